@@ -2,9 +2,8 @@
 #include <stdexcept>
 #include <numeric>
 #include "chords_extractor.hh"
-#include "utils.hh" // for debug_dump
 
-std::vector<chord_t> get_chords(const std::vector<note_t>& notes)
+std::vector<chord_t> get_chords(const std::vector<note_t>& notes, const conversion_context& context)
 {
   // sanity check: precondition notes must be sorted by starting time
   if (not std::is_sorted(notes.cbegin(), notes.cend(), [] (const auto& a, const auto& b) {
@@ -70,7 +69,7 @@ std::vector<chord_t> get_chords(const std::vector<note_t>& notes)
     }
   }
 
-  debug_dump(res, "chords");
+  debug_dump(context, res, "chords");
 
   return res;
 }
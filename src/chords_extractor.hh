@@ -1,7 +1,8 @@
 #pragma once
 
 #include <vector>
+#include "conversion_context.hh"
 #include "utils.hh"
 
 // group notes into chords
-std::vector<chord_t> get_chords(const std::vector<note_t>& notes);
+std::vector<chord_t> get_chords(const std::vector<note_t>& notes, const conversion_context& context);
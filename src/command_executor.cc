@@ -1,4 +1,20 @@
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <iomanip>
+#include <poll.h>
+#include <set>
+#include <signal.h>
+#include <spawn.h>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <vector>
@@ -6,13 +22,24 @@
 #include <fstream>
 #include <unistd.h>
 #include <string.h>
+#include <sstream>
+#include <thread>
 #include "command_executor.hh"
+#include "conversion_cache.hh"
+#include "job_scheduler.hh"
+#include "sha256.hh"
 #include "event_listener.h"
+#include "lilypond_worker.h"
+#include "lilypond_worker_pool.hh"
 #include "open_preloader.h"
 #include "common.h"
 
 #include "svg_extractor.hh"
+#include "svg_pages_extractor.hh"
+#include "parts_splitter.hh"
+#include "progressive_writer.hh"
 #include "notes_file_extractor.hh"
+#include "midi_file_extractor.hh"
 #include "chords_extractor.hh"
 #include "cursor_boxes_extractor.hh"
 #include "keyboard_events_extractor.hh"
@@ -24,6 +51,14 @@
 constexpr const char* const without_skyline_suffix = ".without_skylines";
 constexpr const char* const with_skyline_suffix = ".with_skylines";
 
+// sub directories of the temporary directory, one per lilypond run
+constexpr const char* const notes_pass_dir = "notes_and_staff_num";
+constexpr const char* const svg_with_skylines_pass_dir = "svg_with_skylines";
+constexpr const char* const svg_without_skylines_pass_dir = "svg_without_skylines";
+
+// the runtime directories are named with this prefix and a hash of the embedded files
+constexpr const char* const runtime_directory_prefix = "runtime-";
+
 static
 void copy_buffer_to(const char* buffer, int buf_len, const fs::path& dst_file)
 {
@@ -49,76 +84,111 @@ void copy_open_preloader_to(const fs::path& dst_file)
 }
 
 static
-bool execute_command(const std::vector<std::string>& command,
-		     const std::vector<std::string>& env,
-		     std::ofstream& output_debug_file)
+void copy_lilypond_worker_to(const fs::path& dst_file)
 {
-  const auto nb_param = command.size();
+  copy_buffer_to(reinterpret_cast<const char*>(lilypond_worker_scm), lilypond_worker_scm_len, dst_file);
+}
 
-  if (nb_param == 0)
+namespace
+{
+  // posix_spawn wants arrays of pointers to non-const char terminated by a nullptr. Only the
+  // pointers are copied, the strings stay where they are.
+  struct c_string_array
   {
-    throw std::runtime_error("Error: can't execute an empty command");
-  }
+      explicit c_string_array(const std::vector<std::string>& strings)
+	: _data()
+      {
+	for (const auto& str : strings)
+	{
+	  _data.push_back(const_cast<char*>(str.data())); // TODO: const cast shouldn't be required with C++17
+	}
+	_data.push_back(nullptr);
+      }
 
-  const auto pid = fork();
-  if (pid == -1)
-  {
-    throw std::runtime_error(std::string{"Couldn't launch the ["} + command[0] + "] command");
-  }
+      char** data()
+      {
+	return _data.data();
+      }
+
+    private:
+      std::vector<char*> _data;
+  };
 
-  if (pid == 0)
+  // a command to run along with the variables to add to the environment of the child process
+  struct command_t
   {
+      std::vector<std::string> command_line;
+      std::vector<std::string> env_to_append;
+  };
 
-    // TODO: rework this when compilers will support C++17. std::string::data() returns a pointer to non-const data
-    // in C++17, so one can just pass command[i].data() to execvp instead of creating useless copy
+  struct command_result_t
+  {
+      bool success;
+      std::string output; // what the command wrote on its standard and error outputs
+  };
+}
 
-    struct dummy_to_avoid_vla
-    {
-	struct Deleter
-	{
-	    void operator()(char* data[]) const
-	    {
-	      delete[] data;
-	    }
-	};
+static
+void print_command(std::ostream& stream, const std::vector<std::string>& command)
+{
+  for (const auto& str : command)
+  {
+    stream << " " << str;
+  }
+}
 
-	dummy_to_avoid_vla(const std::vector<std::string>& _command)
-	  : _data(new char*[_command.size() + 1])
-	{
-	  const auto len = _command.size();
-	  for (unsigned int i = 0; i < len; ++i)
-	  {
-	    _data[i] = const_cast<char*>(_command[i].data()); // TODO: const cast shouldn't be required with C++17
-	  }
-	  _data[len] = nullptr;
-	}
+// output_fd, when not -1, becomes the standard output of the command, and its error output as well
+// when with_stderr is set. The command gets our environment, with the variables of env_to_append.
+//
+// posix_spawn doesn't copy the memory of this process as fork does, which is expensive for a process
+// as big as this one, and is a lot faster.
+static
+pid_t start_command(const std::vector<std::string>& command,
+		    const std::vector<std::string>& env_to_append,
+		    int output_fd = -1,
+		    bool with_stderr = false)
+{
+  if (command.empty())
+  {
+    throw std::runtime_error("Error: can't execute an empty command");
+  }
 
-	char** data()
-	{
-	  return _data.get();
-	}
+  c_string_array c_command (command);
+  auto c_env = get_child_environment(env_to_append);
 
-    private:
-	std::unique_ptr<char*[], Deleter> _data;
-    };
+  posix_spawn_file_actions_t file_actions;
+  posix_spawn_file_actions_init(&file_actions);
+  if (output_fd != -1)
+  {
+    // dup2 clears close-on-exec on the new descriptors
+    posix_spawn_file_actions_adddup2(&file_actions, output_fd, STDOUT_FILENO);
+    if (with_stderr)
+    {
+      posix_spawn_file_actions_adddup2(&file_actions, output_fd, STDERR_FILENO);
+    }
+  }
 
-    // child
-    dummy_to_avoid_vla c_command (command);
-    dummy_to_avoid_vla c_env (env);
+  pid_t pid;
+  const auto error = ::posix_spawnp(&pid, c_command.data()[0], &file_actions, nullptr, c_command.data(), c_env.data());
+  posix_spawn_file_actions_destroy(&file_actions);
 
-    ::execvpe(c_command.data()[0], c_command.data(), c_env.data());
-    throw std::runtime_error(std::string{"Failed to execute ["} + command[0] + "] command (" + strerror(errno) + ")");
+  if (error != 0)
+  {
+    throw std::runtime_error(std::string{"Couldn't launch the ["} + command[0] + "] command (" + strerror(error) + ")");
   }
 
-  int status;
-  waitpid(pid, &status, 0);
+  return pid;
+}
 
-  const auto print_command = [] (std::ofstream& stream, const auto& _command) {
-    for (const auto& str : _command)
-    {
-      stream << " " << str;
-    }
-  };
+static
+bool wait_for_command(pid_t pid,
+		      const std::vector<std::string>& command,
+		      std::ostream& output_debug_file)
+{
+  int status;
+  while ((waitpid(pid, &status, 0) == -1) and (errno == EINTR))
+  {
+  }
 
   if (not WIFEXITED(status))
   {
@@ -143,32 +213,228 @@ bool execute_command(const std::vector<std::string>& command,
   return true;
 }
 
-
+// runs the command and gives what it printed on its standard output
 static
-bool execute_command_with_append_to_env(const std::vector<std::string>& command,
-					const std::vector<std::string>& to_append,
-					std::ofstream& output_debug_file)
+std::string get_command_output(const std::vector<std::string>& command,
+			       std::ostream& output_debug_file)
 {
-  std::vector<std::string> env;
+  std::array<int, 2> pipe_fds;
+  if (::pipe2(pipe_fds.data(), O_CLOEXEC) != 0)
+  {
+    throw std::runtime_error(std::string{"Error: failed to create a pipe (" } + strerror(errno) + ")");
+  }
+
+  const auto pid = [&] () {
+    try
+    {
+      return start_command(command, {}, pipe_fds[1]);
+    }
+    catch (...)
+    {
+      ::close(pipe_fds[0]);
+      ::close(pipe_fds[1]);
+      throw;
+    }
+  }();
+  ::close(pipe_fds[1]);
 
-  for (unsigned int i = 0; environ[i] != nullptr; ++i)
+  std::string res;
+  std::array<char, 4096> buffer;
+  ssize_t nb_read;
+  while (((nb_read = ::read(pipe_fds[0], buffer.data(), buffer.size())) > 0) or
+	 ((nb_read == -1) and (errno == EINTR)))
   {
-    env.push_back(environ[i]);
+    if (nb_read > 0)
+    {
+      res.append(buffer.data(), static_cast<size_t>(nb_read));
+    }
   }
+  ::close(pipe_fds[0]);
 
-  for (const auto& str : to_append)
+  if (not wait_for_command(pid, command, output_debug_file))
   {
-    env.push_back(str);
+    throw std::runtime_error(std::string{"Error: failed to execute ["} + command[0] + "]");
   }
 
-  return execute_command(command, env, output_debug_file);
+  return res;
 }
 
+// how often the should_stop of execute_commands and execute_lilypond_runs is called
+constexpr int stop_check_interval_ms = 50;
+
+// runs all the commands, with at most max_concurrent of them at the same time. What they print is
+// written to the log as it comes, line by line, with the time elapsed since the first one started
+// and the index of the command.
+//
+// should_stop, when given, is called regularly. Once it returns true, the running commands are
+// terminated and the ones left are not started. They are reported as failed. on_line, when given,
+// is called with each line a command prints, and the index of the command. on_finished, when given,
+// is called with the index of each command once it exited, and whether it succeeded.
 static
-bool execute_command(const std::vector<std::string>& command,
-		     std::ofstream& output_debug_file)
+std::vector<command_result_t> execute_commands(const std::vector<command_t>& commands,
+					       unsigned int max_concurrent,
+					       std::ostream& output_debug_file,
+					       const std::function<bool()>& should_stop = {},
+					       const std::function<void(size_t, const std::string&)>& on_line = {},
+					       const std::function<void(size_t, bool)>& on_finished = {})
 {
-  return execute_command_with_append_to_env(command, std::vector<std::string>{}, output_debug_file);
+  if (max_concurrent == 0)
+  {
+    throw std::invalid_argument("Error: at least one command must be allowed to run at a time");
+  }
+
+  std::vector<command_result_t> res (commands.size(), command_result_t{ .success = false, .output = {} });
+
+  struct running_command_t
+  {
+      size_t index;
+      pid_t pid;
+      int output_fd;
+      std::string incomplete_line;
+  };
+  std::vector<running_command_t> running;
+
+  const auto start_time = std::chrono::steady_clock::now();
+  const auto log_line = [&] (size_t index, const std::string& line) {
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_time);
+    output_debug_file << "[" << (elapsed.count() / 1000) << "." << std::setfill('0') << std::setw(3)
+		      << (elapsed.count() % 1000) << std::setfill(' ') << "s] [" << index << "] " << line << "\n";
+    res[index].output += line + "\n";
+    if (on_line)
+    {
+      on_line(index, line);
+    }
+  };
+
+  // the output is closed when the command exits, it is then waited for
+  const auto finish = [&] (running_command_t& command) {
+    if (not command.incomplete_line.empty())
+    {
+      log_line(command.index, command.incomplete_line);
+    }
+    ::close(command.output_fd);
+    res[command.index].success = wait_for_command(command.pid, commands[command.index].command_line, output_debug_file);
+  };
+
+  bool stopping = false;
+
+  try
+  {
+    size_t next_command = 0;
+    while (((next_command < commands.size()) and (not stopping)) or (not running.empty()))
+    {
+      if ((not stopping) and should_stop and should_stop())
+      {
+	stopping = true;
+	output_debug_file << "stopping the commands\n";
+	for (const auto& command : running)
+	{
+	  ::kill(command.pid, SIGTERM);
+	}
+      }
+
+      while ((not stopping) and (next_command < commands.size()) and (running.size() < max_concurrent))
+      {
+	std::array<int, 2> pipe_fds;
+	if (::pipe2(pipe_fds.data(), O_CLOEXEC) != 0)
+	{
+	  throw std::runtime_error(std::string{"Error: failed to create a pipe (" } + strerror(errno) + ")");
+	}
+
+	try
+	{
+	  const auto& command = commands[next_command];
+	  const auto pid = start_command(command.command_line, command.env_to_append, pipe_fds[1], true);
+	  running.push_back(running_command_t{ .index = next_command, .pid = pid, .output_fd = pipe_fds[0],
+		                               .incomplete_line = {} });
+	}
+	catch (...)
+	{
+	  ::close(pipe_fds[0]);
+	  ::close(pipe_fds[1]);
+	  throw;
+	}
+	::close(pipe_fds[1]);
+
+	output_debug_file << "[" << next_command << "] started:";
+	print_command(output_debug_file, commands[next_command].command_line);
+	output_debug_file << "\n";
+	++next_command;
+      }
+
+      std::vector<pollfd> poll_fds;
+      for (const auto& command : running)
+      {
+	poll_fds.push_back(pollfd{ .fd = command.output_fd, .events = POLLIN, .revents = 0 });
+      }
+
+      if (poll_fds.empty())
+      {
+	continue;
+      }
+
+      const int timeout_ms = (should_stop and (not stopping)) ? stop_check_interval_ms : -1;
+      if (::poll(poll_fds.data(), poll_fds.size(), timeout_ms) == -1)
+      {
+	if (errno == EINTR)
+	{
+	  continue;
+	}
+	throw std::runtime_error(std::string{"Error: failed to wait for the commands output ("} + strerror(errno) + ")");
+      }
+
+      // walked backwards, so that removing a finished command doesn't move the ones still to look at
+      for (size_t i = poll_fds.size(); i-- > 0; )
+      {
+	if (poll_fds[i].revents == 0)
+	{
+	  continue;
+	}
+
+	auto& command = running[i];
+	std::array<char, 4096> buffer;
+	const auto nb_read = ::read(command.output_fd, buffer.data(), buffer.size());
+	if ((nb_read == -1) and (errno == EINTR))
+	{
+	  continue;
+	}
+
+	if (nb_read <= 0)
+	{
+	  finish(command);
+	  const auto index = command.index;
+	  running.erase(running.begin() + static_cast<long>(i));
+	  if (on_finished)
+	  {
+	    on_finished(index, res[index].success);
+	  }
+	  continue;
+	}
+
+	command.incomplete_line.append(buffer.data(), static_cast<size_t>(nb_read));
+	for (auto end = command.incomplete_line.find('\n'); end != std::string::npos; end = command.incomplete_line.find('\n'))
+	{
+	  log_line(command.index, command.incomplete_line.substr(0, end));
+	  command.incomplete_line.erase(0, end + 1);
+	}
+      }
+    }
+  }
+  catch (...)
+  {
+    // the commands left are terminated rather than waited for, and not left as zombies
+    for (const auto& command : running)
+    {
+      ::kill(command.pid, SIGTERM);
+    }
+    for (auto& command : running)
+    {
+      finish(command);
+    }
+    throw;
+  }
+
+  return res;
 }
 
 static
@@ -204,305 +470,2300 @@ fs::path get_directory_of_file(const fs::path& filepath)
 }
 
 static
-std::tuple<fs::path, fs::path> generate_note_and_staff_num_files(const std::string& lilypond_command,
-								 const fs::path& input_lily_file,
-								 const fs::path& output_tmp_directory,
-								 std::ofstream& output_debug_file)
+fs::path get_note_and_staff_num_file(const fs::path& input_lily_file,
+				     const fs::path& pass_directory,
+				     const char* extension)
 {
-  // must run lilypond with force unfold repeat
-  const std::string event_listener_filename = "event-listener.scm";
-  const fs::path out_listener_file = output_tmp_directory / event_listener_filename;
-  const fs::path out_preloader_file = output_tmp_directory / "open_preloader.so";
-  const fs::path out_patched_file = output_tmp_directory / PATCHED_FILE_NAME;
-
-  const fs::path lily_filename = input_lily_file.filename();
-  const fs::path input_lily_dir = get_directory_of_file(input_lily_file);
-  const auto out_lily_with_ext = [&] (const char* extension) {
-    auto res = output_tmp_directory / lily_filename;
-    res.replace_extension(extension);
-    return res;
-  };
+  auto res = pass_directory / input_lily_file.filename();
+  res.replace_extension(extension);
+  return res;
+}
 
-  const fs::path out_note_file = out_lily_with_ext(".notes");
-  const fs::path out_staff_num_file = out_lily_with_ext(".sn2in");
-
-  copy_event_listener_to(out_listener_file);
-  copy_open_preloader_to(out_preloader_file);
-
-  // remove note and staff_num file if they already exists, and then create an empty one.  Removing them first
-  // is necessary to avoid working on "polluted" data. Creating them right after is a workaround to avoid the
-  // event listener to do it itself. It has been noted that the guile part can fail in some weird way when
-  // creating these, by e.g. setting the permissions for the sn2in file to 100 (--x------). Consequence being
-  // then the program can't read the file back.
-  const auto create_out_file = [&] (const auto& path) {
-    std::error_code dummy_ec;
-    fs::remove(path, dummy_ec); // remove file if it exists
-    std::ofstream(path.c_str()); // create file
-    fs::permissions(path, fs::perms::owner_read | fs::perms::owner_write);
-  };
-  create_out_file(out_note_file);
-  create_out_file(out_staff_num_file);
-
-  const auto log_file = (output_tmp_directory / "notes_and_staff_num_generation");
-
-  const std::vector<std::string> command_line {
-    { lilypond_command,
-	std::string{"-dlog-file=\""} + log_file.string() + "\"",
-	std::string{"--include="} + input_lily_dir.c_str(),
-	"-dno-point-and-click",
-	std::string{"--output="} + output_tmp_directory.c_str(),
-	"--evaluate=(ly:add-option 'note-file-output #f  \"Output for the note file. Default is filename with .notes extension instead of .ly\")",
-	std::string{"--evaluate=(ly:set-option 'note-file-output \""} + out_note_file.c_str() + "\")",
-	"--evaluate=(ly:add-option 'instrument-name-file-output #f  \"Output for the staff-number-to-instrument-name-table file. Default is filename with .sn2in extension instead of .ly\")",
-	std::string{"--evaluate=(ly:set-option 'instrument-name-file-output \""} + out_staff_num_file.c_str() + "\")",
-	std::string{"-dinclude-settings=\""} + out_listener_file.c_str() + "\"",
-	"-dbackend=null",
-	input_lily_file.c_str() } };
-
-
-  const std::vector<std::string> env { { std::string{"LD_PRELOAD="} + out_preloader_file.c_str() },
-					 std::string{DUMP_OUTPUT_DIR} + "=" + output_tmp_directory.c_str() };
-  const auto ret = execute_command_with_append_to_env(command_line, env, output_debug_file);
+// remove note and staff_num file if they already exists, and then create an empty one.  Removing them first
+// is necessary to avoid working on "polluted" data. Creating them right after is a workaround to avoid the
+// event listener to do it itself. It has been noted that the guile part can fail in some weird way when
+// creating these, by e.g. setting the permissions for the sn2in file to 100 (--x------). Consequence being
+// then the program can't read the file back.
+static
+void create_empty_output_file(const fs::path& path)
+{
+  std::error_code dummy_ec;
+  fs::remove(path, dummy_ec); // remove file if it exists
+  std::ofstream(path.c_str()); // create file
+  fs::permissions(path, fs::perms::owner_read | fs::perms::owner_write);
+}
 
-  const auto get_error_message = [&] () {
-    auto real_log_file = log_file;
-    real_log_file.replace_extension(".log");
-    return std::string{"Failed to create the notes and staff-num-to-instrument name files.\n"
-		       "Below is the content of the command log file:\n"}
-                      + get_file_content(real_log_file, "  ");
+// lilypond names its outputs after the input file: <name>.svg, <name>-page-2.svg, <name>.midi ...
+static
+bool is_output_of(const fs::path& output_file, const fs::path& input_lily_file)
+{
+  const auto name = output_file.filename().string();
+  const auto prefix = input_lily_file.stem().string();
+  return (name.compare(0, prefix.size(), prefix) == 0) and (name.size() > prefix.size()) and
+         ((name[prefix.size()] == '.') or (name[prefix.size()] == '-'));
+}
+
+bool can_share_lilypond_run(const fs::path& input_lily_file_a, const fs::path& input_lily_file_b)
+{
+  // included files are looked for in the directory of the input files, so all of them must be in the
+  // same one. Then the outputs of one file must not look like the outputs of the other one.
+  auto file_a = input_lily_file_a.stem();
+  auto file_b = input_lily_file_b.stem();
+  file_a += ".ly";
+  file_b += ".ly";
+  return (get_directory_of_file(input_lily_file_a) == get_directory_of_file(input_lily_file_b)) and
+         (not is_output_of(file_a, input_lily_file_b)) and (not is_output_of(file_b, input_lily_file_a));
+}
+
+// the command line of a run: the common options, the ones of the run and then the input files. All
+// the input files are processed by the same lilypond process, which saves loading guile, the init
+// files and the fonts once per file. runtime_directory is where lilypond keeps its caches, see
+// prepare_runtime_directory.
+static
+command_t get_lilypond_command(const std::string& lilypond_command,
+			       const lilypond_run_t& run,
+			       unsigned int lilypond_job_count,
+			       const fs::path& runtime_directory)
+{
+  command_t res{
+    .command_line = {
+      lilypond_command,
+      std::string{"--include="} + run.include_directory.c_str(),
+      "-dno-point-and-click",
+      std::string{"--output="} + run.output_directory.c_str() },
+    .env_to_append = {},
   };
 
-  if (not ret)
+  auto& command_line = res.command_line;
+
+  // lilypond can also split the files between several processes it forks itself
+  if ((lilypond_job_count > 1) and (run.input_files.size() > 1))
   {
-    throw std::runtime_error(get_error_message());
+    command_line.emplace_back("-djob-count=" + std::to_string(lilypond_job_count));
   }
 
-  const auto is_file_ok = [&] (const auto& file) {
-    if ((not fs::exists(file)) or (not is_regular_file(file)) or fs::is_empty(file))
+  for (const auto& option : run.options)
+  {
+    if (option.description.empty())
     {
-      output_debug_file << "  Failed to create [" << file.c_str() << "]\n";
-      return false;
+      command_line.emplace_back("-d" + option.name + "=" + option.value);
     }
     else
     {
-      output_debug_file << "  Detected expected output file [" << file.c_str() << "]\n";
-      return true;
+      command_line.emplace_back("--evaluate=(ly:add-option '" + option.name + " #f " + to_scheme_string(option.description) + ")");
+      command_line.emplace_back("--evaluate=(ly:set-option '" + option.name + " " + option.value + ")");
     }
-  };
-
-  const bool has_error = [&](){
-    const auto note_ok = is_file_ok(out_note_file);
-    const auto staff_ok = is_file_ok(out_staff_num_file);
-    const auto patched_ok = is_file_ok(out_patched_file);
-    return not (note_ok and staff_ok and patched_ok);
-  }();
-
-  output_debug_file << "\n";
+  }
 
-  if (has_error)
+  for (const auto& input_lily_file : run.input_files)
   {
-    throw std::runtime_error(get_error_message());
+    command_line.emplace_back(input_lily_file.c_str());
   }
 
+  res.env_to_append = get_cache_environment(runtime_directory, not run.preloader_file.empty());
+  if (not run.preloader_file.empty())
+  {
+    res.env_to_append.insert(res.env_to_append.end(), {
+	std::string{"LD_PRELOAD="} + run.preloader_file.c_str(),
+	std::string{DUMP_OUTPUT_DIR} + "=" + run.output_directory.c_str() });
+  }
 
-  return std::make_tuple(out_note_file, out_staff_num_file);
+  return res;
 }
 
-static
-std::vector<fs::path> generate_svg_files(const std::vector<std::string>& command_line,
-					 const fs::path& output_tmp_directory,
-					 std::ofstream& output_debug_file,
-					 bool with_skyline)
+namespace
 {
-
-  const auto ret = execute_command(command_line, output_debug_file);
-  if (not ret)
+  // an error lilypond printed, e.g. "/path/to/file.ly:12:5: error: unknown escaped string"
+  struct lilypond_error_t
   {
-    throw std::runtime_error(std::string{"Failed to create the SVGs files (with"} +
-			     (with_skyline ? "" : "out") + " skylines)");
-  }
-
+      std::string file; // empty when lilypond didn't tell where the error is
+      unsigned int line; // 0 when lilypond didn't tell
+      unsigned int column;
+      std::string message;
+  };
 
-  std::vector<fs::path> svg_files;
-  for (const auto& file : fs::directory_iterator(output_tmp_directory))
+  // a lilypond run stopped on an error of the input file
+  class lilypond_failure : public std::runtime_error
   {
-    const auto& path = file.path();
-
-    if (fs::is_regular_file(path) and (path.extension() == ".svg"))
-    {
-      svg_files.push_back(file);
-    }
-  }
+    public:
+      explicit lilypond_failure(const lilypond_error_t& error)
+	: std::runtime_error(get_message(error))
+	, _file(error.file)
+      {
+      }
 
-  const auto nb_svgs = svg_files.size();
-  if (nb_svgs == 0)
-  {
-    throw std::runtime_error(std::string{"Error: no SVGs files (the ones with"} +
-			     (with_skyline ? "" : "out") + " skylines) were created in the temporary directory");
-  }
+      // where the error is. Empty when lilypond didn't tell.
+      const std::string& file() const { return _file; }
 
-  std::sort(std::begin(svg_files), std::end(svg_files), [] (const auto& a, const auto& b) {
-      const auto get_page_number = [] (const auto& elt) {
-	const auto path = elt.string();
-	const std::string page_str = "-page-";
-	const auto page_pos = path.rfind(page_str);
-	if (page_pos == std::string::npos)
+    private:
+      static std::string get_message(const lilypond_error_t& error)
+      {
+	if (error.file.empty())
 	{
-	  return 1; // couldn't find the string "-page-" in filename means lilypond generated only one file,
-		    // so page number 1
+	  return "Error: lilypond failed: " + error.message;
 	}
 
-	const auto page_num_pos = page_pos + page_str.length();
-	return std::stoi(path.substr(page_num_pos));
-      };
-
-      return get_page_number(a) < get_page_number(b);
-    });
-
-  output_debug_file << "Found " << nb_svgs << " svgs files with" << (with_skyline ? "" : "out") << " skylines:\n";
+	const auto location = (error.line == 0) ? error.file :
+	  (error.file + ", line " + std::to_string(error.line) + ", column " + std::to_string(error.column));
+	return "Error: lilypond failed on " + location + ": " + error.message;
+      }
 
-  const auto suffix = (with_skyline ? with_skyline_suffix : without_skyline_suffix);
+      std::string _file;
+  };
+}
 
-  for (auto& svg_file : svg_files)
+// gives the number at the end of str, and removes it with the ':' before it. Returns false when str
+// doesn't end this way.
+static
+bool pop_location_number(std::string& str, unsigned int& number)
+{
+  const auto separator = str.rfind(':');
+  if ((separator == std::string::npos) or (separator + 1 == str.size()) or
+      (str.find_first_not_of("0123456789", separator + 1) != std::string::npos))
   {
-    const auto new_name = [&] (const auto& file_name) {
-      auto res = file_name;
-      res += suffix;
-      return res;
-    }(svg_file);
-
-    fs::rename(svg_file, new_name);
-    output_debug_file << "  " << new_name << "\n";
-    svg_file = new_name;
+    return false;
   }
 
-  output_debug_file << "\n";
-
-  return svg_files;
+  number = static_cast<unsigned int>(std::stoul(str.substr(separator + 1)));
+  str.erase(separator);
+  return true;
 }
 
+// whether the line lilypond printed is an error, as "file:line:column: error: message" or
+// "error: message". Warnings and programming errors don't make lilypond fail.
 static
-std::vector<fs::path> generate_svg_files_without_skylines(const std::string& lilypond_command,
-							  const fs::path& input_lily_file,
-							  const fs::path& output_tmp_directory,
-							  std::ofstream& output_debug_file)
+bool parse_lilypond_error(const std::string& line, lilypond_error_t& error)
 {
-  const fs::path input_lily_dir = get_directory_of_file(input_lily_file);
-  const std::vector<std::string> command_line {
-    { lilypond_command,
-      std::string{"-dlog-file=\""} + (output_tmp_directory / std::string{"svg_without_skylines_generation"}).c_str() + "\"",
-      std::string{"--include="} + input_lily_dir.c_str(),
-      "-dno-point-and-click",
-      std::string{"--output="} + output_tmp_directory.c_str(),
-      "-dbackend=svg",
-      input_lily_file.c_str(),
+  for (const std::string marker : { "fatal error: ", "error: " })
+  {
+    if (line.compare(0, marker.size(), marker) == 0)
+    {
+      error = lilypond_error_t{ .file = {}, .line = 0, .column = 0, .message = line.substr(marker.size()) };
+      return true;
     }
-  };
 
-  return generate_svg_files(command_line, output_tmp_directory, output_debug_file, false);
+    const auto pos = line.find(": " + marker);
+    if (pos != std::string::npos)
+    {
+      error = lilypond_error_t{ .file = line.substr(0, pos), .line = 0, .column = 0,
+				.message = line.substr(pos + 2 + marker.size()) };
+
+      unsigned int column;
+      unsigned int line_number;
+      auto file = error.file;
+      if (pop_location_number(file, column) and pop_location_number(file, line_number))
+      {
+	error.file = file;
+	error.line = line_number;
+	error.column = column;
+      }
+      return true;
+    }
+  }
+
+  return false;
 }
 
+// gives the lines added to a file since offset, and moves offset past them. The last line is only
+// given once it is complete, or once the file is.
 static
-std::vector<fs::path> generate_svg_files_with_skylines(const std::string& lilypond_command,
-						       const fs::path& input_lily_file,
-						       const fs::path& output_tmp_directory,
-						       std::ofstream& output_debug_file)
+std::vector<std::string> read_new_lines(const fs::path& filename, std::streamoff& offset, bool is_file_complete)
 {
+  std::ifstream file (filename, std::ios::in | std::ios::binary);
+  if (not file.is_open())
+  {
+    return {};
+  }
 
-  const std::string event_listener_filename = "event-listener.scm";
-  const auto dst_event_listener_file = output_tmp_directory / event_listener_filename;
-
-  copy_event_listener_to(dst_event_listener_file);
-
-  const fs::path input_lily_dir = get_directory_of_file(input_lily_file);
-  const std::vector<std::string> command_line {
-    { lilypond_command,
-      std::string{"-dlog-file=\""} + (output_tmp_directory / std::string{"svg_with_skylines_generation"}).c_str() + "\"",
-      std::string{"--include="} + input_lily_dir.c_str(),
-      "-dno-point-and-click",
-      std::string{"--output="} + output_tmp_directory.c_str(),
-	"--evaluate=(ly:add-option 'disable-notes-output #f \"prevent the generation of the notes file.\")",
-	"--evaluate=(ly:set-option 'disable-notes-output #t)",
-	"--evaluate=(ly:add-option 'disable-table-output #f \"prevent the generation of the instrument file.\")",
-	"--evaluate=(ly:set-option 'disable-table-output #t)",
-
-      std::string{"-dinclude-settings="} + dst_event_listener_file.c_str(),
-      "-dbackend=svg",
-      input_lily_file.c_str() } };
-
-  return generate_svg_files(command_line, output_tmp_directory, output_debug_file, true);
-}
-
-
-void generate_bin_file(const std::string& lilypond_command,
-		       const fs::path& input_lily_file,
-		       const fs::path& output_bin_file,
-		       const fs::path& output_tmp_directory,
-		       std::ofstream& output_debug_file)
-{
-  fs::copy_file(input_lily_file, output_tmp_directory / input_lily_file.filename());
-
-  // TODO C++17 rewrite the following as
-  //   const auto [notes_file, staffs_num_file] = generate_note_and_staff_num_files(lilypond_command, input_lily_file,
-  //									       output_tmp_directory, output_debug_file);
-  // when compilers will properly support C++17
-  const auto pair = generate_note_and_staff_num_files(lilypond_command, input_lily_file,
-						      output_tmp_directory, output_debug_file);
-  const auto notes_file = std::get<0>(pair);
-  const auto staffs_num_file = std::get<1>(pair);
-
-  const auto svgs_with_skylines = generate_svg_files_with_skylines(lilypond_command,
-								   input_lily_file,
-								   output_tmp_directory,
-								   output_debug_file);
-
-  const auto svgs_without_skylines = generate_svg_files_without_skylines(lilypond_command,
-									 input_lily_file,
-									 output_tmp_directory,
-									 output_debug_file);
+  file.seekg(offset);
+  const std::string content { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
 
-  // safety check: there should be the same number of images with and without skylines
-  const auto nb_svgs = svgs_with_skylines.size();
-  const auto nb_svgs_without_skylines = svgs_without_skylines.size();
-  if (nb_svgs != nb_svgs_without_skylines)
+  std::vector<std::string> res;
+  size_t begin = 0;
+  for (auto end = content.find('\n'); end != std::string::npos; end = content.find('\n', begin))
   {
-    throw std::runtime_error(std::string{"Number of svg files with skylines and without mismatch.\n"
-	  "  There are "} + std::to_string(nb_svgs) + " svgs with skylines but " +
-      std::to_string(nb_svgs_without_skylines) + "without.\n");
+    res.push_back(content.substr(begin, end - begin));
+    begin = end + 1;
   }
 
-  // safety check: they should have the same names (except the suffix)
-  for (unsigned int i = 0; i < nb_svgs; ++i)
+  if (is_file_complete and (begin < content.size()))
   {
-    const auto name_without = svgs_without_skylines[i];
-    const auto name_with = svgs_with_skylines[i];
-    if (name_without.stem() != name_with.stem())
-    {
-      throw std::runtime_error(std::string{"SVG filename mismatch detected.\n"
-	    "  One file is named ["} + name_without.string() +"]\n  and the associated one with skyline is ["
-	+ name_with.string() + "]\n");
-    }
+    res.push_back(content.substr(begin));
+    begin = content.size();
   }
 
-  const auto unprocessed_notes = get_unprocessed_notes(notes_file);
-  const auto notes = get_processed_notes(unprocessed_notes);
-  const auto staffs_to_instrument = get_staff_instr_mapping(staffs_num_file, output_debug_file);
+  offset += static_cast<std::streamoff>(begin);
+  return res;
+}
 
-  std::vector<svg_file_t> sheets;
-  for (const auto& filename : svgs_with_skylines)
+// the error of a run which failed without lilypond printing an error
+static
+std::runtime_error get_run_failure(const lilypond_run_t& run, const command_result_t& result)
+{
+  std::string message = "Error: lilypond failed on";
+  for (const auto& input_file : run.input_files)
   {
-    sheets.emplace_back(get_svg_data(filename, output_debug_file));
+    message += " " + input_file.string();
   }
+  message += ".\nBelow is what lilypond printed:\n";
 
-  const auto keyboard_events = get_key_events(notes);
-  const auto chords = get_chords(notes);
-  const auto cursor_boxes = get_cursor_boxes(chords, sheets, unprocessed_notes);
-  const auto bar_num_events = get_bar_num_events(cursor_boxes);
+  std::istringstream output (result.output);
+  for (std::string line; std::getline(output, line); )
+  {
+    message += "  " + line + "\n";
+  }
+  return std::runtime_error(message);
+}
 
-  save_to_file(output_bin_file,
-	       keyboard_events,
-	       cursor_boxes,
-	       bar_num_events,
-	       staffs_to_instrument,
-	       svgs_without_skylines);
+// runs lilypond for each of the runs, with at most max_concurrent_passes of them at the same time.
+// res[i] tells whether runs[i] succeeded, and what lilypond printed. The runs are stopped once
+// should_stop returns true: the processes and the busy workers are terminated, and the runs not
+// started yet are dropped. They are all reported as failed.
+//
+// lilypond goes on after an error to report the following ones, but the run fails anyway. The first
+// error lilypond prints stops all the runs, and is thrown as a lilypond_failure. A run failing
+// without one stops them as well, and what lilypond printed is thrown as a std::runtime_error.
+//
+// on_run_finished, when given, is called with the index of each run once it is done, and whether it
+// succeeded. It can be called from another thread.
+static
+std::vector<command_result_t> execute_lilypond_runs(const std::string& lilypond_command,
+					const std::vector<lilypond_run_t>& runs,
+					const conversion_options& options,
+					std::ostream& output_debug_file,
+					const std::function<bool()>& should_stop,
+					const std::function<void(size_t, bool)>& on_run_finished)
+{
+  // with the workers, the runs are sent by several threads. This guards what they share.
+  std::mutex mutex;
+  std::atomic<bool> stopping { false };
+
+  std::unique_ptr<lilypond_error_t> first_error;
+  const auto look_for_error = [&] (const std::string& line) {
+    auto error = lilypond_error_t{ .file = {}, .line = 0, .column = 0, .message = {} };
+    if (parse_lilypond_error(line, error))
+    {
+      const std::lock_guard<std::mutex> lock (mutex);
+      if (first_error == nullptr)
+      {
+	output_debug_file << "stopping on the first lilypond error: " << line << "\n";
+	first_error = std::make_unique<lilypond_error_t>(std::move(error));
+	stopping = true;
+      }
+    }
+  };
+
+  // the first run which failed on its own, not because the runs were stopped
+  auto failed_run = runs.size();
+  const auto on_finished = [&] (size_t run, bool success) {
+    if ((not success) and (not stopping))
+    {
+      const std::lock_guard<std::mutex> lock (mutex);
+      if (failed_run == runs.size())
+      {
+	output_debug_file << "stopping on the failure of run " << run << "\n";
+	failed_run = run;
+	stopping = true;
+      }
+    }
+
+    if (on_run_finished)
+    {
+      on_run_finished(run, success);
+    }
+  };
+
+  const auto check_should_stop = [&] () {
+    if ((not stopping) and should_stop and should_stop())
+    {
+      stopping = true;
+    }
+    return stopping.load();
+  };
+
+  const auto throw_first_failure = [&] (const std::vector<command_result_t>& res) {
+    if (first_error != nullptr)
+    {
+      throw lilypond_failure(*first_error);
+    }
+    if (failed_run != runs.size())
+    {
+      throw get_run_failure(runs[failed_run], res[failed_run]);
+    }
+  };
+
+  if (options.worker_pool == nullptr)
+  {
+    std::vector<command_t> commands;
+    for (const auto& run : runs)
+    {
+      commands.emplace_back(get_lilypond_command(lilypond_command, run, options.lilypond_job_count,
+						 options.runtime_directory));
+    }
+
+    const auto res = execute_commands(commands, options.max_concurrent_passes, output_debug_file, check_should_stop,
+      [&] (size_t, const std::string& line) {
+	look_for_error(line);
+      },
+      on_finished);
+
+    throw_first_failure(res);
+    return res;
+  }
+
+  // the workers are already started, the runs only have to be sent to them, by as many threads as
+  // there can be runs at the same time. The log stream is not thread safe, so each run logs in its
+  // own buffer. The workers write what lilypond prints in the log file of the run, which is read as
+  // it grows to stop on the first error.
+  std::vector<command_result_t> res (runs.size(), command_result_t{ .success = false, .output = {} });
+  std::vector<std::ostringstream> logs (runs.size());
+  size_t next_run = 0;
+  size_t nb_sending_threads = std::min<size_t>(options.max_concurrent_passes, runs.size());
+  std::condition_variable all_sent;
+
+  const auto send_runs = [&] () {
+    for (;;)
+    {
+      size_t i = 0;
+      {
+	const std::lock_guard<std::mutex> lock (mutex);
+	if (stopping or (next_run == runs.size()))
+	{
+	  --nb_sending_threads;
+	  all_sent.notify_one();
+	  return;
+	}
+	i = next_run++;
+      }
+
+      auto log_file = runs[i].log_file;
+      log_file += ".log";
+      std::error_code error;
+      fs::remove(log_file, error); // what a former conversion printed there must not stop this one
+
+      std::streamoff log_offset = 0;
+      const auto success = options.worker_pool->run(runs[i], logs[i], [&] () {
+	  for (const auto& line : read_new_lines(log_file, log_offset, false))
+	  {
+	    look_for_error(line);
+	  }
+	  return stopping.load();
+	});
+
+      for (const auto& line : read_new_lines(log_file, log_offset, true))
+      {
+	look_for_error(line);
+      }
+      res[i] = command_result_t{ .success = success, .output = get_file_content(log_file, "") };
+      on_finished(i, success);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < nb_sending_threads; ++i)
+  {
+    threads.emplace_back(send_runs);
+  }
+
+  // should_stop is only called from this thread, as when the runs are processes
+  {
+    std::unique_lock<std::mutex> lock (mutex);
+    while (not all_sent.wait_for(lock, std::chrono::milliseconds(stop_check_interval_ms), [&] () {
+	  return nb_sending_threads == 0;
+	}))
+    {
+      lock.unlock();
+      check_should_stop();
+      lock.lock();
+    }
+  }
+
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  for (const auto& log : logs)
+  {
+    output_debug_file << log.str();
+  }
+
+  throw_first_failure(res);
+  return res;
+}
+
+// the event listener writes a notes and a staff-num-to-instrument file per input file in the given
+// directory, named after the input file.
+static
+std::vector<lilypond_option_t> get_listener_output_options(const std::vector<fs::path>& input_lily_files,
+							   const fs::path& pass_directory)
+{
+  for (const auto& input_lily_file : input_lily_files)
+  {
+    create_empty_output_file(get_note_and_staff_num_file(input_lily_file, pass_directory, ".notes"));
+    create_empty_output_file(get_note_and_staff_num_file(input_lily_file, pass_directory, ".sn2in"));
+  }
+
+  return {
+    lilypond_option_t{ .name = "listener-output-dir",
+		       .value = to_scheme_string(pass_directory.string()),
+		       .description = "Directory for the note and staff-number-to-instrument-name-table files, named after each input file" } };
+}
+
+static
+lilypond_run_t get_note_and_staff_num_run(const std::vector<fs::path>& input_lily_files,
+					  const fs::path& include_directory,
+					  const fs::path& listener_file,
+					  const fs::path& preloader_file,
+					  const fs::path& pass_directory,
+					  const fs::path& log_file)
+{
+  // must run lilypond with force unfold repeat
+  lilypond_run_t res{
+    .input_files = input_lily_files,
+    .include_directory = include_directory,
+    .output_directory = pass_directory,
+    .log_file = log_file,
+    .options = get_listener_output_options(input_lily_files, pass_directory),
+    .preloader_file = preloader_file,
+  };
+
+  res.options.insert(res.options.end(), {
+      lilypond_option_t{ .name = "include-settings", .value = to_scheme_string(listener_file.string()), .description = {} },
+      lilypond_option_t{ .name = "backend", .value = "null", .description = {} } });
+
+  return res;
+}
+
+static
+std::tuple<fs::path, fs::path> check_note_and_staff_num_files(const command_result_t& command_result,
+							      const fs::path& input_lily_file,
+							      const fs::path& pass_directory,
+							      bool with_patched_file,
+							      std::ostream& output_debug_file)
+{
+  const fs::path out_note_file = get_note_and_staff_num_file(input_lily_file, pass_directory, ".notes");
+  const fs::path out_staff_num_file = get_note_and_staff_num_file(input_lily_file, pass_directory, ".sn2in");
+  const fs::path out_patched_file = pass_directory / PATCHED_FILE_NAME;
+
+  const auto get_error_message = [&] () {
+    std::string res = "Failed to create the notes and staff-num-to-instrument name files.\n"
+                      "Below is what lilypond printed:\n";
+    std::istringstream output (command_result.output);
+    for (std::string line; std::getline(output, line); )
+    {
+      res += "  " + line + "\n";
+    }
+    return res;
+  };
+
+  if (not command_result.success)
+  {
+    throw std::runtime_error(get_error_message());
+  }
+
+  const auto is_file_ok = [&] (const auto& file) {
+    if ((not fs::exists(file)) or (not is_regular_file(file)) or fs::is_empty(file))
+    {
+      output_debug_file << "  Failed to create [" << file.c_str() << "]\n";
+      return false;
+    }
+    else
+    {
+      output_debug_file << "  Detected expected output file [" << file.c_str() << "]\n";
+      return true;
+    }
+  };
+
+  const bool has_error = [&](){
+    const auto note_ok = is_file_ok(out_note_file);
+    const auto staff_ok = is_file_ok(out_staff_num_file);
+    // the patched file only exists when lilypond ran with the open preloader
+    const auto patched_ok = (not with_patched_file) or is_file_ok(out_patched_file);
+    return not (note_ok and staff_ok and patched_ok);
+  }();
+
+  output_debug_file << "\n";
+
+  if (has_error)
+  {
+    throw std::runtime_error(get_error_message());
+  }
+
+
+  return std::make_tuple(out_note_file, out_staff_num_file);
+}
+
+// lilypond names the pages <name>-page-<number>.svg, or <name>.svg when there is only one
+static
+unsigned int get_page_number(const fs::path& svg_file)
+{
+  const auto path = svg_file.string();
+  const std::string page_str = "-page-";
+  const auto page_pos = path.rfind(page_str);
+  if (page_pos == std::string::npos)
+  {
+    return 1; // couldn't find the string "-page-" in filename means lilypond generated only one file,
+	      // so page number 1
+  }
+
+  const auto page_num_pos = page_pos + page_str.length();
+  return static_cast<unsigned int>(std::stoul(path.substr(page_num_pos)));
+}
+
+static
+void sort_by_page_number(std::vector<fs::path>& svg_files)
+{
+  std::sort(std::begin(svg_files), std::end(svg_files), [] (const auto& a, const auto& b) {
+      return get_page_number(a) < get_page_number(b);
+    });
+}
+
+// pass_directory must be used only by the command which generated the svgs. Any svg file found there
+// named after the input file is considered to be a page of its music sheet.
+static
+std::vector<fs::path> get_svg_files(bool command_succeeded,
+				    const fs::path& input_lily_file,
+				    const fs::path& pass_directory,
+				    std::ostream& output_debug_file,
+				    bool with_skyline)
+{
+  if (not command_succeeded)
+  {
+    throw std::runtime_error(std::string{"Failed to create the SVGs files (with"} +
+			     (with_skyline ? "" : "out") + " skylines)");
+  }
+
+
+  std::vector<fs::path> svg_files;
+  for (const auto& file : fs::directory_iterator(pass_directory))
+  {
+    const auto& path = file.path();
+
+    if (fs::is_regular_file(path) and (path.extension() == ".svg") and is_output_of(path, input_lily_file))
+    {
+      svg_files.push_back(file);
+    }
+  }
+
+  const auto nb_svgs = svg_files.size();
+  if (nb_svgs == 0)
+  {
+    throw std::runtime_error(std::string{"Error: no SVGs files (the ones with"} +
+			     (with_skyline ? "" : "out") + " skylines) were created in the directory " +
+			     pass_directory.string());
+  }
+
+  sort_by_page_number(svg_files);
+
+  output_debug_file << "Found " << nb_svgs << " svgs files with" << (with_skyline ? "" : "out") << " skylines:\n";
+
+  const auto suffix = (with_skyline ? with_skyline_suffix : without_skyline_suffix);
+
+  for (auto& svg_file : svg_files)
+  {
+    const auto new_name = [&] (const auto& file_name) {
+      auto res = file_name;
+      res += suffix;
+      return res;
+    }(svg_file);
+
+    fs::rename(svg_file, new_name);
+    output_debug_file << "  " << new_name << "\n";
+    svg_file = new_name;
+  }
+
+  output_debug_file << "\n";
+
+  return svg_files;
+}
+
+// the pages of the music sheet of input_lily_file, among the ones extracted while lilypond was
+// running, sorted by page number. They are taken out of pages.
+static
+std::vector<svg_file_t> take_pages_of(const fs::path& input_lily_file,
+				      std::map<fs::path, svg_file_t>& pages,
+				      const fs::path& pass_directory,
+				      std::ostream& output_debug_file)
+{
+  std::vector<fs::path> svg_files;
+  for (const auto& page : pages)
+  {
+    if (is_output_of(page.first, input_lily_file))
+    {
+      svg_files.push_back(page.first);
+    }
+  }
+
+  if (svg_files.empty())
+  {
+    throw std::runtime_error(std::string{"Error: no SVGs files (the ones with skylines) were created in the directory "} +
+			     pass_directory.string());
+  }
+
+  sort_by_page_number(svg_files);
+
+  output_debug_file << "Found " << svg_files.size() << " svgs files with skylines:\n";
+
+  std::vector<svg_file_t> res;
+  for (const auto& svg_file : svg_files)
+  {
+    output_debug_file << "  " << svg_file << "\n";
+    const auto page = pages.find(svg_file);
+    res.emplace_back(std::move(page->second));
+    pages.erase(page);
+  }
+
+  output_debug_file << "\n";
+
+  return res;
+}
+
+static
+lilypond_run_t get_svg_without_skylines_run(const std::vector<fs::path>& input_lily_files,
+					    const fs::path& include_directory,
+					    const fs::path& pass_directory,
+					    const fs::path& log_file)
+{
+  return lilypond_run_t{
+    .input_files = input_lily_files,
+    .include_directory = include_directory,
+    .output_directory = pass_directory,
+    .log_file = log_file,
+    .options = { lilypond_option_t{ .name = "backend", .value = "svg", .description = {} } },
+    .preloader_file = {},
+  };
+}
+
+static
+lilypond_run_t get_svg_with_skylines_run(const std::vector<fs::path>& input_lily_files,
+					 const fs::path& include_directory,
+					 const fs::path& listener_file,
+					 const fs::path& pass_directory,
+					 const fs::path& log_file,
+					 bool with_notes_output,
+					 bool with_midi_output,
+					 const bar_range_t& bars)
+{
+  lilypond_run_t res{
+    .input_files = input_lily_files,
+    .include_directory = include_directory,
+    .output_directory = pass_directory,
+    .log_file = log_file,
+    .options = {},
+    .preloader_file = {},
+  };
+
+  auto& options = res.options;
+  if (with_notes_output)
+  {
+    // the notes file of this pass has the repeats folded. It is only used for the ids of the notes,
+    // the timings come from the midi file or the notes pass, which have them unfolded.
+    options = get_listener_output_options(input_lily_files, pass_directory);
+  }
+  else
+  {
+    options.insert(options.end(), {
+	lilypond_option_t{ .name = "disable-notes-output", .value = "#t",
+			   .description = "prevent the generation of the notes file." },
+	lilypond_option_t{ .name = "disable-table-output", .value = "#t",
+			   .description = "prevent the generation of the instrument file." } });
+  }
+
+  if (with_midi_output)
+  {
+    options.push_back(lilypond_option_t{ .name = "unfolded-midi-output", .value = "#t",
+					 .description = "also output every score as midi, with its repeats unfolded." });
+  }
+
+  // the other bars are not typeset, see event-listener.scm
+  if (bars.last != 0)
+  {
+    options.insert(options.end(), {
+	lilypond_option_t{ .name = "engraved-first-bar", .value = std::to_string(static_cast<unsigned int>(bars.first)),
+			   .description = "first bar engraved, the ones before are skipped." },
+	lilypond_option_t{ .name = "engraved-last-bar", .value = std::to_string(static_cast<unsigned int>(bars.last)),
+			   .description = "last bar engraved, the ones after are skipped." } });
+  }
+
+  options.insert(options.end(), {
+      lilypond_option_t{ .name = "include-settings", .value = to_scheme_string(listener_file.string()), .description = {} },
+      lilypond_option_t{ .name = "backend", .value = "svg", .description = {} } });
+
+  return res;
+}
+
+// writes the settings of the svg run of a layout variant: the event listener, then the variant's
+// paper file, both included before the music sheet
+static
+fs::path write_layout_settings(const fs::path& listener_file, const layout_variant_t& layout, const fs::path& directory)
+{
+  const auto res = directory / ("settings-" + layout.name + ".ly");
+  std::ofstream file (res);
+  file << "\\include " << to_scheme_string(listener_file.string()) << "\n"
+       << "\\include " << to_scheme_string(layout.paper_file.string()) << "\n";
+  file.close();
+  if (file.fail())
+  {
+    throw std::runtime_error(std::string{"Error: failed to write "} + res.c_str());
+  }
+  return res;
+}
+
+// the midi file lilypond wrote next to the svgs, with the repeats unfolded by the event listener.
+static
+fs::path get_midi_file(const fs::path& input_lily_file, const fs::path& pass_directory, std::ostream& output_debug_file)
+{
+  std::vector<fs::path> midi_files;
+  for (const auto& file : fs::directory_iterator(pass_directory))
+  {
+    const auto& path = file.path();
+    if (fs::is_regular_file(path) and ((path.extension() == ".midi") or (path.extension() == ".mid")) and
+	is_output_of(path, input_lily_file))
+    {
+      midi_files.push_back(path);
+    }
+  }
+
+  if (midi_files.size() != 1)
+  {
+    throw std::runtime_error(std::string{"Error: exactly one midi file was expected for "} + input_lily_file.filename().string() +
+			     " in the directory " + pass_directory.string() + ", found " + std::to_string(midi_files.size()) + ".\n"
+			     "  Music sheets with several scores, or with their own \\midi block, can't take their\n"
+			     "  timings from the midi file.");
+  }
+
+  output_debug_file << "Found midi file [" << midi_files[0].c_str() << "]\n";
+  return midi_files[0];
+}
+
+// checks that the pages derived from the ones with skylines are the same as the ones lilypond renders
+// without the event listener and the skylines.
+static
+void verify_clean_svgs(const std::vector<fs::path>& derived_svgs,
+		       const std::vector<fs::path>& svgs_without_skylines,
+		       std::ostream& output_debug_file)
+{
+  // safety check: there should be the same number of images with and without skylines
+  const auto nb_svgs = derived_svgs.size();
+  const auto nb_svgs_without_skylines = svgs_without_skylines.size();
+  if (nb_svgs != nb_svgs_without_skylines)
+  {
+    throw std::runtime_error(std::string{"Number of svg files with skylines and without mismatch.\n"
+	  "  There are "} + std::to_string(nb_svgs) + " svgs with skylines but " +
+      std::to_string(nb_svgs_without_skylines) + "without.\n");
+  }
+
+  // safety check: they should have the same names (except the suffix)
+  for (unsigned int i = 0; i < nb_svgs; ++i)
+  {
+    const auto name_without = svgs_without_skylines[i];
+    const auto name_derived = derived_svgs[i];
+    if (name_without.stem() != name_derived.stem())
+    {
+      throw std::runtime_error(std::string{"SVG filename mismatch detected.\n"
+	    "  One file is named ["} + name_without.string() +"]\n  and the associated one derived from the skylines one is ["
+	+ name_derived.string() + "]\n");
+    }
+
+    if (not have_same_content(name_derived, name_without))
+    {
+      throw std::runtime_error(std::string{"SVG content mismatch detected.\n"
+	    "  The page derived from the one with skylines ["} + name_derived.string() + "]\n"
+	"  differs from the one rendered by lilypond [" + name_without.string() + "]\n");
+    }
+  }
+
+  output_debug_file << "The " << nb_svgs << " derived svg files match the ones rendered without skylines\n\n";
+}
+
+static
+fs::path make_pass_directory(const fs::path& output_tmp_directory, const char* const name)
+{
+  const auto res = output_tmp_directory / name;
+  fs::create_directories(res);
+  return res;
+}
+
+namespace
+{
+  // the pages rendered in a layout
+  struct layout_files
+  {
+      std::vector<fs::path> svgs_with_skylines;
+      // the pages extracted while lilypond was running. Empty when they are still to be extracted.
+      std::vector<svg_file_t> sheets;
+  };
+
+  // what the lilypond runs leave in the temporary directory, and the extraction works on
+  struct intermediate_files
+  {
+      fs::path notes_file;
+      // the notes parsed while lilypond was running. Both are empty when the notes file is still to
+      // be read.
+      std::vector<note_t> unprocessed_notes;
+      std::vector<note_t> processed_notes;
+      fs::path staffs_num_file;
+      fs::path midi_file; // empty when the timings come from the notes pass
+      // the pages of each layout: the music sheet's own, or one per layout variant. Empty when only
+      // the key events are extracted.
+      std::vector<layout_files> layouts;
+      std::vector<fs::path> svgs_without_skylines; // empty unless the clean svgs must be verified
+      // the notes the svg run engraved when it only engraved some bars (see conversion_options::bars).
+      // Empty when it engraved them all.
+      fs::path engraved_notes_file;
+  };
+}
+
+// runs the passes once for all the input files, and gives the files obtained for each of them.
+// include_directory is where the files they include are looked for. progress, when not nullptr, is
+// given the notes and the pages as soon as they are known. There must be a single input file then.
+static
+std::vector<intermediate_files> run_lilypond_passes(const std::string& lilypond_command,
+						    const std::vector<fs::path>& input_lily_files,
+						    const fs::path& include_directory,
+						    const conversion_options& options,
+						    const conversion_context& context,
+						    progressive_writer* progress)
+{
+  if ((progress != nullptr) and (input_lily_files.size() != 1))
+  {
+    throw std::invalid_argument("Error: only a single file can be written while lilypond runs");
+  }
+
+  for (const auto& input_lily_file : input_lily_files)
+  {
+    fs::copy_file(input_lily_file, context.directory() / input_lily_file.filename());
+  }
+
+  // the runtime directory already has the embedded files, and keeping their paths the same from one
+  // run to the other lets guile reuse what it compiled from them
+  const auto embedded_files_directory = options.runtime_directory.empty() ? context.directory() : options.runtime_directory;
+  const fs::path listener_file = embedded_files_directory / "event-listener.scm";
+  const fs::path preloader_file = embedded_files_directory / "open_preloader.so";
+  if (options.runtime_directory.empty())
+  {
+    copy_event_listener_to(listener_file);
+    copy_open_preloader_to(preloader_file);
+  }
+
+  // the lilypond runs don't depend on each other and can therefore run concurrently. Each of them
+  // writes into its own directory so that looking for the svg files generated by one run can't pick
+  // up the pages produced by another one.
+  //
+  // When the timings come from the midi file, the svg pass also outputs the notes file and the
+  // midi file, and the separate notes pass is not needed.
+  //
+  // When only the key events are extracted, the notes pass is the only one. When the music sheet is
+  // rendered in layout variants, each one gets an svg run of its own and they share the notes pass.
+  const bool timings_from_midi = (options.timing_source == timing_source_t::midi);
+  const bool with_pages = not options.events_only;
+  if (options.events_only and (timings_from_midi or options.verify_clean_svgs))
+  {
+    throw std::invalid_argument("Error: the key events alone can only be extracted from the notes pass");
+  }
+
+  const bool with_variants = not options.layout_variants.empty();
+  if (with_variants and (timings_from_midi or options.verify_clean_svgs or options.events_only or (progress != nullptr)))
+  {
+    throw std::invalid_argument("Error: the layout variants can only be rendered next to the notes pass");
+  }
+
+  // only the bars of the range are engraved, and the notes of the others are left out of the
+  // extraction (see conversion_options::bars). The timings and the folded ids of the notes can't be
+  // matched to each other when the midi file gives the timings.
+  const bool only_some_bars = (options.bars.last != 0);
+  if (only_some_bars and (timings_from_midi or options.split_parts or options.events_only))
+  {
+    throw std::invalid_argument("Error: only the bars of a score rendered next to the notes pass can be kept");
+  }
+
+  const auto notes_dir = context.directory() / notes_pass_dir;
+  const auto notes_log_file = context.directory() / "notes_and_staff_num_generation";
+
+  // the suffix of the directory and the log file of the svg run of each layout
+  std::vector<std::string> layout_suffixes;
+  if (with_variants)
+  {
+    for (const auto& layout : options.layout_variants)
+    {
+      layout_suffixes.push_back("-" + layout.name);
+    }
+  }
+  else if (with_pages)
+  {
+    layout_suffixes.push_back("");
+  }
+
+  std::vector<lilypond_run_t> runs;
+  std::vector<fs::path> with_skylines_dirs;
+  std::vector<size_t> with_skylines_passes;
+  const auto add_with_skylines_runs = [&] () {
+    for (size_t layout = 0; layout < layout_suffixes.size(); ++layout)
+    {
+      const auto pass_name = svg_with_skylines_pass_dir + layout_suffixes[layout];
+      with_skylines_dirs.push_back(make_pass_directory(context.directory(), pass_name.c_str()));
+      with_skylines_passes.push_back(runs.size());
+
+      const auto settings_file = with_variants ?
+	write_layout_settings(listener_file, options.layout_variants[layout], context.directory()) : listener_file;
+      const auto log_file = context.directory() / ("svg_with_skylines_generation" + layout_suffixes[layout]);
+      // the notes engraved by the first layout tell which ones are in the bars of the range
+      const bool with_notes_output = timings_from_midi or (only_some_bars and (layout == 0));
+      runs.emplace_back(get_svg_with_skylines_run(input_lily_files, include_directory, settings_file,
+						  with_skylines_dirs.back(), log_file, with_notes_output, timings_from_midi,
+						  options.bars));
+    }
+  };
+
+  size_t notes_pass = 0;
+  const auto add_notes_run = [&] () {
+    if (not timings_from_midi)
+    {
+      make_pass_directory(context.directory(), notes_pass_dir);
+      notes_pass = runs.size();
+      runs.emplace_back(get_note_and_staff_num_run(input_lily_files, include_directory, listener_file, preloader_file,
+						   notes_dir, notes_log_file));
+    }
+  };
+
+  // the svg runs take the longest, they start first. Nothing can be written progressively before the
+  // notes are known though, and the runs may not all run at the same time.
+  if (progress == nullptr)
+  {
+    add_with_skylines_runs();
+    add_notes_run();
+  }
+  else
+  {
+    add_notes_run();
+    add_with_skylines_runs();
+  }
+
+  // the clean pages are derived from the ones with skylines. Rendering them for real is only
+  // needed to check the derived ones are identical.
+  const auto without_skylines_dir = context.directory() / svg_without_skylines_pass_dir;
+  const size_t without_skylines_pass = runs.size();
+  if (options.verify_clean_svgs)
+  {
+    make_pass_directory(context.directory(), svg_without_skylines_pass_dir);
+    const auto without_skylines_log_file = context.directory() / "svg_without_skylines_generation";
+    runs.emplace_back(get_svg_without_skylines_run(input_lily_files, include_directory, without_skylines_dir, without_skylines_log_file));
+  }
+
+  // the notes files are parsed while the notes pass writes them. A malformed line stops the runs
+  // right away instead of once lilypond is done with the whole music sheet.
+  std::vector<std::unique_ptr<notes_file_reader>> notes_readers;
+  if (not timings_from_midi)
+  {
+    for (const auto& input_lily_file : input_lily_files)
+    {
+      notes_readers.emplace_back(std::make_unique<notes_file_reader>(
+	  get_note_and_staff_num_file(input_lily_file, notes_dir, ".notes")));
+    }
+  }
+
+  // the pages with skylines are extracted as lilypond writes them, unless they must be extracted one
+  // at a time (see conversion_options::stream_pages)
+  const auto on_page = [&] (const fs::path& page, const svg_file_t& data) {
+    progress->page_extracted(get_page_number(page), data);
+  };
+  std::vector<std::unique_ptr<svg_pages_extractor>> with_skylines_pages;
+  for (const auto& with_skylines_dir : (options.stream_pages ? std::vector<fs::path>{} : with_skylines_dirs))
+  {
+    with_skylines_pages.emplace_back(std::make_unique<svg_pages_extractor>(
+	with_skylines_dir, with_skyline_suffix, without_skyline_suffix, context,
+	(progress == nullptr) ? svg_pages_extractor::page_listener{} : on_page));
+  }
+
+  // when the output is written progressively, the notes are taken as soon as the notes pass is done
+  std::vector<std::tuple<std::vector<note_t>, std::vector<note_t>>> notes (input_lily_files.size());
+  bool notes_taken = false;
+  std::exception_ptr notes_error;
+  const auto on_run_finished = [&] (size_t run, bool success) {
+    if ((run != notes_pass) or not success or notes_readers.empty())
+    {
+      return;
+    }
+
+    try
+    {
+      notes_readers[0]->writer_finished();
+      notes[0] = notes_readers[0]->get_notes();
+      progress->notes_ready(std::get<0>(notes[0]), std::get<1>(notes[0]),
+			    get_note_and_staff_num_file(input_lily_files[0], notes_dir, ".sn2in"));
+    }
+    catch (...)
+    {
+      notes_error = std::current_exception();
+    }
+    notes_taken = true;
+  };
+
+  const auto results = execute_lilypond_runs(lilypond_command, runs, options, context.log(), [&] () {
+      return std::any_of(notes_readers.begin(), notes_readers.end(), [] (const auto& reader) {
+	  return reader->failed();
+	});
+    },
+    (progress == nullptr) ? std::function<void(size_t, bool)>{} : on_run_finished);
+  context.log() << "\n";
+
+  // a line that couldn't be parsed explains better than lilypond why the notes pass failed, and
+  // all the runs were stopped because of it
+  if (notes_error)
+  {
+    std::rethrow_exception(notes_error);
+  }
+
+  for (size_t i = 0; (i < notes_readers.size()) and not notes_taken; ++i)
+  {
+    notes_readers[i]->writer_finished();
+    notes[i] = notes_readers[i]->get_notes();
+  }
+
+  std::vector<std::map<fs::path, svg_file_t>> pages;
+  for (size_t layout = 0; layout < with_skylines_pages.size(); ++layout)
+  {
+    pages.push_back(results[with_skylines_passes[layout]].success ?
+		      with_skylines_pages[layout]->finish(context.log()) : std::map<fs::path, svg_file_t>{});
+  }
+
+  std::vector<intermediate_files> res;
+  for (size_t i = 0; i < input_lily_files.size(); ++i)
+  {
+    const auto& input_lily_file = input_lily_files[i];
+
+    // TODO C++17 rewrite the following as
+    //   const auto [notes_file, staffs_num_file] = check_note_and_staff_num_files(...);
+    // when compilers will properly support C++17
+    const auto pair = timings_from_midi ?
+      check_note_and_staff_num_files(results[with_skylines_passes[0]], input_lily_file, with_skylines_dirs[0],
+				     false, context.log()) :
+      check_note_and_staff_num_files(results[notes_pass], input_lily_file, notes_dir,
+				     options.worker_pool == nullptr, context.log());
+
+    std::vector<layout_files> layouts;
+    for (size_t layout = 0; layout < with_skylines_dirs.size(); ++layout)
+    {
+      if (not results[with_skylines_passes[layout]].success)
+      {
+	throw std::runtime_error("Failed to create the SVGs files (with skylines" +
+				 (with_variants ? " in the layout " + options.layout_variants[layout].name : std::string{}) +
+				 ")");
+      }
+
+      if (options.stream_pages)
+      {
+	layouts.emplace_back(layout_files{
+	    .svgs_with_skylines = get_svg_files(true, input_lily_file, with_skylines_dirs[layout], context.log(), true),
+	    .sheets = {},
+	  });
+	continue;
+      }
+
+      auto sheets = take_pages_of(input_lily_file, pages[layout], with_skylines_dirs[layout], context.log());
+      std::vector<fs::path> svgs_with_skylines;
+      for (const auto& sheet : sheets)
+      {
+	svgs_with_skylines.push_back(sheet.filename);
+      }
+      layouts.emplace_back(layout_files{
+	  .svgs_with_skylines = std::move(svgs_with_skylines),
+	  .sheets = std::move(sheets),
+	});
+    }
+
+    res.emplace_back(intermediate_files{
+	.notes_file = std::get<0>(pair),
+	.unprocessed_notes = std::move(std::get<0>(notes[i])),
+	.processed_notes = std::move(std::get<1>(notes[i])),
+	.staffs_num_file = std::get<1>(pair),
+	.midi_file = timings_from_midi ? get_midi_file(input_lily_file, with_skylines_dirs[0], context.log()) : fs::path{},
+	.layouts = std::move(layouts),
+	.svgs_without_skylines = options.verify_clean_svgs ?
+	                           get_svg_files(results[without_skylines_pass].success, input_lily_file, without_skylines_dir,
+						 context.log(), false) :
+	                           std::vector<fs::path>{},
+	.engraved_notes_file = only_some_bars ?
+	                         get_note_and_staff_num_file(input_lily_file, with_skylines_dirs[0], ".notes") :
+	                         fs::path{},
+      });
+  }
+
+  context.stage_done("lilypond");
+  return res;
+}
+
+// the svg files a previous run already renamed with the given suffix
+static
+std::vector<fs::path> find_renamed_svg_files(const fs::path& pass_directory,
+					     const char* const suffix,
+					     std::ostream& output_debug_file)
+{
+  std::vector<fs::path> res;
+  if (fs::is_directory(pass_directory))
+  {
+    for (const auto& file : fs::directory_iterator(pass_directory))
+    {
+      const auto& path = file.path();
+      if (fs::is_regular_file(path) and (path.extension() == suffix) and (path.stem().extension() == ".svg"))
+      {
+	res.push_back(path);
+      }
+    }
+  }
+
+  if (res.empty())
+  {
+    throw std::runtime_error(std::string{"Error: no svg files ending with "} + suffix + " in " + pass_directory.string());
+  }
+
+  sort_by_page_number(res);
+
+  output_debug_file << "Reusing " << res.size() << " svg files:\n";
+  for (const auto& svg_file : res)
+  {
+    output_debug_file << "  " << svg_file << "\n";
+  }
+  output_debug_file << "\n";
+
+  return res;
+}
+
+// the notes file lilypond wrote in a previous run. Its name is the one of the input file, which is
+// not known when reusing a directory.
+static
+fs::path find_notes_file(const fs::path& pass_directory)
+{
+  std::vector<fs::path> res;
+  if (fs::is_directory(pass_directory))
+  {
+    for (const auto& file : fs::directory_iterator(pass_directory))
+    {
+      if (fs::is_regular_file(file.path()) and (file.path().extension() == ".notes"))
+      {
+	res.push_back(file.path());
+      }
+    }
+  }
+
+  if (res.size() != 1)
+  {
+    throw std::runtime_error(std::string{"Error: exactly one notes file was expected in "} + pass_directory.string() +
+			     ", found " + std::to_string(res.size()));
+  }
+
+  return res[0];
+}
+
+// checks a temporary directory of a previous run holds everything the extraction needs
+static
+intermediate_files find_intermediate_files(const fs::path& intermediates_directory,
+					   const conversion_options& options,
+					   std::ostream& output_debug_file)
+{
+  const bool timings_from_midi = (options.timing_source == timing_source_t::midi);
+  const auto with_skylines_dir = intermediates_directory / svg_with_skylines_pass_dir;
+  const auto notes_dir = timings_from_midi ? with_skylines_dir : (intermediates_directory / notes_pass_dir);
+
+  const auto notes_file = find_notes_file(notes_dir);
+  auto staffs_num_file = notes_file;
+  staffs_num_file.replace_extension(".sn2in");
+  if (not fs::is_regular_file(staffs_num_file))
+  {
+    throw std::runtime_error(std::string{"Error: missing file "} + staffs_num_file.string());
+  }
+
+  output_debug_file << "Reusing notes file [" << notes_file.c_str() << "]\n"
+		    << "Reusing staff-num-to-instrument file [" << staffs_num_file.c_str() << "]\n";
+
+  // the svg run left the notes it engraved when it only engraved the bars of the range. Otherwise the
+  // range is cut from the whole song.
+  fs::path engraved_notes_file;
+  if ((options.bars.last != 0) and not (timings_from_midi or options.events_only) and
+      fs::is_directory(with_skylines_dir))
+  {
+    for (const auto& file : fs::directory_iterator(with_skylines_dir))
+    {
+      if (fs::is_regular_file(file.path()) and (file.path().extension() == ".notes"))
+      {
+	engraved_notes_file = file.path();
+	output_debug_file << "Reusing engraved notes file [" << engraved_notes_file.c_str() << "]\n";
+      }
+    }
+  }
+
+  return intermediate_files{
+    .notes_file = notes_file,
+    .unprocessed_notes = {},
+    .processed_notes = {},
+    .staffs_num_file = staffs_num_file,
+    .midi_file = timings_from_midi ? get_midi_file(notes_file, with_skylines_dir, output_debug_file) : fs::path{},
+    .layouts = options.events_only ? std::vector<layout_files>{} : std::vector<layout_files>{ layout_files{
+	.svgs_with_skylines = find_renamed_svg_files(with_skylines_dir, with_skyline_suffix, output_debug_file),
+	.sheets = {},
+      } },
+    .svgs_without_skylines = options.verify_clean_svgs ?
+                               find_renamed_svg_files(intermediates_directory / svg_without_skylines_pass_dir,
+						      without_skyline_suffix, output_debug_file) :
+                               std::vector<fs::path>{},
+    .engraved_notes_file = engraved_notes_file,
+  };
+}
+
+// keeps the notes of the first time the song goes through the engraved bars (see
+// conversion_options::bars): from the first engraved note to the first one after it which was not
+// engraved. The ids of the engraved notes are the ones of the engraved_notes_file.
+static
+void keep_engraved_notes(std::vector<note_t>& unprocessed_notes,
+			 std::vector<note_t>& processed_notes,
+			 const fs::path& engraved_notes_file,
+			 std::ostream& output_debug_file)
+{
+  std::set<std::string> engraved_ids;
+  for (const auto& note : get_unprocessed_notes_with_transparent_ones(engraved_notes_file))
+  {
+    engraved_ids.insert(note.id);
+  }
+
+  using time_type = decltype(note_t::start_time);
+  time_type begin_time = std::numeric_limits<time_type>::max();
+  for (const auto& note : unprocessed_notes)
+  {
+    if (engraved_ids.count(note.id) != 0)
+    {
+      begin_time = std::min(begin_time, note.start_time);
+    }
+  }
+
+  time_type end_time = std::numeric_limits<time_type>::max();
+  for (const auto& note : unprocessed_notes)
+  {
+    if ((engraved_ids.count(note.id) == 0) and (note.start_time > begin_time))
+    {
+      end_time = std::min(end_time, note.start_time);
+    }
+  }
+
+  const auto is_kept = [&] (const note_t& note) {
+    return (engraved_ids.count(note.id) != 0) and (note.start_time >= begin_time) and (note.start_time < end_time);
+  };
+
+  const auto nb_notes = unprocessed_notes.size();
+  for (auto* notes : { &unprocessed_notes, &processed_notes })
+  {
+    notes->erase(std::remove_if(notes->begin(), notes->end(), [&] (const note_t& note) {
+	  return not is_kept(note);
+	}), notes->end());
+  }
+
+  output_debug_file << "Keeping the " << unprocessed_notes.size() << " of " << nb_notes
+		    << " notes in the engraved bars\n";
+}
+
+// gives the song of each layout of files, or the song without pages when only the key events are
+// extracted. The layouts share everything but the pages and the events which depend on them.
+//
+// The stages run as a graph of tasks (see task_graph), each one as soon as what it needs is there:
+// the staffs and the pages don't wait for the notes, nor the key events for the pages. Each task
+// logs into a stream of its own, added to the conversion's log in the order of the stages.
+static
+std::vector<song_t> extract_songs(const intermediate_files& files, const conversion_options& options,
+				  const conversion_context& context)
+{
+  task_graph graph;
+  std::deque<std::ostringstream> logs;
+  const auto add_task = [&] (const std::function<void(const conversion_context&)>& run,
+			     const std::vector<task_graph::task_id>& dependencies) {
+    logs.emplace_back();
+    const auto task_context = context.with_log(logs.back());
+    return graph.add([run, task_context] () { run(task_context); }, dependencies);
+  };
+
+  // the notes may have been parsed while lilypond was running
+  auto unprocessed_notes = files.unprocessed_notes;
+  auto notes = files.processed_notes;
+  const auto notes_task = add_task([&] (const conversion_context& task_context) {
+      if (unprocessed_notes.empty())
+      {
+	unprocessed_notes = files.midi_file.empty() ?
+	  get_unprocessed_notes(files.notes_file) :
+	  get_unprocessed_notes_from_midi(files.midi_file, files.notes_file, task_context);
+	notes = get_processed_notes(unprocessed_notes);
+      }
+
+      if (not files.engraved_notes_file.empty())
+      {
+	keep_engraved_notes(unprocessed_notes, notes, files.engraved_notes_file, task_context.log());
+      }
+    }, {});
+
+  std::vector<std::string> staffs_to_instrument;
+  add_task([&] (const conversion_context& task_context) {
+      staffs_to_instrument = get_staff_instr_mapping(files.staffs_num_file, task_context);
+    }, {});
+
+  std::vector<key_event> keyboard_events;
+  add_task([&] (const conversion_context& task_context) {
+      keyboard_events = get_key_events(notes, task_context);
+    }, { notes_task });
+
+  std::vector<chord_t> chords;
+  const auto chords_task = options.events_only ? notes_task : add_task([&] (const conversion_context& task_context) {
+      chords = get_chords(notes, task_context);
+    }, { notes_task });
+
+  const auto nb_layouts = options.events_only ? size_t{0} : files.layouts.size();
+  std::vector<std::vector<fs::path>> clean_svgs (nb_layouts);
+  std::vector<std::vector<std::unique_ptr<svg_file_t>>> extracted_sheets (nb_layouts);
+  std::vector<std::vector<cursor_box_t>> cursor_boxes (nb_layouts);
+  std::vector<std::vector<bar_num_event_t>> bar_num_events (nb_layouts);
+  for (size_t layout = 0; layout < nb_layouts; ++layout)
+  {
+    const auto& layout_files = files.layouts[layout];
+    for (const auto& filename : layout_files.svgs_with_skylines)
+    {
+      auto clean_filename = filename;
+      clean_filename.replace_extension(without_skyline_suffix);
+      clean_svgs[layout].push_back(clean_filename);
+    }
+
+    // the tasks extracting the pages, and the one finding the cursor boxes on them
+    std::vector<task_graph::task_id> pages_tasks;
+    task_graph::task_id cursor_boxes_task = 0;
+    if (options.stream_pages)
+    {
+      // each page is only held until the chords on it are found
+      cursor_boxes_task = add_task([&, layout] (const conversion_context& task_context) {
+	    const auto& svgs_with_skylines = files.layouts[layout].svgs_with_skylines;
+	    cursor_boxes[layout] = get_cursor_boxes(chords, svgs_with_skylines.size(), [&] (size_t page) {
+		return get_svg_data(svgs_with_skylines[page], clean_svgs[layout][page], task_context);
+	      }, unprocessed_notes);
+	  }, { chords_task });
+      pages_tasks.push_back(cursor_boxes_task);
+    }
+    else
+    {
+      // the pages not extracted while lilypond was running are extracted side by side
+      extracted_sheets[layout].resize(layout_files.svgs_with_skylines.size());
+      for (size_t page = layout_files.sheets.size(); page < layout_files.svgs_with_skylines.size(); ++page)
+      {
+	pages_tasks.push_back(add_task([&, layout, page] (const conversion_context& task_context) {
+	      extracted_sheets[layout][page] = std::make_unique<svg_file_t>(
+		  get_svg_data(files.layouts[layout].svgs_with_skylines[page], clean_svgs[layout][page], task_context));
+	    }, {}));
+      }
+
+      auto dependencies = pages_tasks;
+      dependencies.push_back(chords_task);
+      cursor_boxes_task = add_task([&, layout] (const conversion_context&) {
+	    std::vector<svg_file_t> sheets = files.layouts[layout].sheets;
+	    for (size_t page = sheets.size(); page < extracted_sheets[layout].size(); ++page)
+	    {
+	      sheets.emplace_back(std::move(*extracted_sheets[layout][page]));
+	      extracted_sheets[layout][page].reset();
+	    }
+	    cursor_boxes[layout] = get_cursor_boxes(chords, sheets, unprocessed_notes);
+	  }, dependencies);
+    }
+
+    add_task([&, layout] (const conversion_context&) {
+	bar_num_events[layout] = get_bar_num_events(cursor_boxes[layout]);
+      }, { cursor_boxes_task });
+
+    if (not files.svgs_without_skylines.empty())
+    {
+      add_task([&, layout] (const conversion_context& task_context) {
+	  verify_clean_svgs(clean_svgs[layout], files.svgs_without_skylines, task_context.log());
+	}, pages_tasks);
+    }
+  }
+
+  std::exception_ptr error;
+  try
+  {
+    graph.run(std::max(1u, options.extraction_threads));
+  }
+  catch (...)
+  {
+    error = std::current_exception();
+  }
+
+  for (const auto& log : logs)
+  {
+    context.log() << log.str();
+  }
+  if (error)
+  {
+    std::rethrow_exception(error);
+  }
+
+  if (options.events_only)
+  {
+    return { song_t{
+	.keyboard_events = std::move(keyboard_events),
+	.cursor_boxes = {},
+	.bar_num_events = {},
+	.staffs_to_instrument = std::move(staffs_to_instrument),
+	.svg_files = {},
+      } };
+  }
+
+  std::vector<song_t> res;
+  for (size_t layout = 0; layout < nb_layouts; ++layout)
+  {
+    res.emplace_back(song_t{
+	.keyboard_events = keyboard_events,
+	.cursor_boxes = std::move(cursor_boxes[layout]),
+	.bar_num_events = std::move(bar_num_events[layout]),
+	.staffs_to_instrument = staffs_to_instrument,
+	.svg_files = std::move(clean_svgs[layout]),
+      });
+  }
+  return res;
+}
+
+void save_song(const song_t& song, const fs::path& output_bin_file, const conversion_options& options)
+{
+  const auto save = options.progressive_output ? save_chunks_to_file : save_to_file;
+  save(output_bin_file,
+       song.keyboard_events,
+       song.cursor_boxes,
+       song.bar_num_events,
+       song.staffs_to_instrument,
+       song.svg_files);
+}
+
+// appends a part converted on its own to the song made of the parts before it. The part is played
+// once the song ends, its pages come after the ones of the song, and its staves are given the
+// numbers of the song's staves of the same instrument, or new ones.
+static
+void append_part(song_t& song, song_t&& part)
+{
+  using time_type = decltype(key_event::time);
+  time_type end_of_song = 0;
+  if (not song.keyboard_events.empty())
+  {
+    end_of_song = std::max(end_of_song, song.keyboard_events.back().time);
+  }
+  if (not song.cursor_boxes.empty())
+  {
+    end_of_song = std::max(end_of_song, song.cursor_boxes.back().start_time);
+  }
+  if (not song.bar_num_events.empty())
+  {
+    end_of_song = std::max(end_of_song, song.bar_num_events.back().time);
+  }
+
+  std::vector<bool> staff_taken (song.staffs_to_instrument.size(), false);
+  std::vector<decltype(key_data::staff_number)> new_staff_numbers;
+  for (const auto& instrument : part.staffs_to_instrument)
+  {
+    size_t staff = 0;
+    while ((staff < song.staffs_to_instrument.size()) and
+	   (staff_taken[staff] or (song.staffs_to_instrument[staff] != instrument)))
+    {
+      ++staff;
+    }
+
+    if (staff == song.staffs_to_instrument.size())
+    {
+      if (staff >= std::numeric_limits<decltype(key_data::staff_number)>::max())
+      {
+	throw std::runtime_error("Error: the parts have too many staves together");
+      }
+      song.staffs_to_instrument.push_back(instrument);
+      staff_taken.push_back(false);
+    }
+
+    staff_taken[staff] = true;
+    new_staff_numbers.push_back(static_cast<decltype(key_data::staff_number)>(staff));
+  }
+
+  for (auto& event : part.keyboard_events)
+  {
+    event.time += end_of_song;
+    if (event.data.staff_number < new_staff_numbers.size())
+    {
+      event.data.staff_number = new_staff_numbers[event.data.staff_number];
+    }
+    song.keyboard_events.push_back(event);
+  }
+
+  const auto first_svg_file = song.svg_files.size();
+  if (first_svg_file + part.svg_files.size() > std::numeric_limits<decltype(cursor_box_t::svg_file_pos)>::max())
+  {
+    throw std::runtime_error("Error: the parts have too many pages together");
+  }
+
+  for (auto& cursor_box : part.cursor_boxes)
+  {
+    cursor_box.start_time += end_of_song;
+    cursor_box.svg_file_pos = static_cast<decltype(cursor_box_t::svg_file_pos)>(cursor_box.svg_file_pos + first_svg_file);
+    song.cursor_boxes.push_back(cursor_box);
+  }
+
+  for (auto& bar_num_event : part.bar_num_events)
+  {
+    bar_num_event.time += end_of_song;
+    song.bar_num_events.push_back(bar_num_event);
+  }
+
+  song.svg_files.insert(song.svg_files.end(), part.svg_files.begin(), part.svg_files.end());
+}
+
+bar_range_t parse_bar_range(const std::string& str)
+{
+  const auto separator = str.find(':');
+  const auto first = str.substr(0, separator);
+  const auto last = (separator == std::string::npos) ? std::string{} : str.substr(separator + 1);
+  const auto is_number = [] (const std::string& number) {
+    return (not number.empty()) and (number.size() <= 5) and
+      (number.find_first_not_of("0123456789") == std::string::npos);
+  };
+
+  if (not is_number(first) or not is_number(last))
+  {
+    throw std::runtime_error("Error: invalid bar range '" + str + "'. Expected FROM:TO, as in 12:16");
+  }
+
+  const auto first_bar = std::stoul(first);
+  const auto last_bar = std::stoul(last);
+  using bar_type = decltype(bar_range_t::first);
+  if ((last_bar == 0) or (first_bar > last_bar) or (last_bar > std::numeric_limits<bar_type>::max()))
+  {
+    throw std::runtime_error("Error: invalid bar range '" + str + "'");
+  }
+
+  return bar_range_t{ .first = static_cast<bar_type>(first_bar), .last = static_cast<bar_type>(last_bar) };
+}
+
+layout_variant_t parse_layout_variant(const std::string& str)
+{
+  const auto separator = str.find('=');
+  if ((separator == std::string::npos) or (separator == 0) or (separator + 1 == str.size()))
+  {
+    throw std::runtime_error("Error: invalid layout variant '" + str + "'. Expected NAME=PAPER_FILE, as in phone=phone.ly");
+  }
+
+  const auto name = str.substr(0, separator);
+  if (name.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") != std::string::npos)
+  {
+    throw std::runtime_error("Error: invalid layout variant name '" + name + "'. Only letters, digits, '_' and '-' are allowed");
+  }
+
+  const fs::path paper_file {str.substr(separator + 1)};
+  if (not fs::is_regular_file(paper_file))
+  {
+    throw std::runtime_error("Error: the paper file '" + paper_file.string() + "' of the layout variant '" + name +
+			     "' doesn't exist");
+  }
+
+  // lilypond runs in the directory of the conversion
+  return layout_variant_t{ .name = name, .paper_file = fs::absolute(paper_file) };
+}
+
+std::vector<fs::path> get_output_files(const fs::path& output_bin_file, const conversion_options& options)
+{
+  if (options.layout_variants.empty())
+  {
+    return { output_bin_file };
+  }
+
+  std::vector<fs::path> res;
+  for (const auto& layout : options.layout_variants)
+  {
+    auto output_file = output_bin_file;
+    output_file.replace_filename(output_bin_file.stem().string() + "-" + layout.name +
+				 output_bin_file.extension().string());
+    res.push_back(std::move(output_file));
+  }
+  return res;
+}
+
+// "FROM:TO", as parse_bar_range reads it
+static
+std::string to_string(const bar_range_t& bars)
+{
+  return std::to_string(static_cast<unsigned int>(bars.first)) + ":" + std::to_string(static_cast<unsigned int>(bars.last));
+}
+
+// removes what is not in the bars of the range from the song. The song starts at the first cursor
+// of the range, and ends at the first cursor after it: the keys still pressed are released then.
+static
+void keep_bars(song_t& song, const bar_range_t& bars, std::ostream& output_debug_file)
+{
+  const auto in_range = [&] (const cursor_box_t& cursor_box) {
+    return (cursor_box.bar_number >= bars.first) and (cursor_box.bar_number <= bars.last);
+  };
+
+  const auto first_box = std::find_if(song.cursor_boxes.cbegin(), song.cursor_boxes.cend(), in_range);
+  if (first_box == song.cursor_boxes.cend())
+  {
+    throw std::runtime_error("Error: the song has no bar in the range " + to_string(bars));
+  }
+  const auto end_box = std::find_if_not(first_box, song.cursor_boxes.cend(), in_range);
+
+  using time_type = decltype(key_event::time);
+  const time_type begin_time = first_box->start_time;
+  const bool ends_with_song = (end_box == song.cursor_boxes.cend());
+  const time_type end_time = ends_with_song ? std::numeric_limits<time_type>::max() : end_box->start_time;
+
+  // the keys pressed before the range are not released in it, the ones pressed in it are released
+  // at the end of the range at the latest.
+  std::vector<key_event> keyboard_events;
+  std::vector<key_data> pressed_keys;
+  for (const auto& event : song.keyboard_events)
+  {
+    if ((event.time < begin_time) or (event.time > end_time))
+    {
+      continue;
+    }
+
+    if (event.data.ev_type == key_data::type::pressed)
+    {
+      if (event.time == end_time)
+      {
+	continue;
+      }
+      pressed_keys.push_back(event.data);
+    }
+    else
+    {
+      // two staves can play the same key, the release goes with the press of its staff. Merged
+      // notes may not keep it, any press of the key is taken then.
+      auto key = std::find_if(pressed_keys.begin(), pressed_keys.end(), [&] (const key_data& data) {
+	  return (data.pitch == event.data.pitch) and (data.staff_number == event.data.staff_number);
+	});
+      if (key == pressed_keys.end())
+      {
+	key = std::find_if(pressed_keys.begin(), pressed_keys.end(), [&] (const key_data& data) {
+	    return data.pitch == event.data.pitch;
+	  });
+      }
+      if (key == pressed_keys.end())
+      {
+	continue;
+      }
+      pressed_keys.erase(key);
+    }
+
+    keyboard_events.push_back(key_event{ .time = event.time - begin_time, .data = event.data });
+  }
+
+  if (not ends_with_song)
+  {
+    for (const auto& key : pressed_keys)
+    {
+      keyboard_events.push_back(key_event{ .time = end_time - begin_time,
+					   .data = key_data{ .pitch = key.pitch,
+							     .ev_type = key_data::type::released,
+							     .staff_number = key.staff_number } });
+    }
+  }
+
+  // the pages keep their order, without the ones the range is not on
+  using pos_type = decltype(cursor_box_t::svg_file_pos);
+  std::vector<bool> page_used (song.svg_files.size(), false);
+  for (auto cursor_box = first_box; cursor_box != end_box; ++cursor_box)
+  {
+    page_used.at(cursor_box->svg_file_pos) = true;
+  }
+
+  std::vector<fs::path> svg_files;
+  std::vector<pos_type> new_page_pos (song.svg_files.size(), 0);
+  for (size_t page = 0; page < song.svg_files.size(); ++page)
+  {
+    if (page_used[page])
+    {
+      new_page_pos[page] = static_cast<pos_type>(svg_files.size());
+      svg_files.push_back(song.svg_files[page]);
+    }
+  }
+
+  std::vector<cursor_box_t> cursor_boxes (first_box, end_box);
+  for (auto& cursor_box : cursor_boxes)
+  {
+    cursor_box.start_time -= begin_time;
+    cursor_box.svg_file_pos = new_page_pos[cursor_box.svg_file_pos];
+  }
+
+  output_debug_file << "Keeping bars " << to_string(bars) << ": " << keyboard_events.size()
+		    << " of " << song.keyboard_events.size() << " key events, " << cursor_boxes.size() << " of "
+		    << song.cursor_boxes.size() << " cursors, " << svg_files.size() << " of "
+		    << song.svg_files.size() << " pages\n";
+
+  song.keyboard_events = std::move(keyboard_events);
+  song.bar_num_events = get_bar_num_events(cursor_boxes);
+  song.cursor_boxes = std::move(cursor_boxes);
+  song.svg_files = std::move(svg_files);
+}
+
+// the files lilypond converts for the input file: its parts when it is split (see
+// conversion_options::split_parts), or the file itself.
+static
+std::vector<fs::path> get_lilypond_input_files(const fs::path& input_lily_file,
+					       const conversion_options& options,
+					       const conversion_context& context)
+{
+  const auto parts = options.split_parts ?
+    split_into_parts(input_lily_file, context.directory() / "parts") :
+    std::vector<fs::path>{};
+  if (parts.empty())
+  {
+    return { input_lily_file };
+  }
+
+  context.log() << "Split [" << input_lily_file.c_str() << "] into " << parts.size() << " parts\n";
+  return parts;
+}
+
+// the song of each layout made of the files [begin, end) converted by the lilypond runs, one after
+// the other, with only the bars of conversion_options::bars
+static
+std::vector<song_t> extract_parts(const std::vector<fs::path>& lilypond_input_files,
+				  const std::vector<intermediate_files>& files,
+				  size_t begin,
+				  size_t end,
+				  const conversion_options& options,
+				  const conversion_context& context)
+{
+  std::vector<song_t> songs;
+  for (auto file = begin; file < end; ++file)
+  {
+    context.log() << "Extracting [" << lilypond_input_files[file].c_str() << "]\n";
+
+    // the parts dump their debug data in directories of their own
+    const auto part_context = (end - begin == 1) ? context :
+      context.in_sub_directory("dumps-" + lilypond_input_files[file].stem().string());
+    auto parts = extract_songs(files[file], options, part_context);
+    if (file == begin)
+    {
+      songs = std::move(parts);
+    }
+    else
+    {
+      for (size_t layout = 0; layout < songs.size(); ++layout)
+      {
+	append_part(songs[layout], std::move(parts[layout]));
+      }
+    }
+  }
+
+  if (options.bars.last != 0)
+  {
+    for (auto& song : songs)
+    {
+      keep_bars(song, options.bars, context.log());
+    }
+  }
+
+  context.stage_done("extraction");
+  return songs;
+}
+
+// converts the input files with a single run of each lilypond pass. Gives for each input file why its
+// conversion failed, or an empty string when it succeeded.
+static
+std::vector<std::string> convert(const std::string& lilypond_command,
+				 const std::vector<fs::path>& input_lily_files,
+				 const std::vector<fs::path>& output_bin_files,
+				 const conversion_options& options,
+				 const conversion_context& context)
+{
+  const auto nb_files = input_lily_files.size();
+  std::vector<std::string> res (nb_files);
+
+  // the files split into parts are replaced by their parts, which lilypond converts as files of
+  // their own, possibly in several processes (see lilypond_job_count). first_file[i] is the first
+  // one of input_lily_files[i], and first_file[nb_files] the end.
+  std::vector<fs::path> lilypond_input_files;
+  std::vector<size_t> first_file;
+  for (const auto& input_lily_file : input_lily_files)
+  {
+    first_file.push_back(lilypond_input_files.size());
+
+    const auto files = get_lilypond_input_files(input_lily_file, options, context);
+    lilypond_input_files.insert(lilypond_input_files.end(), files.begin(), files.end());
+  }
+  first_file.push_back(lilypond_input_files.size());
+
+  // a single file is written while lilypond runs, see conversion_options::progressive_output. The
+  // bars to keep are only known once the song is extracted.
+  const bool write_while_running = options.progressive_output and (lilypond_input_files.size() == 1) and
+    (options.bars.last == 0) and options.layout_variants.empty();
+  std::unique_ptr<progressive_writer> progress;
+
+  std::vector<intermediate_files> files;
+  std::string error;
+  std::string failed_file; // the file lilypond reported an error in, when it told
+  try
+  {
+    if (write_while_running)
+    {
+      progress = std::make_unique<progressive_writer>(output_bin_files[0], not options.events_only, context);
+    }
+    files = run_lilypond_passes(lilypond_command, lilypond_input_files, get_directory_of_file(input_lily_files.at(0)),
+				options, context, progress.get());
+  }
+  catch (const lilypond_failure& e)
+  {
+    error = e.what();
+    failed_file = e.file();
+  }
+  catch (const std::exception& e)
+  {
+    error = e.what();
+  }
+
+  if (not error.empty())
+  {
+    if (nb_files == 1)
+    {
+      res[0] = error;
+      return res;
+    }
+
+    // the outputs of the other files could be partial. Convert each file on its own so that a broken
+    // file doesn't take the other ones down. When lilypond told which file is broken, it is not
+    // converted again.
+    context.log() << "Converting the " << nb_files << " files together failed, converting them one by one:\n"
+		  << error << "\n\n";
+    const auto is_failed_file = [&] (const fs::path& file) {
+      return (not failed_file.empty()) and (fs::absolute(failed_file) == fs::absolute(file));
+    };
+
+    for (size_t i = 0; i < nb_files; ++i)
+    {
+      if (std::any_of(lilypond_input_files.begin() + static_cast<long>(first_file[i]),
+		      lilypond_input_files.begin() + static_cast<long>(first_file[i + 1]), is_failed_file))
+      {
+	res[i] = error;
+	continue;
+      }
+
+      res[i] = convert(lilypond_command, { input_lily_files[i] }, { output_bin_files[i] }, options,
+		       context.in_sub_directory("alone-" + input_lily_files[i].stem().string()))[0];
+    }
+    return res;
+  }
+
+  for (size_t i = 0; i < nb_files; ++i)
+  {
+    try
+    {
+      const auto file_context = (nb_files == 1) ? context :
+	context.in_sub_directory("dumps-" + input_lily_files[i].stem().string());
+      const auto songs = extract_parts(lilypond_input_files, files, first_file[i], first_file[i + 1], options,
+				       file_context);
+      if (progress != nullptr)
+      {
+	progress->finish(songs.at(0), file_context.log());
+      }
+      else
+      {
+	const auto outputs = get_output_files(output_bin_files[i], options);
+	for (size_t layout = 0; layout < songs.size(); ++layout)
+	{
+	  save_song(songs[layout], outputs.at(layout), options);
+	}
+      }
+      file_context.stage_done("output");
+    }
+    catch (const std::exception& e)
+    {
+      res[i] = e.what();
+    }
+  }
+
+  return res;
+}
+
+// what the cache key of each output file of a conversion depends on, beside the input file: the
+// layout variant with its paper file and the files it includes, or the music sheet's own layout.
+static
+std::vector<std::string> get_layout_key_parts(const conversion_options& options)
+{
+  if (options.layout_variants.empty())
+  {
+    return { "own layout" };
+  }
+
+  std::vector<std::string> res;
+  for (const auto& layout : options.layout_variants)
+  {
+    auto part = "layout " + layout.name + "\n";
+    for (const auto& file : get_input_and_included_files(layout.paper_file))
+    {
+      part += get_file_content(file, "");
+    }
+    res.push_back(std::move(part));
+  }
+  return res;
+}
+
+// the key of the cache entry for the conversion of this file in a layout (see get_layout_key_parts)
+static
+std::string get_conversion_key(const fs::path& input_lily_file,
+			       const std::string& lilypond_version,
+			       const std::string& layout,
+			       const conversion_options& options,
+			       const conversion_context& context)
+{
+  // everything else the generated file depends on: the lilypond version, the files given to lilypond
+  // and the options changing the output.
+  return get_cache_key(input_lily_file, {
+      lilypond_version,
+      std::string(reinterpret_cast<const char*>(event_listener_scm), event_listener_scm_len),
+      std::string(reinterpret_cast<const char*>(open_preloader_so), open_preloader_so_len),
+      (options.timing_source == timing_source_t::midi) ? "timing from midi" : "timing from notes pass",
+      options.split_parts ? "split into parts" : "not split",
+      (options.bars.last == 0) ? "all bars" :
+        ("bars " + to_string(options.bars)),
+      options.events_only ? "events only" : "with pages",
+      options.progressive_output ? "progressive format" : "whole format",
+      layout },
+    context.log());
+}
+
+std::vector<std::string> generate_bin_files(const std::string& lilypond_command,
+					    const std::vector<fs::path>& input_lily_files,
+					    const std::vector<fs::path>& output_bin_files,
+					    const conversion_options& options,
+					    const conversion_context& context)
+{
+  const auto nb_files = input_lily_files.size();
+  if ((nb_files == 0) or (output_bin_files.size() != nb_files))
+  {
+    throw std::invalid_argument("Error: there must be one output file per input file");
+  }
+
+  for (size_t i = 0; i < nb_files; ++i)
+  {
+    for (size_t j = i + 1; j < nb_files; ++j)
+    {
+      if (not can_share_lilypond_run(input_lily_files[i], input_lily_files[j]))
+      {
+	throw std::invalid_argument(std::string{"Error: "} + input_lily_files[i].string() + " and " +
+				    input_lily_files[j].string() + " can't be converted by the same lilypond run");
+      }
+    }
+  }
+
+  if (options.cache_directory.empty())
+  {
+    return convert(lilypond_command, input_lily_files, output_bin_files, options, context);
+  }
+
+  // each output file has its own entry, a file is only converted again when one of them is missing
+  struct entry_t
+  {
+      size_t file;
+      fs::path output_file;
+      std::string key;
+  };
+
+  const auto lilypond_version = get_command_output({ lilypond_command, "--version" }, context.log());
+  const auto layout_key_parts = get_layout_key_parts(options);
+  std::vector<entry_t> entries;
+  for (size_t i = 0; i < nb_files; ++i)
+  {
+    const auto outputs = get_output_files(output_bin_files[i], options);
+    for (size_t layout = 0; layout < outputs.size(); ++layout)
+    {
+      entries.emplace_back(entry_t{
+	  .file = i,
+	  .output_file = outputs[layout],
+	  .key = get_conversion_key(input_lily_files[i], lilypond_version, layout_key_parts[layout], options, context),
+	});
+    }
+  }
+
+  // the entries are locked in the order of their keys, so that two processes converting overlapping
+  // groups of files can't wait for each other.
+  std::sort(entries.begin(), entries.end(), [] (const entry_t& a, const entry_t& b) {
+      return a.key < b.key;
+    });
+
+  std::vector<std::unique_ptr<cache_entry_lock>> locks;
+  std::vector<bool> must_convert (nb_files, false);
+  for (const auto& entry : entries)
+  {
+    locks.emplace_back(std::make_unique<cache_entry_lock>(options.cache_directory, entry.key));
+    if (get_from_cache(options.cache_directory, entry.key, entry.output_file, context.log()))
+    {
+      context.stage_done("cache");
+    }
+    else
+    {
+      must_convert[entry.file] = true;
+    }
+  }
+
+  std::vector<size_t> to_convert;
+  for (size_t i = 0; i < nb_files; ++i)
+  {
+    if (must_convert[i])
+    {
+      to_convert.push_back(i);
+    }
+  }
+
+  std::vector<std::string> res (nb_files);
+  if (not to_convert.empty())
+  {
+    std::vector<fs::path> inputs;
+    std::vector<fs::path> outputs;
+    for (const auto i : to_convert)
+    {
+      inputs.push_back(input_lily_files[i]);
+      outputs.push_back(output_bin_files[i]);
+    }
+
+    const auto errors = convert(lilypond_command, inputs, outputs, options, context);
+    for (size_t j = 0; j < to_convert.size(); ++j)
+    {
+      res[to_convert[j]] = errors[j];
+    }
+
+    for (const auto& entry : entries)
+    {
+      if (must_convert[entry.file] and res[entry.file].empty())
+      {
+	put_in_cache(options.cache_directory, entry.key, entry.output_file, context.log());
+      }
+    }
+  }
+
+  return res;
+}
+
+void generate_bin_file(const std::string& lilypond_command,
+		       const fs::path& input_lily_file,
+		       const fs::path& output_bin_file,
+		       const conversion_options& options,
+		       const conversion_context& context)
+{
+  const auto errors = generate_bin_files(lilypond_command, { input_lily_file }, { output_bin_file },
+					 options, context);
+  if (not errors[0].empty())
+  {
+    throw std::runtime_error(errors[0]);
+  }
+}
+
+song_t generate_song(const std::string& lilypond_command,
+		     const fs::path& input_lily_file,
+		     const fs::path& include_directory,
+		     const conversion_options& options,
+		     const conversion_context& context)
+{
+  if (not options.layout_variants.empty())
+  {
+    throw std::invalid_argument("Error: a single song is given, the layout variants can't be rendered");
+  }
+
+  const auto lilypond_input_files = get_lilypond_input_files(input_lily_file, options, context);
+  const auto files = run_lilypond_passes(lilypond_command, lilypond_input_files, include_directory,
+					 options, context, nullptr);
+  return extract_parts(lilypond_input_files, files, 0, files.size(), options, context).at(0);
+}
+
+song_t generate_song_from_source(const std::string& lilypond_command,
+				 const std::string& lilypond_source,
+				 const fs::path& include_directory,
+				 const conversion_options& options,
+				 const conversion_context& context)
+{
+  // the lilypond passes copy the input file into the directory of the conversion
+  const auto source_directory = context.directory() / "source";
+  fs::create_directories(source_directory);
+
+  const auto input_lily_file = source_directory / "score.ly";
+  {
+    std::ofstream input (input_lily_file, std::ios::out | std::ios::binary | std::ios::trunc);
+    input << lilypond_source;
+    if (not input)
+    {
+      throw std::runtime_error(std::string{"Error: failed to write '"} + input_lily_file.c_str() + "'");
+    }
+  }
+
+  return generate_song(lilypond_command, input_lily_file,
+		       include_directory.empty() ? source_directory : include_directory, options, context);
+}
+
+void generate_bin_file_from_intermediates(const fs::path& intermediates_directory,
+					  const fs::path& output_bin_file,
+					  const conversion_options& options,
+					  const conversion_context& context)
+{
+  if (not options.layout_variants.empty())
+  {
+    throw std::invalid_argument("Error: the intermediate files are the ones of the music sheet's own layout");
+  }
+
+  const auto files = find_intermediate_files(intermediates_directory, options, context.log());
+  auto song = extract_songs(files, options, context).at(0);
+  if (options.bars.last != 0)
+  {
+    keep_bars(song, options.bars, context.log());
+  }
+  save_song(song, output_bin_file, options);
+  context.stage_done("output");
+}
+
+std::unique_ptr<lilypond_worker_pool> start_lilypond_workers(const std::string& lilypond_command,
+							     const fs::path& directory,
+							     const fs::path& runtime_directory,
+							     unsigned int nb_workers)
+{
+  fs::create_directories(directory);
+  const auto embedded_files_directory = runtime_directory.empty() ? directory : runtime_directory;
+  const fs::path worker_file = embedded_files_directory / "lilypond-worker.scm";
+  const fs::path preloader_file = embedded_files_directory / "open_preloader.so";
+  if (runtime_directory.empty())
+  {
+    copy_lilypond_worker_to(worker_file);
+    copy_open_preloader_to(preloader_file);
+  }
+
+  return std::make_unique<lilypond_worker_pool>(lilypond_command, worker_file, preloader_file, directory,
+						runtime_directory, nb_workers);
+}
+
+// a file of the runtime directory. Several lilydumper processes can prepare the directory at the
+// same time, each file appears at once, complete.
+static
+void write_runtime_file(const unsigned char* const data, int size, const fs::path& file)
+{
+  auto tmp_file = file;
+  tmp_file += ".tmp-" + std::to_string(::getpid());
+  copy_buffer_to(reinterpret_cast<const char*>(data), size, tmp_file);
+  fs::rename(tmp_file, file);
+}
+
+runtime_directory::runtime_directory(const fs::path& directory, int lock_fd)
+  : _directory(directory)
+  , _lock_fd(lock_fd)
+{
+}
+
+runtime_directory::~runtime_directory()
+{
+  ::close(_lock_fd); // releases the lock
+}
+
+const fs::path& runtime_directory::directory() const
+{
+  return _directory;
+}
+
+// opens and locks the lock file of a runtime directory, shared by its users or exclusive to remove
+// it. Without wait, gives -1 when another process holds a lock on it.
+static
+int lock_runtime_directory(const fs::path& lock_file, short type, bool wait)
+{
+  for (;;)
+  {
+    const int fd = ::open(lock_file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd == -1)
+    {
+      throw std::runtime_error(std::string{"Error: failed to open the lock file '"} + lock_file.string() + "' (" +
+			       strerror(errno) + ")");
+    }
+
+    // fcntl locks, unlike flock ones, also work on network file systems
+    struct flock lock {};
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    int res = 0;
+    while (((res = ::fcntl(fd, wait ? F_SETLKW : F_SETLK, &lock)) == -1) and (errno == EINTR))
+    {
+    }
+
+    if (res == -1)
+    {
+      const auto error = errno;
+      ::close(fd);
+      if ((not wait) and ((error == EACCES) or (error == EAGAIN)))
+      {
+	return -1;
+      }
+      throw std::runtime_error(std::string{"Error: failed to lock '"} + lock_file.string() + "' (" + strerror(error) + ")");
+    }
+
+    // the directory and its lock file may have been removed while waiting for the lock, the lock
+    // is then taken again on the new lock file
+    struct stat locked {};
+    struct stat current {};
+    if ((::fstat(fd, &locked) == 0) and (::stat(lock_file.c_str(), &current) == 0) and
+	(locked.st_dev == current.st_dev) and (locked.st_ino == current.st_ino))
+    {
+      return fd;
+    }
+    ::close(fd);
+  }
+}
+
+static
+fs::path get_lock_file(const fs::path& directory)
+{
+  auto res = directory;
+  res += ".lock";
+  return res;
+}
+
+std::unique_ptr<runtime_directory> prepare_runtime_directory(const fs::path& cache_root)
+{
+  // the directory is named after the embedded files, so that a new version of lilydumper doesn't
+  // use what the former one cached
+  sha256 hash;
+  hash.update(event_listener_scm, event_listener_scm_len);
+  hash.update(open_preloader_so, open_preloader_so_len);
+  hash.update(lilypond_worker_scm, lilypond_worker_scm_len);
+  const std::string prefix = runtime_directory_prefix;
+  const auto name = prefix + hash.hex_digest().substr(0, 16);
+
+  fs::create_directories(cache_root);
+  auto res = std::make_unique<runtime_directory>(cache_root / name,
+						 lock_runtime_directory(get_lock_file(cache_root / name), F_RDLCK, true));
+  const auto& directory = res->directory();
+
+  const auto ready_file = directory / "ready";
+  if (not fs::exists(ready_file))
+  {
+    fs::create_directories(directory / "xdg-cache");
+    fs::create_directories(directory / "patched");
+    write_runtime_file(event_listener_scm, event_listener_scm_len, directory / "event-listener.scm");
+    write_runtime_file(open_preloader_so, open_preloader_so_len, directory / "open_preloader.so");
+    write_runtime_file(lilypond_worker_scm, lilypond_worker_scm_len, directory / "lilypond-worker.scm");
+    std::ofstream{ready_file};
+  }
+
+  // the directories of the other versions, unless a process still uses them: lilypond loads the
+  // preloader and the event listener from there.
+  for (const auto& entry : fs::directory_iterator(cache_root))
+  {
+    const auto entry_name = entry.path().filename().string();
+    if ((entry_name == name) or (entry_name.compare(0, prefix.size(), prefix) != 0) or
+	not fs::is_directory(entry.path()))
+    {
+      continue;
+    }
+
+    const auto lock_file = get_lock_file(entry.path());
+    const auto lock_fd = lock_runtime_directory(lock_file, F_WRLCK, false);
+    if (lock_fd == -1)
+    {
+      continue;
+    }
+
+    std::error_code error;
+    fs::remove_all(entry.path(), error);
+    fs::remove(lock_file, error);
+    ::close(lock_fd);
+  }
+
+  return res;
 }
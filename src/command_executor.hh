@@ -1,11 +1,205 @@
 #pragma once
 
+#include <cstdint>
 #include <experimental/filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+#include "bar_number_events_extractor.hh"
+#include "conversion_context.hh"
+#include "cursor_boxes_extractor.hh"
+#include "utils.hh"
 
 namespace fs = std::experimental::filesystem;
 
+class lilypond_worker_pool;
+
+// where the time at which each note is played comes from
+enum class timing_source_t : uint8_t
+{
+  // a dedicated lilypond run with the repeats unfolded, reporting the notes through the event listener
+  notes_pass,
+
+  // the midi file written by the svg run, saving one lilypond run
+  midi,
+};
+
+// bars [first, last] of a song, as numbered on the music sheet
+struct bar_range_t
+{
+    uint16_t first;
+    uint16_t last;
+};
+
+// a layout the music sheet is rendered in, e.g. for phones
+struct layout_variant_t
+{
+    std::string name; // added to the name of the output file
+    fs::path paper_file; // included before the music sheet, with its \paper block
+};
+
+struct conversion_options
+{
+    // how many lilypond processes can run at the same time for a single conversion
+    unsigned int max_concurrent_passes;
+
+    // how many threads extract the results of lilypond for a single conversion (see
+    // extract_songs). 0 or 1 keeps them in a single thread.
+    unsigned int extraction_threads;
+
+    // also render the pages without skylines with lilypond, and check they are the same as the
+    // ones derived from the pages with skylines.
+    bool verify_clean_svgs;
+
+    timing_source_t timing_source;
+
+    // where converted files are kept to avoid converting the same input again. Empty when there is
+    // no cache.
+    fs::path cache_directory;
+
+    // when several files are converted by the same lilypond run, lilypond can split them between this
+    // many processes itself. 0 or 1 keeps them in a single process.
+    unsigned int lilypond_job_count;
+
+    // converts the top level \score and \bookpart blocks of a file as files of their own, and joins
+    // the results one after the other. Each part is laid out on its own pages. See split_into_parts.
+    bool split_parts;
+
+    // where lilypond keeps what can be reused from one run to the other, see
+    // prepare_runtime_directory. Empty to let each conversion copy the embedded files into its own
+    // temporary directory, and lilypond use its default caches.
+    fs::path runtime_directory;
+
+    // lilypond processes started in advance, which do the lilypond runs instead of new processes.
+    // nullptr to start a new process for each run.
+    lilypond_worker_pool* worker_pool;
+
+    // only keeps the bars of this range, for a preview: the events start when the range starts, and
+    // only the pages it is on are kept. When the song goes through the range several times
+    // (repeats), the first time is kept. The svg runs only engrave the bars of the range, and the
+    // notes of the other ones are left out before the chords and the cursors are extracted. The
+    // notes pass still goes through the whole song, as its repeats are unfolded. The timings must
+    // come from it, and the file can't be split into parts. bars.last = 0 keeps the whole song.
+    bar_range_t bars;
+
+    // only extracts the key events: lilypond renders no page, and the output file has no cursor and
+    // no page. The timings must come from the notes pass.
+    bool events_only;
+
+    // writes the output file in the progressive version of the file format (see file_format.md).
+    // A single file is written while lilypond runs: once the notes pass is done, the pages are
+    // written as lilypond renders them, with the events until the first chord of a page still to
+    // come, so that a player can start long before the conversion is done.
+    bool progressive_output;
+
+    // renders the music sheet in each of these layouts instead of its own. They share the notes pass
+    // and the key events, and each one gets its svg run and its output file (see get_output_files).
+    // What the music sheet sets itself in its \paper block wins over the settings of the layouts.
+    // The timings must come from the notes pass.
+    std::vector<layout_variant_t> layout_variants;
+
+    // extracts the pages one at a time once lilypond is done, and keeps each one only until the
+    // cursor boxes of its chords are found, so that the memory doesn't grow with the number of
+    // pages. The pages are not extracted while lilypond renders them then. The output is the same.
+    // Incompatible with progressive_output, which writes each page as soon as it is rendered.
+    bool stream_pages;
+};
+
+// parses "FROM:TO" into a bar range. Throws std::runtime_error when it is not a valid range.
+bar_range_t parse_bar_range(const std::string& str);
+
+// parses "NAME=PAPER_FILE" into a layout variant. Throws std::runtime_error when the name can't be
+// part of a file name, or the file doesn't exist.
+layout_variant_t parse_layout_variant(const std::string& str);
+
+// the files written for output_bin_file: itself, or <stem>-<name><extension> for each layout variant
+std::vector<fs::path> get_output_files(const fs::path& output_bin_file, const conversion_options& options);
+
+// what the output file is made of
+struct song_t
+{
+    std::vector<key_event> keyboard_events;
+    std::vector<cursor_box_t> cursor_boxes;
+    std::vector<bar_num_event_t> bar_num_events;
+    std::vector<std::string> staffs_to_instrument;
+    std::vector<fs::path> svg_files; // the clean pages, in the directory of the conversion
+};
+
+// the intermediate files and the debug data go to the directory of the context
 void generate_bin_file(const std::string& lilypond_command,
                        const fs::path& input_lily_file,
                        const fs::path& output_bin_file,
-                       const fs::path& output_tmp_directory,
-		       std::ofstream& output_debug_file);
+                       const conversion_options& options,
+		       const conversion_context& context);
+
+// converts several files with a single run of each lilypond pass, saving lilypond's startup time for
+// all but the first one. The files must be in the same directory, see can_share_lilypond_run. Gives
+// for each input file why its conversion failed, or an empty string when it succeeded.
+std::vector<std::string> generate_bin_files(const std::string& lilypond_command,
+					    const std::vector<fs::path>& input_lily_files,
+					    const std::vector<fs::path>& output_bin_files,
+					    const conversion_options& options,
+					    const conversion_context& context);
+
+// same as generate_bin_file, but gives the song instead of saving it, and doesn't use the cache nor
+// the layout variants. lilypond looks for the included files in include_directory instead of next
+// to the input file.
+song_t generate_song(const std::string& lilypond_command,
+		     const fs::path& input_lily_file,
+		     const fs::path& include_directory,
+		     const conversion_options& options,
+		     const conversion_context& context);
+
+// same as generate_song, for the content of a .ly file, which is written into the directory of the
+// context. An empty include_directory looks for the included files next to it, where there are none.
+song_t generate_song_from_source(const std::string& lilypond_command,
+				 const std::string& lilypond_source,
+				 const fs::path& include_directory,
+				 const conversion_options& options,
+				 const conversion_context& context);
+
+// saves the song into output_bin_file, in the progressive version of the file format when
+// conversion_options::progressive_output is set
+void save_song(const song_t& song, const fs::path& output_bin_file, const conversion_options& options);
+
+bool can_share_lilypond_run(const fs::path& input_lily_file_a, const fs::path& input_lily_file_b);
+
+// same as generate_bin_file, but reuses the files the lilypond runs left in the temporary directory of a
+// previous conversion instead of running lilypond again.
+void generate_bin_file_from_intermediates(const fs::path& intermediates_directory,
+					  const fs::path& output_bin_file,
+					  const conversion_options& options,
+					  const conversion_context& context);
+
+// starts nb_workers lilypond processes of each kind (with and without the repeats unfolded), which
+// keep their files in directory. See lilypond_worker_pool.
+std::unique_ptr<lilypond_worker_pool> start_lilypond_workers(const std::string& lilypond_command,
+							     const fs::path& directory,
+							     const fs::path& runtime_directory,
+							     unsigned int nb_workers);
+
+// a runtime directory (see prepare_runtime_directory), which is in use for as long as this lives:
+// it holds a shared lock on <directory>.lock, so that no other version of lilydumper removes it.
+class runtime_directory
+{
+  public:
+    runtime_directory(const fs::path& directory, int lock_fd);
+    ~runtime_directory();
+
+    runtime_directory(const runtime_directory&) = delete;
+    runtime_directory& operator=(const runtime_directory&) = delete;
+
+    // to set in conversion_options::runtime_directory
+    const fs::path& directory() const;
+
+  private:
+    const fs::path _directory;
+    const int _lock_fd;
+};
+
+// prepares, in cache_root, the directory kept from one lilydumper run to the other: the embedded
+// files (event listener, preloader, worker), the cache of the patched music functions, and the
+// caches of guile and fontconfig of the lilypond processes (through XDG_CACHE_HOME). The directory
+// is named after the embedded files. The ones of other versions of lilydumper are removed, unless a
+// process still uses them. The directory must be kept until the last lilypond process is done.
+std::unique_ptr<runtime_directory> prepare_runtime_directory(const fs::path& cache_root);
@@ -0,0 +1,81 @@
+#include <fstream>
+#include "command_executor.hh"
+#include "unit_test.hh"
+
+static
+void test_parse_bar_range()
+{
+  const auto bars = parse_bar_range("12:16");
+  CHECK((bars.first == 12) and (bars.last == 16));
+
+  const auto single_bar = parse_bar_range("3:3");
+  CHECK((single_bar.first == 3) and (single_bar.last == 3));
+
+  CHECK(parse_bar_range("0:1").first == 0);
+  CHECK(parse_bar_range("1:65535").last == 65535);
+
+  CHECK_THROWS(parse_bar_range(""));
+  CHECK_THROWS(parse_bar_range("12"));
+  CHECK_THROWS(parse_bar_range("12:"));
+  CHECK_THROWS(parse_bar_range(":16"));
+  CHECK_THROWS(parse_bar_range("a:16"));
+  CHECK_THROWS(parse_bar_range("-1:16"));
+  CHECK_THROWS(parse_bar_range("16:12"));
+  CHECK_THROWS(parse_bar_range("0:0"));
+  CHECK_THROWS(parse_bar_range("1:65536"));
+  CHECK_THROWS(parse_bar_range("1:123456"));
+}
+
+static
+void test_parse_layout_variant()
+{
+  const test_directory directory;
+  const auto paper_file = directory.path() / "phone.ly";
+  std::ofstream{paper_file} << "\\paper { line-width = 60\\mm }\n";
+
+  const auto layout = parse_layout_variant("phone-2_b=" + paper_file.string());
+  CHECK(layout.name == "phone-2_b");
+  CHECK(layout.paper_file == paper_file);
+
+  CHECK_THROWS(parse_layout_variant("phone"));
+  CHECK_THROWS(parse_layout_variant("=" + paper_file.string()));
+  CHECK_THROWS(parse_layout_variant("phone="));
+  CHECK_THROWS(parse_layout_variant("pho ne=" + paper_file.string()));
+  CHECK_THROWS(parse_layout_variant("../phone=" + paper_file.string()));
+  CHECK_THROWS(parse_layout_variant("phone=" + (directory.path() / "missing.ly").string()));
+  CHECK_THROWS(parse_layout_variant("phone=" + directory.path().string()));
+}
+
+static
+void test_get_output_files()
+{
+  conversion_options options{ .max_concurrent_passes = 1,
+			      .extraction_threads = 1,
+			      .verify_clean_svgs = false,
+			      .timing_source = timing_source_t::notes_pass,
+			      .cache_directory = {},
+			      .lilypond_job_count = 0,
+			      .split_parts = false,
+			      .runtime_directory = {},
+			      .worker_pool = nullptr,
+			      .bars = { .first = 0, .last = 0 },
+			      .events_only = false,
+			      .progressive_output = false,
+			      .layout_variants = {},
+			      .stream_pages = false };
+
+  CHECK(get_output_files("/out/song.bin", options) == std::vector<fs::path>{ "/out/song.bin" });
+
+  options.layout_variants = { layout_variant_t{ .name = "phone", .paper_file = "/phone.ly" },
+			      layout_variant_t{ .name = "tablet", .paper_file = "/tablet.ly" } };
+  CHECK((get_output_files("/out/song.bin", options) ==
+	 std::vector<fs::path>{ "/out/song-phone.bin", "/out/song-tablet.bin" }));
+}
+
+int main()
+{
+  test_parse_bar_range();
+  test_parse_layout_variant();
+  test_get_output_files();
+  return test_result();
+}
@@ -4,3 +4,6 @@ static const char * const PATCHED_FILE_NAME = "patched_music_functions";
 static const char * const MUSIC_FUNCTIONS_FILENAME = "music-functions.scm";
 static const char * const MUSIC_FUNCTIONS_END_PATH = "/scm/music-functions.scm";
 static const char * const DUMP_OUTPUT_DIR = "LILYDUMPER_OUTPUT_DIR";
+
+// where the preloader keeps the patched music functions between the runs. Optional.
+static const char * const PATCHED_CACHE_DIR = "LILYDUMPER_PATCHED_CACHE_DIR";
@@ -0,0 +1,298 @@
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <set>
+#include <stdexcept>
+#include "conversion_cache.hh"
+#include "sha256.hh"
+
+// to change whenever lilydumper produces different .bin files from the same inputs, so that the
+// entries created by former versions are not used any more.
+constexpr const char* const cache_format_version = "lilydumper cache v1";
+
+static
+std::string get_file_content(const fs::path& filename)
+{
+  std::ifstream file (filename, std::ios::in | std::ios::binary);
+  if (not file.is_open())
+  {
+    throw std::runtime_error(std::string{"Error: failed to open '"} + filename.c_str() + "'");
+  }
+
+  return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// gives the names of the files included with \include "name". This is not a real lilypond parser:
+// comments and strings are skipped, but an \include coming from a music function or a variable is
+// not seen.
+static
+std::vector<std::string> get_included_files(const std::string& content)
+{
+  std::vector<std::string> res;
+  const std::string include_command = "\\include";
+
+  size_t pos = 0;
+  while (pos < content.size())
+  {
+    if (content.compare(pos, 2, "%{") == 0)
+    {
+      const auto end = content.find("%}", pos + 2);
+      pos = (end == std::string::npos) ? content.size() : end + 2;
+    }
+    else if (content[pos] == '%')
+    {
+      const auto end = content.find('\n', pos);
+      pos = (end == std::string::npos) ? content.size() : end + 1;
+    }
+    else if (content[pos] == '"')
+    {
+      ++pos;
+      while ((pos < content.size()) and (content[pos] != '"'))
+      {
+	pos += (content[pos] == '\\') ? 2u : 1u;
+      }
+      ++pos;
+    }
+    else if (content.compare(pos, include_command.size(), include_command) == 0)
+    {
+      pos = content.find_first_not_of(" \t\r\n", pos + include_command.size());
+      if ((pos != std::string::npos) and (content[pos] == '"'))
+      {
+	const auto end = content.find('"', pos + 1);
+	if (end != std::string::npos)
+	{
+	  res.emplace_back(content.substr(pos + 1, end - pos - 1));
+	  pos = end + 1;
+	}
+      }
+    }
+    else
+    {
+      ++pos;
+    }
+  }
+
+  return res;
+}
+
+static
+void add_key_part(sha256& hash, const std::string& part)
+{
+  // the length goes first so that the parts can't be mistaken for one another
+  hash.update(std::to_string(part.size()) + ":");
+  hash.update(part);
+}
+
+// lilypond looks for included files next to the including file, and in the directory of the input
+// file which is passed with --include. Files not found there are part of lilypond itself and
+// covered by its version. Gives an empty path for them.
+static
+fs::path find_included_file(const std::string& name, const fs::path& including_dir, const fs::path& input_lily_dir)
+{
+  for (const auto& dir : { including_dir, input_lily_dir })
+  {
+    if (fs::is_regular_file(dir / name))
+    {
+      return fs::canonical(dir / name);
+    }
+  }
+
+  return {};
+}
+
+static
+void add_file_and_includes(sha256& hash,
+			   const fs::path& filename,
+			   const fs::path& input_lily_dir,
+			   std::set<fs::path>& seen_files,
+			   std::ostream& output_debug_file)
+{
+  const auto content = get_file_content(filename);
+  add_key_part(hash, content);
+  output_debug_file << "  " << filename.c_str() << "\n";
+
+  const auto including_dir = fs::absolute(filename).parent_path();
+  for (const auto& name : get_included_files(content))
+  {
+    add_key_part(hash, name);
+
+    const auto included_file = find_included_file(name, including_dir, input_lily_dir);
+    if (included_file.empty())
+    {
+      add_key_part(hash, "not found");
+    }
+    else if (seen_files.insert(included_file).second)
+    {
+      add_file_and_includes(hash, included_file, input_lily_dir, seen_files, output_debug_file);
+    }
+  }
+}
+
+std::string get_cache_key(const fs::path& input_lily_file,
+			  const std::vector<std::string>& key_parts,
+			  std::ostream& output_debug_file)
+{
+  sha256 hash;
+  add_key_part(hash, cache_format_version);
+  for (const auto& part : key_parts)
+  {
+    add_key_part(hash, part);
+  }
+
+  // the name of the input file ends up in the names of the svg files
+  add_key_part(hash, input_lily_file.filename().string());
+
+  output_debug_file << "Files part of the cache key:\n";
+  const auto input_file = fs::canonical(input_lily_file);
+  std::set<fs::path> seen_files { input_file };
+  add_file_and_includes(hash, input_file, input_file.parent_path(), seen_files, output_debug_file);
+
+  const auto res = hash.hex_digest();
+  output_debug_file << "Cache key: " << res << "\n\n";
+  return res;
+}
+
+std::vector<fs::path> get_input_and_included_files(const fs::path& input_lily_file)
+{
+  const auto input_file = fs::canonical(input_lily_file);
+  std::vector<fs::path> res { input_file };
+
+  // res grows while it is walked through, with the files included by the ones already in it
+  for (size_t i = 0; i < res.size(); ++i)
+  {
+    const auto including_dir = res[i].parent_path();
+    for (const auto& name : get_included_files(get_file_content(res[i])))
+    {
+      const auto included_file = find_included_file(name, including_dir, input_file.parent_path());
+      if ((not included_file.empty()) and (std::find(res.begin(), res.end(), included_file) == res.end()))
+      {
+	res.push_back(included_file);
+      }
+    }
+  }
+
+  return res;
+}
+
+// entries are spread in sub directories named after the first two characters of their key, to
+// avoid having too many files in a single directory.
+static
+fs::path get_entry_directory(const fs::path& cache_directory, const std::string& key)
+{
+  const auto res = cache_directory / key.substr(0, 2);
+  std::error_code ec;
+  fs::create_directories(res, ec); // can fail because another process just created it
+  if (not fs::is_directory(res))
+  {
+    throw std::runtime_error(std::string{"Error: failed to create the cache directory '"} + res.string() + "' (" + ec.message() + ")");
+  }
+
+  return res;
+}
+
+cache_entry_lock::cache_entry_lock(const fs::path& cache_directory, const std::string& key)
+  : _fd(-1)
+{
+  const auto lock_file = get_entry_directory(cache_directory, key) / (key + ".lock");
+  _fd = ::open(lock_file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (_fd == -1)
+  {
+    throw std::runtime_error(std::string{"Error: failed to open the lock file '"} + lock_file.string() + "' (" + strerror(errno) + ")");
+  }
+
+  // fcntl locks, unlike flock ones, also work on network file systems. Open file description locks
+  // are used rather than the classic ones, which belong to the whole process: these would not
+  // exclude the threads of a batch converting the same score, and closing any other descriptor of
+  // the file would release them.
+  struct flock lock {};
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_pid = 0;
+  while (::fcntl(_fd, F_OFD_SETLKW, &lock) == -1)
+  {
+    if (errno != EINTR)
+    {
+      const auto error = errno;
+      ::close(_fd);
+      throw std::runtime_error(std::string{"Error: failed to lock '"} + lock_file.string() + "' (" + strerror(error) + ")");
+    }
+  }
+}
+
+cache_entry_lock::~cache_entry_lock()
+{
+  ::close(_fd); // releases the lock
+}
+
+// clones the file when the file system supports it (e.g. btrfs or xfs), which is instantaneous and
+// shares the blocks on disk. Otherwise copies it.
+static
+void copy_or_clone_file(const fs::path& from, const fs::path& to)
+{
+  const int src_fd = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (src_fd == -1)
+  {
+    throw std::runtime_error(std::string{"Error: failed to open '"} + from.string() + "' (" + strerror(errno) + ")");
+  }
+
+  const int dst_fd = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (dst_fd == -1)
+  {
+    const auto error = errno;
+    ::close(src_fd);
+    throw std::runtime_error(std::string{"Error: failed to open '"} + to.string() + "' (" + strerror(error) + ")");
+  }
+
+  const bool cloned = (::ioctl(dst_fd, FICLONE, src_fd) == 0);
+  ::close(src_fd);
+  ::close(dst_fd);
+
+  if (not cloned)
+  {
+    fs::copy_file(from, to, fs::copy_options::overwrite_existing);
+  }
+}
+
+bool get_from_cache(const fs::path& cache_directory,
+		    const std::string& key,
+		    const fs::path& output_bin_file,
+		    std::ostream& output_debug_file)
+{
+  const auto entry = get_entry_directory(cache_directory, key) / (key + ".bin");
+  if (not fs::is_regular_file(entry))
+  {
+    output_debug_file << "Cache miss, " << entry.c_str() << " does not exist\n\n";
+    return false;
+  }
+
+  copy_or_clone_file(entry, output_bin_file);
+  output_debug_file << "Cache hit, copied " << entry.c_str() << "\n\n";
+  return true;
+}
+
+void put_in_cache(const fs::path& cache_directory,
+		  const std::string& key,
+		  const fs::path& bin_file,
+		  std::ostream& output_debug_file)
+{
+  const auto entry_directory = get_entry_directory(cache_directory, key);
+  const auto entry = entry_directory / (key + ".bin");
+
+  // written under another name first and then renamed, so that nobody can see a partially written
+  // entry, even if the lock is not honoured. The host name avoids clashes between machines sharing
+  // the directory, the counter between threads of a batch.
+  static std::atomic<unsigned int> nb_entries_written { 0 };
+  std::array<char, 256> host_name {};
+  ::gethostname(host_name.data(), host_name.size() - 1);
+  const auto tmp_entry = entry_directory / (key + ".tmp." + host_name.data() + "." + std::to_string(::getpid()) +
+					    "." + std::to_string(nb_entries_written++));
+
+  copy_or_clone_file(bin_file, tmp_entry);
+  fs::rename(tmp_entry, entry);
+  output_debug_file << "Stored the result in the cache as " << entry.c_str() << "\n";
+}
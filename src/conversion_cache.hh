@@ -0,0 +1,46 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include "utils.hh"
+
+// The conversion cache stores the generated .bin files under a hash of everything they depend on:
+// the input file, the files it includes, lilypond's version and the files lilydumper embeds. Several
+// lilydumper processes, possibly on different machines, can share the same cache directory.
+
+// key_parts are the other things the conversion depends on, e.g. lilypond's version.
+std::string get_cache_key(const fs::path& input_lily_file,
+			  const std::vector<std::string>& key_parts,
+			  std::ostream& output_debug_file);
+
+// the input file followed by the files it includes, directly or not, the same way the cache key
+// finds them.
+std::vector<fs::path> get_input_and_included_files(const fs::path& input_lily_file);
+
+// holds an exclusive lock on a cache entry for as long as it lives, so that a score converted by
+// several processes or threads at the same time is only converted once. The others wait and then
+// find the result in the cache.
+class cache_entry_lock
+{
+  public:
+    cache_entry_lock(const fs::path& cache_directory, const std::string& key);
+    ~cache_entry_lock();
+
+    cache_entry_lock(const cache_entry_lock&) = delete;
+    cache_entry_lock& operator=(const cache_entry_lock&) = delete;
+
+  private:
+    int _fd;
+};
+
+// copies the cached .bin file to output_bin_file. Returns false when there is no such entry.
+bool get_from_cache(const fs::path& cache_directory,
+		    const std::string& key,
+		    const fs::path& output_bin_file,
+		    std::ostream& output_debug_file);
+
+void put_in_cache(const fs::path& cache_directory,
+		  const std::string& key,
+		  const fs::path& bin_file,
+		  std::ostream& output_debug_file);
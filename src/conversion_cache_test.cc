@@ -0,0 +1,150 @@
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <thread>
+#include "conversion_cache.hh"
+#include "unit_test.hh"
+
+static
+fs::path write_file(const fs::path& filename, const std::string& content)
+{
+  std::ofstream{filename, std::ios::out | std::ios::binary | std::ios::trunc} << content;
+  return filename;
+}
+
+static
+std::string read_file(const fs::path& filename)
+{
+  std::ifstream file (filename, std::ios::in | std::ios::binary);
+  return std::string{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+}
+
+static
+std::string get_key(const fs::path& input_lily_file, const std::vector<std::string>& key_parts = { "2.18.2" })
+{
+  std::ostringstream log;
+  return get_cache_key(input_lily_file, key_parts, log);
+}
+
+static
+void test_cache_key()
+{
+  const test_directory directory;
+  const auto song = write_file(directory.path() / "song.ly", "\\include \"notes.ily\"\n\\score { \\melody }\n");
+  write_file(directory.path() / "notes.ily", "melody = { c'4 }\n");
+
+  const auto key = get_key(song);
+  CHECK(key.size() == 64);
+  CHECK(key.find_first_not_of("0123456789abcdef") == std::string::npos);
+
+  // the same inputs give the same key
+  CHECK(get_key(song) == key);
+
+  // the other parts of the key
+  CHECK(get_key(song, { "2.20.0" }) != key);
+  CHECK(get_key(song, { "2.18.2", "" }) != key);
+  // the parts can't be mistaken for one another
+  CHECK(get_key(song, { "ab", "c" }) != get_key(song, { "a", "bc" }));
+
+  // the included files are part of the key
+  write_file(directory.path() / "notes.ily", "melody = { d'4 }\n");
+  const auto key_with_new_include = get_key(song);
+  CHECK(key_with_new_include != key);
+
+  // and so is the name of the input file, which the pages are named after
+  fs::create_directory(directory.path() / "other");
+  const auto copy = write_file(directory.path() / "other" / "copy.ly", read_file(song));
+  write_file(directory.path() / "other" / "notes.ily", "melody = { d'4 }\n");
+  CHECK(get_key(copy) != key_with_new_include);
+  fs::rename(copy, directory.path() / "other" / "song.ly");
+  CHECK(get_key(directory.path() / "other" / "song.ly") == key_with_new_include);
+
+  // an include in a comment is not followed
+  const auto commented = write_file(directory.path() / "commented.ly", "% \\include \"notes.ily\"\n{ c'4 }\n");
+  const auto commented_key = get_key(commented);
+  write_file(directory.path() / "notes.ily", "melody = { e'4 }\n");
+  CHECK(get_key(commented) == commented_key);
+}
+
+static
+void test_included_files()
+{
+  const test_directory directory;
+  fs::create_directory(directory.path() / "lib");
+  const auto song = write_file(directory.path() / "song.ly",
+			       "\\include \"lib/a.ily\"\n"
+			       "\\include \"english.ly\"\n"
+			       "%{ \\include \"lib/commented.ily\" %}\n");
+  // relative to the including file first, then to the input file
+  write_file(directory.path() / "lib" / "a.ily", "\\include \"b.ily\"\n\\include \"c.ily\"\n");
+  write_file(directory.path() / "lib" / "b.ily", "\\include \"a.ily\"\n");
+  write_file(directory.path() / "c.ily", "");
+  write_file(directory.path() / "lib" / "commented.ily", "");
+
+  const auto canonical_dir = fs::canonical(directory.path());
+  CHECK((get_input_and_included_files(song) ==
+	 std::vector<fs::path>{ canonical_dir / "song.ly",
+				canonical_dir / "lib" / "a.ily",
+				canonical_dir / "lib" / "b.ily",
+				canonical_dir / "c.ily" }));
+}
+
+static
+void test_cache_entries()
+{
+  const test_directory directory;
+  const auto cache_directory = directory.path() / "cache";
+  const std::string key = "0123456789abcdef";
+  std::ostringstream log;
+
+  CHECK(not get_from_cache(cache_directory, key, directory.path() / "out.bin", log));
+  CHECK(not fs::exists(directory.path() / "out.bin"));
+
+  {
+    const cache_entry_lock lock (cache_directory, key);
+    put_in_cache(cache_directory, key, write_file(directory.path() / "song.bin", "LPYP content"), log);
+  }
+
+  CHECK(fs::is_regular_file(cache_directory / "01" / (key + ".bin")));
+  CHECK(get_from_cache(cache_directory, key, directory.path() / "out.bin", log));
+  CHECK(read_file(directory.path() / "out.bin") == "LPYP content");
+}
+
+// the lock excludes the threads of a process too, and closing another descriptor of the lock file
+// doesn't release it
+static
+void test_cache_entry_lock()
+{
+  const test_directory directory;
+  const auto cache_directory = directory.path() / "cache";
+  const std::string key = "0123456789abcdef";
+
+  std::atomic<bool> is_released { false };
+  std::atomic<bool> was_released_before { false };
+  std::thread other_thread;
+  {
+    const cache_entry_lock lock (cache_directory, key);
+    other_thread = std::thread([&] () {
+	const cache_entry_lock other_lock (cache_directory, key);
+	was_released_before = is_released.load();
+      });
+
+    std::ifstream{cache_directory / "01" / (key + ".lock")}.close();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    is_released = true;
+  }
+  other_thread.join();
+
+  CHECK(was_released_before);
+}
+
+int main()
+{
+  test_cache_key();
+  test_included_files();
+  test_cache_entries();
+  test_cache_entry_lock();
+  return test_result();
+}
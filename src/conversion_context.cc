@@ -0,0 +1,139 @@
+#include <fstream>
+#include <iostream>
+#include "conversion_context.hh"
+
+conversion_context::conversion_context(const fs::path& directory, std::ostream& log)
+  : _directory(directory)
+  , _log(log)
+  , _stage_listener()
+{
+}
+
+conversion_context conversion_context::with_log(std::ostream& log) const
+{
+  auto res = *this;
+  res._log = log;
+  return res;
+}
+
+conversion_context conversion_context::in_sub_directory(const std::string& name) const
+{
+  auto res = *this;
+  res._directory /= name;
+  fs::create_directories(res._directory);
+  return res;
+}
+
+conversion_context conversion_context::with_stage_listener(const stage_listener& listener) const
+{
+  auto res = *this;
+  res._stage_listener = listener;
+  return res;
+}
+
+void conversion_context::stage_done(const char* stage) const
+{
+  if (_stage_listener)
+  {
+    _stage_listener(stage);
+  }
+}
+
+void debug_dump(const conversion_context& context, const std::vector<note_t>& song, const char* const out_filename)
+{
+  const auto out_file = context.directory() / out_filename;
+
+  std::ofstream file(out_file,
+		     std::ios::binary | std::ios::trunc | std::ios::out);
+
+  if (not file.is_open())
+  {
+    std::cerr << "Error: could not open " << out_file << " for writing.\n";
+    return;
+  }
+
+  for (const auto& event : song)
+  {
+      file << event.start_time << "\n";
+  }
+
+}
+
+
+void debug_dump(const conversion_context& context, const std::vector<key_event>& song, const char* const out_filename)
+{
+  const auto out_file = context.directory() / out_filename;
+
+  std::ofstream file(out_file,
+		     std::ios::binary | std::ios::trunc | std::ios::out);
+
+  if (not file.is_open())
+  {
+    std::cerr << "Error: could not open " << out_file << " for writing.\n";
+    return;
+  }
+
+  for (const auto& event : song)
+  {
+    if (event.data.ev_type == key_data::pressed)
+    {
+      file << event.time << " down " << static_cast<int>(event.data.pitch) << "\n";
+    }
+
+    if (event.data.ev_type == key_data::released)
+    {
+      file << event.time << " up " << static_cast<int>(event.data.pitch) << "\n";
+    }
+
+  }
+
+}
+
+
+void debug_dump(const conversion_context& context, const std::vector<chord_t>& chords, const char* const out_filename)
+{
+  const auto out_file = context.directory() / out_filename;
+
+  std::ofstream file(out_file,
+		     std::ios::binary | std::ios::trunc | std::ios::out);
+
+  if (not file.is_open())
+  {
+    std::cerr << "Error: could not open " << out_file << " for writing.\n";
+    return;
+  }
+
+  for (const auto& chord : chords)
+  {
+    const auto start_time = chord.notes[0].start_time;
+    file << start_time;
+
+    for (const auto& note : chord.notes)
+    {
+      file << "\n  " << static_cast<int>(note.pitch) << " -> " << note.stop_time;
+    }
+
+    file << "\n\n";
+  }
+}
+
+
+void debug_dump(const conversion_context& context, const std::vector<std::string>& strings, const char* const out_filename)
+{
+  const auto out_file = context.directory() / out_filename;
+
+  std::ofstream file(out_file,
+		     std::ios::binary | std::ios::trunc | std::ios::out);
+
+  if (not file.is_open())
+  {
+    std::cerr << "Error: could not open " << out_file << " for writing.\n";
+    return;
+  }
+
+  for (const auto& string : strings)
+  {
+    file << string << "\n";
+  }
+
+}
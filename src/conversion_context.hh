@@ -0,0 +1,59 @@
+#pragma once
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "utils.hh"
+
+// what a conversion carries from one step to the other: the directory where it keeps its
+// intermediate files and debug data, and the stream it logs to. Each conversion has its own, so that
+// several conversions can run at the same time in the same process.
+//
+// A stream can only be written by one thread at a time: the threads a conversion starts log
+// through a context of their own (see with_log), and their log is added to the conversion's one
+// when they are joined.
+class conversion_context
+{
+  public:
+    // called with the name of each step of the conversion once it is done
+    using stage_listener = std::function<void(const char* stage)>;
+
+    // the directory must exist. The log must outlive the context, and the contexts made from it.
+    conversion_context(const fs::path& directory, std::ostream& log);
+
+    const fs::path& directory() const
+    {
+      return _directory;
+    }
+
+    std::ostream& log() const
+    {
+      return _log.get();
+    }
+
+    // the same conversion, logging to another stream
+    conversion_context with_log(std::ostream& log) const;
+
+    // the same conversion, keeping its files in a sub directory, which is created. Used for each
+    // file converted along with others, so that their debug data don't replace each other.
+    conversion_context in_sub_directory(const std::string& name) const;
+
+    // the same conversion, telling the listener about its progress. The steps are "cache" (the
+    // output was found in the cache), "lilypond" (the lilypond runs are done), "extraction" (the
+    // song is extracted from their files) and "output" (the output file is written).
+    conversion_context with_stage_listener(const stage_listener& listener) const;
+
+    void stage_done(const char* stage) const;
+
+  private:
+    fs::path _directory;
+    std::reference_wrapper<std::ostream> _log;
+    stage_listener _stage_listener; // empty when nobody listens
+};
+
+// write the data into the directory of the conversion, for debugging purpose
+void debug_dump(const conversion_context& context, const std::vector<key_event>& song, const char* const out_filename);
+void debug_dump(const conversion_context& context, const std::vector<note_t>& song, const char* const out_filename);
+void debug_dump(const conversion_context& context, const std::vector<chord_t>& chord, const char* const out_filename);
+void debug_dump(const conversion_context& context, const std::vector<std::string>& strings, const char* const out_filename);
@@ -0,0 +1,582 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include "conversion_server.hh"
+
+// written by the signal handler to stop the server, see wait_for_client
+static int stop_pipe_write_fd = -1;
+
+static
+void on_stop_signal(int)
+{
+  const char c = 0;
+  [[maybe_unused]] const auto nb = ::write(stop_pipe_write_fd, &c, 1);
+}
+
+namespace
+{
+  // a connection to a client, read line by line. The socket is closed by its owner.
+  class connection
+  {
+    public:
+      explicit connection(int fd)
+	: _fd(fd)
+	, _buffer()
+      {
+      }
+
+      connection(const connection&) = delete;
+      connection& operator=(const connection&) = delete;
+
+      // gives the next line, without its newline. Returns false when the client closed the
+      // connection first.
+      bool read_line(std::string& line)
+      {
+	for (auto end = _buffer.find('\n'); end == std::string::npos; end = _buffer.find('\n'))
+	{
+	  if (not fill_buffer())
+	  {
+	    return false;
+	  }
+	}
+
+	const auto end = _buffer.find('\n');
+	line = _buffer.substr(0, end);
+	_buffer.erase(0, end + 1);
+	return true;
+      }
+
+      bool read_bytes(size_t nb_bytes, std::string& bytes)
+      {
+	while (_buffer.size() < nb_bytes)
+	{
+	  if (not fill_buffer())
+	  {
+	    return false;
+	  }
+	}
+
+	bytes = _buffer.substr(0, nb_bytes);
+	_buffer.erase(0, nb_bytes);
+	return true;
+      }
+
+      // a client which left doesn't stop the conversion of its request, its replies are lost
+      void write(const std::string& data)
+      {
+	for (size_t written = 0; written < data.size(); )
+	{
+	  const auto nb = ::send(_fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+	  if ((nb == -1) and (errno == EINTR))
+	  {
+	    continue;
+	  }
+	  if (nb <= 0)
+	  {
+	    return;
+	  }
+	  written += static_cast<size_t>(nb);
+	}
+      }
+
+    private:
+      bool fill_buffer()
+      {
+	std::array<char, 4096> data;
+	for (;;)
+	{
+	  const auto nb = ::read(_fd, data.data(), data.size());
+	  if ((nb == -1) and (errno == EINTR))
+	  {
+	    continue;
+	  }
+	  if (nb <= 0)
+	  {
+	    return false;
+	  }
+	  _buffer.append(data.data(), static_cast<size_t>(nb));
+	  return true;
+	}
+      }
+
+      const int _fd;
+      std::string _buffer; // what was read and not given yet
+  };
+
+  struct request_t
+  {
+      fs::path input_file; // empty when the source is sent inline
+      std::string source;
+      fs::path include_directory;
+      fs::path output_file;
+      conversion_options options;
+  };
+
+  // what the threads serving the clients share
+  struct server_state
+  {
+      server_state()
+	: mutex()
+	, client_arrived()
+	, waiting_clients()
+	, served_clients()
+	, stopping(false)
+	, nb_requests(0)
+	, nb_failed_requests(0)
+      {
+      }
+
+      std::mutex mutex;
+      std::condition_variable client_arrived;
+      std::deque<int> waiting_clients;
+      std::set<int> served_clients; // shut down to stop the server
+      bool stopping;
+      std::atomic<unsigned int> nb_requests; // numbers the directories of the requests
+      std::atomic<unsigned int> nb_failed_requests;
+  };
+}
+
+static
+fs::path get_absolute_path(const std::string& field, const std::string& value)
+{
+  const fs::path res {value};
+  if (not res.is_absolute())
+  {
+    throw std::runtime_error("Error: '" + field + "' must be an absolute path. Got '" + value + "'");
+  }
+  return res;
+}
+
+// reads the next request of the client. Returns false when the client closed the connection instead
+// of sending one.
+static
+bool read_request(connection& client, const conversion_options& defaults, request_t& request)
+{
+  request = request_t{ .input_file = {}, .source = {}, .include_directory = {}, .output_file = {},
+		       .options = defaults };
+  bool has_source = false;
+  bool is_empty = true;
+
+  std::string line;
+  while (client.read_line(line))
+  {
+    if (line.empty())
+    {
+      // empty lines between requests are ignored
+      if (is_empty)
+      {
+	continue;
+      }
+
+      if (has_source == not request.input_file.empty())
+      {
+	throw std::runtime_error("Error: a request must have either an 'input' or a 'source'");
+      }
+
+      if (request.output_file.empty())
+      {
+	throw std::runtime_error("Error: a request must have an 'output'");
+      }
+
+      if (not (has_source or request.include_directory.empty()))
+      {
+	throw std::runtime_error("Error: 'include-directory' only applies to a 'source'");
+      }
+
+      if (request.options.stream_pages and request.options.progressive_output)
+      {
+	throw std::runtime_error("Error: 'stream-pages' can't be used with 'progressive'");
+      }
+
+      return true;
+    }
+
+    is_empty = false;
+    const auto space = line.find(' ');
+    const auto field = line.substr(0, space);
+    const auto value = (space == std::string::npos) ? std::string{} : line.substr(space + 1);
+
+    if (field == "input")
+    {
+      request.input_file = get_absolute_path(field, value);
+    }
+    else if (field == "source")
+    {
+      if (value.empty() or (value.find_first_not_of("0123456789") != std::string::npos))
+      {
+	throw std::runtime_error("Error: 'source' must be followed by the size of the source. Got '" + value + "'");
+      }
+
+      std::string end_of_source;
+      if ((not client.read_bytes(std::stoul(value), request.source)) or (not client.read_line(end_of_source)))
+      {
+	break;
+      }
+
+      if (not end_of_source.empty())
+      {
+	throw std::runtime_error("Error: the source is longer than the size given");
+      }
+      has_source = true;
+    }
+    else if (field == "include-directory")
+    {
+      request.include_directory = get_absolute_path(field, value);
+    }
+    else if (field == "output")
+    {
+      request.output_file = get_absolute_path(field, value);
+    }
+    else if (field == "timing-source")
+    {
+      if (value == "notes-pass")
+      {
+	request.options.timing_source = timing_source_t::notes_pass;
+      }
+      else if (value == "midi")
+      {
+	request.options.timing_source = timing_source_t::midi;
+      }
+      else
+      {
+	throw std::runtime_error("Error: unknown timing source '" + value + "'. Expected 'notes-pass' or 'midi'");
+      }
+    }
+    else if (field == "split-parts")
+    {
+      request.options.split_parts = true;
+    }
+    else if (field == "bars")
+    {
+      request.options.bars = parse_bar_range(value);
+    }
+    else if (field == "events-only")
+    {
+      request.options.events_only = true;
+    }
+    else if (field == "progressive")
+    {
+      request.options.progressive_output = true;
+    }
+    else if (field == "layout-variant")
+    {
+      const auto separator = value.find('=');
+      if (separator != std::string::npos)
+      {
+	get_absolute_path(field, value.substr(separator + 1));
+      }
+      request.options.layout_variants.push_back(parse_layout_variant(value));
+    }
+    else if (field == "stream-pages")
+    {
+      request.options.stream_pages = true;
+    }
+    else if (field == "verify-clean-svgs")
+    {
+      request.options.verify_clean_svgs = true;
+    }
+    else
+    {
+      throw std::runtime_error("Error: unknown field '" + field + "'");
+    }
+  }
+
+  if (not is_empty)
+  {
+    throw std::runtime_error("Error: the connection was closed in the middle of a request");
+  }
+  return false;
+}
+
+static
+std::string to_milliseconds(std::chrono::steady_clock::duration duration)
+{
+  return std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(duration).count());
+}
+
+static
+void reply_error(connection& client, const std::string& error)
+{
+  client.write("error " + std::to_string(error.size()) + "\n" + error + "\n");
+}
+
+static
+void convert_request(const request_t& request, const server_options& options, server_state& state,
+		     connection& client)
+{
+  const auto directory = options.directory / ("request-" + std::to_string(++state.nb_requests));
+  fs::create_directories(directory);
+  std::ofstream log_stream ((directory / "logs").string());
+
+  const auto start = std::chrono::steady_clock::now();
+  auto stage_start = start;
+  const auto context = conversion_context(directory, log_stream).with_stage_listener([&] (const char* stage) {
+      const auto now = std::chrono::steady_clock::now();
+      client.write(std::string{"stage "} + stage + " " + to_milliseconds(now - stage_start) + "\n");
+      stage_start = now;
+    });
+
+  std::string error;
+  try
+  {
+    if (request.input_file.empty())
+    {
+      // the inline sources are not looked for in the cache, which identifies the files by their path
+      const auto song = generate_song_from_source(options.lilypond_command, request.source,
+						  request.include_directory, request.options, context);
+      save_song(song, request.output_file, request.options);
+      context.stage_done("output");
+    }
+    else
+    {
+      log_stream << "Converting '" << request.input_file.string() << "' to '" << request.output_file.string() << "'\n\n";
+      generate_bin_file(options.lilypond_command, request.input_file, request.output_file, request.options, context);
+    }
+  }
+  catch (const std::exception& e)
+  {
+    error = e.what();
+  }
+  log_stream.close();
+
+  if (not error.empty())
+  {
+    ++state.nb_failed_requests;
+    reply_error(client, error + "\nThe intermediate files are kept in '" + directory.string() + "'.");
+    return;
+  }
+
+  client.write("done " + to_milliseconds(std::chrono::steady_clock::now() - start) + "\n");
+  if (not options.keep_intermediates)
+  {
+    fs::remove_all(directory);
+  }
+}
+
+static
+void serve_client(int fd, const server_options& options, server_state& state)
+{
+  connection client (fd);
+  try
+  {
+    auto request = request_t{ .input_file = {}, .source = {}, .include_directory = {}, .output_file = {},
+			     .options = options.conversion };
+    while (read_request(client, options.conversion, request))
+    {
+      convert_request(request, options, state, client);
+    }
+  }
+  catch (const std::exception& e)
+  {
+    reply_error(client, e.what());
+  }
+}
+
+static
+void serve_clients(const server_options& options, server_state& state)
+{
+  for (;;)
+  {
+    std::unique_lock<std::mutex> lock (state.mutex);
+    state.client_arrived.wait(lock, [&] () {
+	return state.stopping or not state.waiting_clients.empty();
+      });
+    if (state.stopping)
+    {
+      return;
+    }
+
+    const auto fd = state.waiting_clients.front();
+    state.waiting_clients.pop_front();
+    state.served_clients.insert(fd);
+    lock.unlock();
+
+    serve_client(fd, options, state);
+
+    // closed once the server can't shut it down anymore, as its number can be given to a new file
+    lock.lock();
+    state.served_clients.erase(fd);
+    ::close(fd);
+  }
+}
+
+static
+sockaddr_un get_socket_address(const fs::path& socket_file)
+{
+  sockaddr_un res {};
+  res.sun_family = AF_UNIX;
+  if (socket_file.string().size() >= sizeof(res.sun_path))
+  {
+    throw std::runtime_error("Error: the socket path '" + socket_file.string() + "' is too long");
+  }
+  strncpy(res.sun_path, socket_file.c_str(), sizeof(res.sun_path) - 1);
+  return res;
+}
+
+static
+int listen_on(const fs::path& socket_file)
+{
+  const auto address = get_socket_address(socket_file);
+
+  // a socket left by a server which didn't stop properly is replaced, not one which is still served
+  if (fs::exists(socket_file))
+  {
+    const auto probe_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    const bool is_served = (probe_fd != -1) and
+      (::connect(probe_fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == 0);
+    if (probe_fd != -1)
+    {
+      ::close(probe_fd);
+    }
+
+    if (is_served)
+    {
+      throw std::runtime_error("Error: a server already listens on '" + socket_file.string() + "'");
+    }
+    fs::remove(socket_file);
+  }
+
+  const auto fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+  {
+    throw std::runtime_error(std::string{"Error: failed to create a socket ("} + strerror(errno) + ")");
+  }
+
+  if ((::bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == -1) or
+      (::listen(fd, SOMAXCONN) == -1))
+  {
+    const auto error = errno;
+    ::close(fd);
+    throw std::runtime_error("Error: failed to listen on '" + socket_file.string() + "' (" + strerror(error) + ")");
+  }
+
+  return fd;
+}
+
+// waits for the next client. Returns -1 once the server must stop.
+static
+int wait_for_client(int listen_fd, int stop_fd)
+{
+  for (;;)
+  {
+    std::array<pollfd, 2> poll_fds {};
+    poll_fds[0].fd = listen_fd;
+    poll_fds[0].events = POLLIN;
+    poll_fds[1].fd = stop_fd;
+    poll_fds[1].events = POLLIN;
+
+    if (::poll(poll_fds.data(), poll_fds.size(), -1) == -1)
+    {
+      if (errno == EINTR)
+      {
+	continue;
+      }
+      throw std::runtime_error(std::string{"Error: failed to wait for clients ("} + strerror(errno) + ")");
+    }
+
+    if (poll_fds[1].revents != 0)
+    {
+      return -1;
+    }
+
+    const auto fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd != -1)
+    {
+      return fd;
+    }
+  }
+}
+
+bool serve(const server_options& options)
+{
+  std::array<int, 2> stop_pipe;
+  if (::pipe2(stop_pipe.data(), O_CLOEXEC) == -1)
+  {
+    throw std::runtime_error(std::string{"Error: failed to create a pipe ("} + strerror(errno) + ")");
+  }
+
+  const auto listen_fd = listen_on(options.socket_file);
+  std::cout << "Serving on '" << options.socket_file.string() << "'.\n" << std::flush;
+
+  // handled by writing to the pipe, so that the server stops between two clients
+  stop_pipe_write_fd = stop_pipe[1];
+  struct sigaction action {};
+  action.sa_handler = on_stop_signal;
+  ::sigemptyset(&action.sa_mask);
+  struct sigaction previous_int_action {};
+  struct sigaction previous_term_action {};
+  ::sigaction(SIGINT, &action, &previous_int_action);
+  ::sigaction(SIGTERM, &action, &previous_term_action);
+
+  server_state state;
+  std::vector<std::thread> threads;
+  for (unsigned int i = 0; i < options.nb_jobs; ++i)
+  {
+    threads.emplace_back([&] () { serve_clients(options, state); });
+  }
+
+  std::string error;
+  try
+  {
+    for (auto fd = wait_for_client(listen_fd, stop_pipe[0]); fd != -1; fd = wait_for_client(listen_fd, stop_pipe[0]))
+    {
+      const std::lock_guard<std::mutex> lock (state.mutex);
+      state.waiting_clients.push_back(fd);
+      state.client_arrived.notify_one();
+    }
+  }
+  catch (const std::exception& e)
+  {
+    error = e.what();
+  }
+
+  // the clients being served are disconnected, their conversions finish but their replies are lost
+  {
+    const std::lock_guard<std::mutex> lock (state.mutex);
+    state.stopping = true;
+    for (const auto fd : state.served_clients)
+    {
+      ::shutdown(fd, SHUT_RDWR);
+    }
+    for (const auto fd : state.waiting_clients)
+    {
+      ::close(fd);
+    }
+  }
+  state.client_arrived.notify_all();
+
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  ::sigaction(SIGINT, &previous_int_action, nullptr);
+  ::sigaction(SIGTERM, &previous_term_action, nullptr);
+  stop_pipe_write_fd = -1;
+  ::close(listen_fd);
+  ::close(stop_pipe[0]);
+  ::close(stop_pipe[1]);
+  fs::remove(options.socket_file);
+
+  if (not error.empty())
+  {
+    throw std::runtime_error(error);
+  }
+
+  return state.nb_failed_requests == 0;
+}
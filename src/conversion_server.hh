@@ -0,0 +1,53 @@
+#pragma once
+
+#include <string>
+#include "command_executor.hh"
+
+struct server_options
+{
+    fs::path socket_file;
+    std::string lilypond_command;
+
+    // the options of the requests which don't set them. The cache, the runtime directory and the
+    // worker pool are the ones of the server, shared by all the requests.
+    conversion_options conversion;
+
+    // where each request gets a directory of its own for its intermediate files and its log
+    fs::path directory;
+
+    // how many clients are served at the same time
+    unsigned int nb_jobs;
+
+    // keep the directory of the requests which succeeded too
+    bool keep_intermediates;
+};
+
+// Converts the requests sent on a unix socket until the process gets SIGINT or SIGTERM. The clients
+// save lilydumper's and lilypond's startup, and share the caches and the lilypond workers of the
+// server.
+//
+// A client sends requests one after the other on the same connection. A request is made of lines
+// "<field> <value>", and ends with an empty line:
+//   input <file>              the .ly file to convert, or
+//   source <size>             followed by a newline, size bytes of .ly source and a newline
+//   include-directory <dir>   where lilypond looks for the files the source includes
+//   output <file>             where the output file goes
+//   timing-source <source>    notes-pass or midi
+//   split-parts               see conversion_options::split_parts
+//   verify-clean-svgs         see conversion_options::verify_clean_svgs
+//   bars <from>:<to>          see conversion_options::bars
+//   events-only               see conversion_options::events_only
+//   progressive               see conversion_options::progressive_output
+//   layout-variant <name>=<paper file>
+//                             see conversion_options::layout_variants, can be given several times
+//   stream-pages              see conversion_options::stream_pages
+// The paths must be absolute. The sources sent inline are not looked for in the cache, which knows
+// the files by their path.
+//
+// The server replies with a line per step of the conversion once it is done, "stage <name>
+// <milliseconds>" (see conversion_context::with_stage_listener), then with "done <milliseconds>"
+// when the output file is written, or "error <size>" followed by a newline, size bytes of message
+// and a newline. A malformed request gets an error, and the connection is closed.
+//
+// Returns whether all the requests succeeded. The directories of the ones which failed are kept.
+bool serve(const server_options& options);
@@ -2,6 +2,7 @@
 #include <stdexcept>
 #include <string>
 #include <fstream>
+#include <unordered_map>
 #include "cursor_boxes_extractor.hh"
 
 static constexpr const char * const maybe_has_repeat_unfold_msg =
@@ -124,7 +125,7 @@ static uint8_t find_svg_pos(const std::vector<note_t>& notes,
 
 // return the note head in the svg file with that specific id
 static note_head_t get_note_head(const std::string& id,
-				 const svg_file_t svg_file,
+				 const svg_file_t& svg_file,
 				 const std::vector<note_t>& unprocessed_notes)
 {
   // sanity check: precondition there must be one, and only note
@@ -347,31 +348,14 @@ static uint8_t find_system_with_point(const svg_file_t& svg_file,
   return res[0];
 }
 
+// the cursor box of the chord, whose notes are on svg_file, the page svg_pos of the music sheet
 static cursor_box_t get_cursor_box(const chord_t& chord,
-				   const std::vector<svg_file_t>& svg_files,
+				   const svg_file_t& svg_file,
+				   uint16_t svg_pos,
 				   const std::vector<note_t>& unprocessed_notes)
 {
   const auto& notes = chord.notes;
 
-  // sanity check: pre-condition
-  if (notes.empty() or svg_files.empty())
-  {
-    throw std::logic_error("Error: invalid parameters");
-  }
-
-  // sanity check: pre-condition, the notes must be part of a
-  // chord. Therefore, they must all start at the same time.
-  const auto start_time = notes[0].start_time;
-  if (std::any_of(notes.cbegin(), notes.cend(), [=] (const auto& a) {
-	return a.start_time != start_time;
-      }))
-  {
-    throw std::runtime_error("Error: all notes of a chord must start at the same time");
-  }
-
-  const auto svg_pos = find_svg_pos(notes, svg_files);
-  const auto& svg_file = svg_files[svg_pos];
-
   auto min_left = std::numeric_limits<decltype(cursor_box_t::left)>::max();
   auto max_right = std::numeric_limits<decltype(cursor_box_t::right)>::min();
   auto min_top = std::numeric_limits<decltype(cursor_box_t::left)>::max();
@@ -449,6 +433,37 @@ static cursor_box_t get_cursor_box(const chord_t& chord,
   return res;
 }
 
+// sanity check: pre-condition, the notes must be part of a chord.
+// Therefore, they must all start at the same time.
+static void check_is_chord(const std::vector<note_t>& notes)
+{
+  const auto start_time = notes[0].start_time;
+  if (std::any_of(notes.cbegin(), notes.cend(), [=] (const auto& a) {
+	return a.start_time != start_time;
+      }))
+  {
+    throw std::runtime_error("Error: all notes of a chord must start at the same time");
+  }
+}
+
+static cursor_box_t get_cursor_box(const chord_t& chord,
+				   const std::vector<svg_file_t>& svg_files,
+				   const std::vector<note_t>& unprocessed_notes)
+{
+  const auto& notes = chord.notes;
+
+  // sanity check: pre-condition
+  if (notes.empty() or svg_files.empty())
+  {
+    throw std::logic_error("Error: invalid parameters");
+  }
+
+  check_is_chord(notes);
+
+  const auto svg_pos = find_svg_pos(notes, svg_files);
+  return get_cursor_box(chord, svg_files[svg_pos], svg_pos, unprocessed_notes);
+}
+
 // returns a cursor for each chord. chords[ x ] -> res[ x ]
 std::vector<cursor_box_t> get_cursor_boxes(const std::vector<chord_t>& chords,
 					   const std::vector<svg_file_t>& svg_files,
@@ -463,3 +478,106 @@ std::vector<cursor_box_t> get_cursor_boxes(const std::vector<chord_t>& chords,
 
   return res;
 }
+
+// returns a cursor for each chord, resolving the chords of a page as soon as it is given, so that
+// only one page is held at a time. A chord is on the page of its first note.
+std::vector<cursor_box_t> get_cursor_boxes(const std::vector<chord_t>& chords,
+					   size_t nb_svg_files,
+					   const std::function<svg_file_t(size_t svg_file_pos)>& get_svg_file,
+					   const std::vector<note_t>& unprocessed_notes)
+{
+  if (nb_svg_files > std::numeric_limits<uint8_t>::max())
+  {
+    throw std::runtime_error(std::string{"Error, this program can't handle more than "}
+                             + std::to_string(static_cast<int>(std::numeric_limits<uint8_t>::max())) +
+                             " svg files per music sheet");
+  }
+
+  // a note played several times, in a repeat, starts several chords
+  std::unordered_map<std::string, std::vector<size_t>> chords_of_first_note;
+  std::unordered_map<std::string, size_t> svg_pos_of_note; // of the notes of the chords, once found
+  for (size_t i = 0; i < chords.size(); ++i)
+  {
+    if (chords[i].notes.empty())
+    {
+      throw std::logic_error("Error: invalid parameters");
+    }
+    check_is_chord(chords[i].notes);
+    chords_of_first_note[chords[i].notes[0].id].push_back(i);
+    for (const auto& note : chords[i].notes)
+    {
+      svg_pos_of_note.emplace(note.id, nb_svg_files);
+    }
+  }
+
+  std::vector<cursor_box_t> res (chords.size());
+  std::vector<bool> is_resolved (chords.size(), false);
+  std::vector<fs::path> svg_filenames; // of the pages already done, for the error messages
+  for (size_t svg_pos = 0; svg_pos < nb_svg_files; ++svg_pos)
+  {
+    const auto svg_file = get_svg_file(svg_pos);
+    svg_filenames.push_back(svg_file.filename);
+
+    for (const auto& note_head : svg_file.note_heads)
+    {
+      // sanity check: a note must appear in at most one svg file. Twice in this one is checked
+      // when its note head is looked for.
+      const auto note_svg_pos = svg_pos_of_note.find(note_head.id);
+      if (note_svg_pos == svg_pos_of_note.end())
+      {
+	continue;
+      }
+      if ((note_svg_pos->second != nb_svg_files) and (note_svg_pos->second != svg_pos))
+      {
+	throw std::runtime_error("Error: note with the following ID\n  " + note_head.id + "\n"
+				 "appear in in the following files (it should appear in only one file)\n"
+				 "  " + svg_filenames[note_svg_pos->second].string() + "\n"
+				 "  " + svg_file.filename.string() + "\n" + maybe_has_repeat_unfold_msg);
+      }
+      note_svg_pos->second = svg_pos;
+
+      const auto chords_of_note = chords_of_first_note.find(note_head.id);
+      if (chords_of_note == chords_of_first_note.end())
+      {
+	continue;
+      }
+
+      for (const auto chord : chords_of_note->second)
+      {
+	const auto& notes = chords[chord].notes;
+	if (is_resolved[chord])
+	{
+	  continue;
+	}
+
+	// sanity check: all notes in a chord must appear on the same page
+	for (const auto& note : notes)
+	{
+	  if (not has_note(svg_file, note.id))
+	  {
+	    throw std::runtime_error(std::string{"Error: the notes with the following IDs\n"
+		  "  "} + notes[0].id + "\n"
+		  "  " + note.id + "\n"
+	      "both appears in a chord said to be played at t=" + std::to_string(notes[0].start_time) +
+	      " but the second one doesn't appear in the svg file of the first one\n  " + svg_file.filename.string() +
+	      "\n\n" + maybe_has_repeat_unfold_msg);
+	  }
+	}
+
+	res[chord] = get_cursor_box(chords[chord], svg_file, static_cast<uint16_t>(svg_pos), unprocessed_notes);
+	is_resolved[chord] = true;
+      }
+    }
+  }
+
+  // sanity check: a note head should appear on at least one svg file
+  for (size_t i = 0; i < chords.size(); ++i)
+  {
+    if (not is_resolved[i])
+    {
+      throw std::runtime_error(std::string{"Error: note head with the following id couldn't be found in any svg file\n  not found id: "} + chords[i].notes[0].id);
+    }
+  }
+
+  return res;
+}
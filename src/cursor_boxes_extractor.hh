@@ -1,5 +1,6 @@
 #pragma once
 
+#include <functional>
 #include <vector>
 
 #include "chords_extractor.hh" // for note_t definition
@@ -21,3 +22,10 @@ struct cursor_box_t
 std::vector<cursor_box_t> get_cursor_boxes(const std::vector<chord_t>& chords,
 					   const std::vector<svg_file_t>& svg_files,
 					   const std::vector<note_t>& unprocessed_notes);
+
+// same as above, but the svg files are given one after the other by get_svg_file, and only one of
+// them is held at a time. Memory doesn't grow with the number of pages then.
+std::vector<cursor_box_t> get_cursor_boxes(const std::vector<chord_t>& chords,
+					   size_t nb_svg_files,
+					   const std::function<svg_file_t(size_t svg_file_pos)>& get_svg_file,
+					   const std::vector<note_t>& unprocessed_notes);
@@ -5,6 +5,23 @@
 
 %%%% Helper functions
 
+%% When several files are given to the same lilypond process, this file is parsed again for each of
+%% them and the options below would make them all write to the same files. Instead, a directory can
+%% be given, where the files are named after the file being processed:
+%% lilypond -e"(ly:add-option 'listener-output-dir #f  \"Directory for the note and staff-number-to-instrument-name-table files, named after each input file\")" -e"(ly:set-option 'listener-output-dir \"/path/to/output/dir\")"
+
+#(define (listener-output-file extension)
+   (let ((dir (ly:get-option 'listener-output-dir)))
+     (and dir
+	  (string-append
+	   dir "/"
+	   (basename
+	    ;; ly:parser-output-name lost its parser argument in lilypond 2.19.22
+	    (catch #t
+		   (lambda () (ly:parser-output-name))
+		   (lambda args (ly:parser-output-name parser))))
+	   extension))))
+
 %% Now the filename for the note file can be controlled by command line using the following syntax:
 %% lilypond -e"(ly:add-option 'note-file-output #f  \"Output for the note file. Default is filename with .notes extension instead of .ly\")" -e"(ly:set-option 'note-file-output \"/path/to/output/note/file\")"
 
@@ -13,15 +30,17 @@
    (if (not global-variable-filename)
        (let ((option-name (ly:get-option 'note-file-output)))
 	 (set! global-variable-filename
-	       (if option-name
-		   option-name
-		   (string-concatenate
-		    (list
-		     (substring (object->string (command-line))
-				;; filename without .ly part
-				(+ (string-rindex (object->string (command-line)) #\sp) 2)
-				(- (string-length (object->string (command-line))) 5))
-		     ".notes"))))))
+	       (cond
+		(option-name option-name)
+		((listener-output-file ".notes") => identity)
+		(else
+		 (string-concatenate
+		  (list
+		   (substring (object->string (command-line))
+			      ;; filename without .ly part
+			      (+ (string-rindex (object->string (command-line)) #\sp) 2)
+			      (- (string-length (object->string (command-line))) 5))
+		   ".notes")))))))
    global-variable-filename)
 
 
@@ -33,15 +52,17 @@
    (if (not instr-name-table-filename)
        (let ((option-name (ly:get-option 'instrument-name-file-output)))
 	 (set! instr-name-table-filename
-	       (if option-name
-		   option-name
-		   (string-concatenate
-		    (list
-		     (substring (object->string (command-line))
-				;; filename without .ly part
-				(+ (string-rindex (object->string (command-line)) #\sp) 2)
-				(- (string-length (object->string (command-line))) 5))
-		     ".sn2in"))))))
+	       (cond
+		(option-name option-name)
+		((listener-output-file ".sn2in") => identity)
+		(else
+		 (string-concatenate
+		  (list
+		   (substring (object->string (command-line))
+			      ;; filename without .ly part
+			      (+ (string-rindex (object->string (command-line)) #\sp) 2)
+			      (- (string-length (object->string (command-line))) 5))
+		   ".sn2in")))))))
    instr-name-table-filename)
 
 
@@ -247,9 +268,49 @@
 ))
 
 
+%% The timings can also be read from a midi file instead of the notes file. When the option
+%% unfolded-midi-output is set, every score is also output as midi, with its repeats unfolded so the
+%% midi file tells when the notes are really played. The engravers below are not part of the midi
+%% contexts, so these notes don't appear twice in the notes file.
+%%
+%% A lilypond worker parses this file for every file it converts, possibly with the handler it
+%% already wrapped. It is wrapped only once, and the option is looked at for each score.
+#(if (and (ly:get-option 'unfolded-midi-output)
+	  (not (procedure-property toplevel-score-handler 'lilydumper-unfolded-midi)))
+     (let ((handle-score toplevel-score-handler))
+       ;; depending on lilypond's version, the handler also gets the parser as first argument
+       (set! toplevel-score-handler
+	     (lambda args
+	       (let* ((score (last args))
+		      (music (ly:score-music score)))
+		 (apply handle-score args)
+		 (if (and (ly:get-option 'unfolded-midi-output) (ly:music? music))
+		     (let ((midi-score (ly:make-score #{ \unfoldRepeats $(ly:music-deep-copy music) #})))
+		       (ly:score-add-output-def! midi-score #{ \midi { } #})
+		       (apply handle-score (append (drop-right args 1) (list midi-score))))))))
+       (set-procedure-property! toplevel-score-handler 'lilydumper-unfolded-midi #t)))
+
+
+%% Only the bars of a range can be engraved, for a preview. Lilypond skips the typesetting of the
+%% other ones, as it does for showFirstLength: their notes are not acknowledged either, so the notes
+%% file of such a run only has the notes of the range. The range is given with:
+%% lilypond -e"(ly:add-option 'engraved-first-bar #f \"...\")" -e"(ly:set-option 'engraved-first-bar 12)" -e"(ly:add-option 'engraved-last-bar #f \"...\")" -e"(ly:set-option 'engraved-last-bar 16)"
+
+#(define (engraved-bars-engraver context)
+   (make-engraver
+    ((start-translation-timestep engraver)
+     (let ((first-bar (ly:get-option 'engraved-first-bar))
+	   (last-bar (ly:get-option 'engraved-last-bar)))
+       (if (and first-bar last-bar)
+	   (let ((bar (ly:context-property context 'currentBarNumber)))
+	     (ly:context-set-property! context 'skipTypesetting
+				       (not (and (>= bar first-bar) (<= bar last-bar))))))))))
+
+
 %%%% The actual engraver definition: We just install some listeners so we
 %%%% are notified about all notes and rests. We don't create any grobs or
-%%%% change any settings.
+%%%% change any settings, apart from skipping the bars which are not to be
+%%%% engraved.
 
 \layout {
   \override NoteHead.stencil = #(lambda (grob)
@@ -264,6 +325,11 @@
 				    (ly:grob-set-property! grob 'id new-id)
 				    note))
 
+  \context {
+    \Score
+    \consists #engraved-bars-engraver
+  }
+
   \context {
     \Voice
     \consists #(make-engraver
@@ -9,6 +9,15 @@
 
 
 
+// the chunks of the progressive version of the file format
+enum chunk_type : uint8_t
+{
+  staff_num_mapping_chunk = 0,
+  events_chunk            = 1,
+  page_chunk              = 2,
+  end_chunk               = 3,
+};
+
 enum event_type : uint8_t
 {
   press_key      = 0,
@@ -109,7 +118,7 @@ uint8_t get_nb_events_at_time(const std::vector<key_event>::const_iterator& key_
 
 
 template <typename T>
-void output_as_big_endian(std::ofstream& out, const T value)
+void output_as_big_endian(std::ostream& out, const T value)
 {
   // output timing such that number is saved as big endian
   for (unsigned int i = 0; i < sizeof(T); ++i)
@@ -157,7 +166,7 @@ decltype(key_event::time) get_current_event_timing(const std::vector<key_event>:
 }
 
 static
-void output_cursor_move_event(std::ofstream& out,
+void output_cursor_move_event(std::ostream& out,
 			      const cursor_box_t& cursor,
 			      decltype(cursor_box_t::svg_file_pos)& current_svg_file)
 {
@@ -194,7 +203,7 @@ void output_cursor_move_event(std::ofstream& out,
 }
 
 static
-void output_key_event(std::ofstream& out, const key_data& key)
+void output_key_event(std::ostream& out, const key_data& key)
 {
   if (key.ev_type == key_data::type::pressed)
   {
@@ -219,7 +228,7 @@ void output_key_event(std::ofstream& out, const key_data& key)
 
 
 static
-void output_bar_num_event(std::ofstream& out,
+void output_bar_num_event(std::ostream& out,
 			  const bar_num_event_t& bar_num_ev)
 {
   static_assert(sizeof(event_type::set_bar_number) == 1, "an event type should be one byte");
@@ -229,11 +238,13 @@ void output_bar_num_event(std::ofstream& out,
   output_as_big_endian(out, bar_num_ev.bar_number);
 }
 
+// current_svg_file is the page shown before the events, and is set to the one shown after them
 static
-void output_events_data(std::ofstream& out,
+void output_events_data(std::ostream& out,
 			const std::vector<key_event>& keyboard_events,
 			const std::vector<cursor_box_t>& cursor_boxes,
-			const std::vector<bar_num_event_t>& bar_num_events)
+			const std::vector<bar_num_event_t>& bar_num_events,
+			decltype(cursor_box_t::svg_file_pos)& current_svg_file)
 {
   // sanity check: inputs must be sorted by time
   if (not std::is_sorted(keyboard_events.cbegin(), keyboard_events.cend(), [] (const auto& a, const auto&b) {
@@ -269,8 +280,6 @@ void output_events_data(std::ofstream& out,
   const auto end_cursor = cursor_boxes.cend();
   const auto end_bar_num = bar_num_events.cend();
 
-  auto current_svg_file = std::numeric_limits<decltype(cursor_box_t::svg_file_pos)>::max();
-
   // the parser/reader needs to know when to stop reading events and when to
   // start reading what comes next (svg files). One way to do so is to have a
   // special "event type" that encodes "end of events". Another way is to add a
@@ -353,7 +362,7 @@ void output_events_data(std::ofstream& out,
 }
 
 static
-void output_staff_num_mapping(std::ofstream& file,
+void output_staff_num_mapping(std::ostream& file,
 			      const std::vector<std::string>& staff_num_mapping)
 {
   file << static_cast<uint8_t>(staff_num_mapping.size());
@@ -366,34 +375,61 @@ void output_staff_num_mapping(std::ofstream& file,
 }
 
 static
-void output_svg_files(std::ofstream& file,
+void output_svg_file(std::ostream& file, const fs::path& filename)
+{
+  // get file size: http://stackoverflow.com/questions/5840148/how-can-i-get-a-files-size-in-c
+
+  // While not necessarily the most popular method, I've heard that the ftell,
+  // fseek method may not always give accurate results in some
+  // circumstances. Specifically, if an already opened file is used and the
+  // size needs to be worked out on that and it happens to be opened as a text
+  // file, then it's going to give out wrong answers.
+
+  struct stat stat_buf;
+  const auto rc = stat(filename.c_str(), &stat_buf);
+  if (rc != 0)
+  {
+    throw std::runtime_error(std::string{"Error, failed to get file size for "} + filename.string());
+  }
+  output_as_big_endian(file, static_cast<uint32_t>(stat_buf.st_size));
+
+  std::ifstream src(filename, std::ios::in | std::ios::binary);
+  file << src.rdbuf();
+}
+
+static
+void output_svg_files(std::ostream& file,
 		      const std::vector<fs::path>& svg_filenames)
 {
   output_as_big_endian(file, static_cast<uint16_t>(svg_filenames.size()));
   for (const auto& filename : svg_filenames)
   {
-    // get file size: http://stackoverflow.com/questions/5840148/how-can-i-get-a-files-size-in-c
+    output_svg_file(file, filename);
+  }
+}
 
-    // While not necessarily the most popular method, I've heard that the ftell,
-    // fseek method may not always give accurate results in some
-    // circumstances. Specifically, if an already opened file is used and the
-    // size needs to be worked out on that and it happens to be opened as a text
-    // file, then it's going to give out wrong answers.
 
-    struct stat stat_buf;
-    const auto rc = stat(filename.c_str(), &stat_buf);
-    if (rc != 0)
-    {
-      throw std::runtime_error(std::string{"Error, failed to get file size for "} + filename.string());
-    }
-    output_as_big_endian(file, static_cast<uint32_t>(stat_buf.st_size));
+void save_to_stream(std::ostream& output,
+		    const std::vector<key_event>& keyboard_events,
+		    const std::vector<cursor_box_t>& cursor_boxes,
+		    const std::vector<bar_num_event_t>& bar_num_events,
+		    const std::vector<std::string>& staff_num_mapping,
+		    const std::vector<fs::path>& svg_filenames)
+{
+  // magic number: LPYP
+  output << static_cast<uint8_t>( 'L' )
+	 << static_cast<uint8_t>( 'P' )
+	 << static_cast<uint8_t>( 'Y' )
+	 << static_cast<uint8_t>( 'P' )
+    // version number
+	 << static_cast<uint8_t>( 0 );
 
-    std::ifstream src(filename, std::ios::in | std::ios::binary);
-    file << src.rdbuf();
-  }
+  auto current_svg_file = std::numeric_limits<decltype(cursor_box_t::svg_file_pos)>::max();
+  output_staff_num_mapping(output, staff_num_mapping);
+  output_events_data(output, keyboard_events, cursor_boxes, bar_num_events, current_svg_file);
+  output_svg_files(output, svg_filenames);
 }
 
-
 void save_to_file(const fs::path& output_filename,
 		  const std::vector<key_event>& keyboard_events,
 		  const std::vector<cursor_box_t>& cursor_boxes,
@@ -409,16 +445,110 @@ void save_to_file(const fs::path& output_filename,
     throw std::runtime_error(std::string{"Error: failed to open "} + output_filename.c_str());
   }
 
+  save_to_stream(file, keyboard_events, cursor_boxes, bar_num_events, staff_num_mapping, svg_filenames);
+  file.close();
+}
+
+song_chunks_writer::song_chunks_writer(std::ostream& output)
+  : _output(output)
+  , _current_svg_file(std::numeric_limits<decltype(_current_svg_file)>::max())
+  , _nb_pages(0)
+{
   // magic number: LPYP
-  file << static_cast<uint8_t>( 'L' )
-       << static_cast<uint8_t>( 'P' )
-       << static_cast<uint8_t>( 'Y' )
-       << static_cast<uint8_t>( 'P' )
+  _output << static_cast<uint8_t>( 'L' )
+	  << static_cast<uint8_t>( 'P' )
+	  << static_cast<uint8_t>( 'Y' )
+	  << static_cast<uint8_t>( 'P' )
     // version number
-       << static_cast<uint8_t>( 0 );
+	  << static_cast<uint8_t>( 1 );
+  _output.flush();
+}
+
+void song_chunks_writer::write_staff_num_mapping(const std::vector<std::string>& staff_num_mapping)
+{
+  output_as_big_endian(_output, chunk_type::staff_num_mapping_chunk);
+  output_staff_num_mapping(_output, staff_num_mapping);
+  _output.flush();
+}
+
+void song_chunks_writer::write_events(const std::vector<key_event>& keyboard_events,
+				      const std::vector<cursor_box_t>& cursor_boxes,
+				      const std::vector<bar_num_event_t>& bar_num_events)
+{
+  if (keyboard_events.empty() and cursor_boxes.empty() and bar_num_events.empty())
+  {
+    return;
+  }
+
+  if (std::any_of(cursor_boxes.cbegin(), cursor_boxes.cend(), [&] (const auto& cursor_box) {
+	return cursor_box.svg_file_pos >= _nb_pages;
+      }))
+  {
+    throw std::logic_error("Error: the events show a page which is not written yet");
+  }
+
+  output_as_big_endian(_output, chunk_type::events_chunk);
+  output_events_data(_output, keyboard_events, cursor_boxes, bar_num_events, _current_svg_file);
+  _output.flush();
+}
+
+void song_chunks_writer::write_page(const fs::path& svg_filename)
+{
+  if (_nb_pages >= std::numeric_limits<decltype(_current_svg_file)>::max())
+  {
+    throw std::runtime_error("Error: the music sheet has too many pages");
+  }
+
+  // a chunk can't be left incomplete
+  if (not fs::is_regular_file(svg_filename))
+  {
+    throw std::runtime_error(std::string{"Error: missing page "} + svg_filename.string());
+  }
+
+  output_as_big_endian(_output, chunk_type::page_chunk);
+  output_svg_file(_output, svg_filename);
+  ++_nb_pages;
+  _output.flush();
+}
+
+void song_chunks_writer::write_end()
+{
+  output_as_big_endian(_output, chunk_type::end_chunk);
+  _output.flush();
+}
+
+void save_chunks_to_stream(std::ostream& output,
+			   const std::vector<key_event>& keyboard_events,
+			   const std::vector<cursor_box_t>& cursor_boxes,
+			   const std::vector<bar_num_event_t>& bar_num_events,
+			   const std::vector<std::string>& staff_num_mapping,
+			   const std::vector<fs::path>& svg_filenames)
+{
+  song_chunks_writer writer (output);
+  writer.write_staff_num_mapping(staff_num_mapping);
+  for (const auto& svg_filename : svg_filenames)
+  {
+    writer.write_page(svg_filename);
+  }
+  writer.write_events(keyboard_events, cursor_boxes, bar_num_events);
+  writer.write_end();
+}
+
+void save_chunks_to_file(const fs::path& output_filename,
+			 const std::vector<key_event>& keyboard_events,
+			 const std::vector<cursor_box_t>& cursor_boxes,
+			 const std::vector<bar_num_event_t>& bar_num_events,
+			 const std::vector<std::string>& staff_num_mapping,
+			 const std::vector<fs::path>& svg_filenames)
+{
+  std::ofstream file(output_filename,
+		     std::ios::binary | std::ios::trunc | std::ios::out);
+
+  if (not file.is_open())
+  {
+    throw std::runtime_error(std::string{"Error: failed to open "} + output_filename.c_str());
+  }
 
-  output_staff_num_mapping(file, staff_num_mapping);
-  output_events_data(file, keyboard_events, cursor_boxes, bar_num_events);
-  output_svg_files(file, svg_filenames);
+  save_chunks_to_stream(file, keyboard_events, cursor_boxes, bar_num_events, staff_num_mapping, svg_filenames);
   file.close();
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+#include <ostream>
 #include <vector>
 #include <string>
 
@@ -14,3 +16,66 @@ void save_to_file(const fs::path& output_filename,
 		  const std::vector<bar_num_event_t>& bar_num_events,
 		  const std::vector<std::string>& staff_num_mapping,
 		  const std::vector<fs::path>& svg_filenames);
+
+// same as save_to_file, for an output which isn't a file, e.g. a std::ostringstream. The stream
+// must be seekable, the number of events is written once they are all out.
+void save_to_stream(std::ostream& output,
+		    const std::vector<key_event>& keyboard_events,
+		    const std::vector<cursor_box_t>& cursor_boxes,
+		    const std::vector<bar_num_event_t>& bar_num_events,
+		    const std::vector<std::string>& staff_num_mapping,
+		    const std::vector<fs::path>& svg_filenames);
+
+// writes the progressive version of the file format (see file_format.md) chunk by chunk, so that a
+// player can start with the first chunks while the next ones are still to come. Each chunk is
+// flushed once written.
+class song_chunks_writer
+{
+  public:
+    // writes the header
+    explicit song_chunks_writer(std::ostream& output);
+
+    song_chunks_writer(const song_chunks_writer&) = delete;
+    song_chunks_writer& operator=(const song_chunks_writer&) = delete;
+
+    // the first chunk after the header
+    void write_staff_num_mapping(const std::vector<std::string>& staff_num_mapping);
+
+    // the events must come after the ones already written, and only show the pages already written.
+    // Nothing is written when there is no event.
+    void write_events(const std::vector<key_event>& keyboard_events,
+		      const std::vector<cursor_box_t>& cursor_boxes,
+		      const std::vector<bar_num_event_t>& bar_num_events);
+
+    // the pages are written in order, the first one is page 0 for the events
+    void write_page(const fs::path& svg_filename);
+
+    // the last chunk, nothing can be written after it
+    void write_end();
+
+    size_t nb_pages() const
+    {
+      return _nb_pages;
+    }
+
+  private:
+    std::ostream& _output;
+    uint16_t _current_svg_file; // the page shown at the end of the events written so far
+    size_t _nb_pages;
+};
+
+// same as save_to_stream, in the progressive version of the file format. The pages come before the
+// events.
+void save_chunks_to_stream(std::ostream& output,
+			   const std::vector<key_event>& keyboard_events,
+			   const std::vector<cursor_box_t>& cursor_boxes,
+			   const std::vector<bar_num_event_t>& bar_num_events,
+			   const std::vector<std::string>& staff_num_mapping,
+			   const std::vector<fs::path>& svg_filenames);
+
+void save_chunks_to_file(const fs::path& output_filename,
+			 const std::vector<key_event>& keyboard_events,
+			 const std::vector<cursor_box_t>& cursor_boxes,
+			 const std::vector<bar_num_event_t>& bar_num_events,
+			 const std::vector<std::string>& staff_num_mapping,
+			 const std::vector<fs::path>& svg_filenames);
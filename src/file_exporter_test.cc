@@ -0,0 +1,116 @@
+#include <fstream>
+#include <sstream>
+#include "file_exporter.hh"
+#include "unit_test.hh"
+
+// the bytes of value, as big endian
+static
+std::string big_endian(uint64_t value, size_t size)
+{
+  std::string res;
+  for (size_t i = 0; i < size; ++i)
+  {
+    res += static_cast<char>((value >> (8 * (size - i - 1))) & 0xFF);
+  }
+  return res;
+}
+
+static
+const std::vector<key_event> keyboard_events {
+  key_event{ .time = 0, .data = key_data{ .pitch = 60, .ev_type = key_data::type::pressed, .staff_number = 1 } },
+  key_event{ .time = 1000, .data = key_data{ .pitch = 60, .ev_type = key_data::type::released, .staff_number = 1 } },
+};
+
+static
+const std::vector<cursor_box_t> cursor_boxes {
+  cursor_box_t{ .left = 1, .right = 2, .top = 3, .bottom = 4, .start_time = 0, .svg_file_pos = 0,
+		.system_number = 0, .bar_number = 1 },
+};
+
+static
+const std::vector<bar_num_event_t> bar_num_events {
+  bar_num_event_t{ .time = 0, .bar_number = 1 },
+};
+
+// the events above, as written in an events chunk
+static
+std::string get_events_chunk()
+{
+  return std::string("\x01", 1) + big_endian(2, 8) +
+    // the first group: the page, the cursor, the bar number and the key press
+    big_endian(0, 8) + big_endian(4, 1) +
+    big_endian(4, 1) + big_endian(0, 2) +
+    big_endian(3, 1) + big_endian(1, 4) + big_endian(2, 4) + big_endian(3, 4) + big_endian(4, 4) +
+    big_endian(2, 1) + big_endian(1, 2) +
+    big_endian(0, 1) + big_endian(60, 1) + big_endian(1, 1) +
+    // the second one: the key release
+    big_endian(1000, 8) + big_endian(1, 1) +
+    big_endian(1, 1) + big_endian(60, 1);
+}
+
+static
+void test_chunks()
+{
+  const test_directory directory;
+  const auto page = directory.path() / "page.svg";
+  std::ofstream{page, std::ios::out | std::ios::binary} << "<svg/>";
+
+  std::ostringstream output;
+  song_chunks_writer writer (output);
+  CHECK(output.str() == "LPYP\x01");
+
+  writer.write_staff_num_mapping({ "Piano", "Bass" });
+  std::string expected = std::string{"LPYP\x01"} + std::string("\x00\x02Piano\x00" "Bass\x00", 13);
+  CHECK(output.str() == expected);
+
+  // the events can't show a page which is not written yet
+  CHECK_THROWS(writer.write_events(keyboard_events, cursor_boxes, bar_num_events));
+  CHECK(output.str() == expected);
+
+  writer.write_page(page);
+  expected += std::string("\x02", 1) + big_endian(6, 4) + "<svg/>";
+  CHECK(output.str() == expected);
+  CHECK(writer.nb_pages() == 1);
+
+  writer.write_events(keyboard_events, cursor_boxes, bar_num_events);
+  expected += get_events_chunk();
+  CHECK(output.str() == expected);
+
+  // nothing for no events
+  writer.write_events({}, {}, {});
+  CHECK(output.str() == expected);
+
+  // the page is still the one shown, it is not set again
+  writer.write_events({}, { cursor_box_t{ .left = 5, .right = 6, .top = 7, .bottom = 8, .start_time = 2000,
+					  .svg_file_pos = 0, .system_number = 0, .bar_number = 2 } }, {});
+  expected += std::string("\x01", 1) + big_endian(1, 8) + big_endian(2000, 8) + big_endian(1, 1) +
+    big_endian(3, 1) + big_endian(5, 4) + big_endian(6, 4) + big_endian(7, 4) + big_endian(8, 4);
+  CHECK(output.str() == expected);
+
+  writer.write_end();
+  expected += std::string("\x03", 1);
+  CHECK(output.str() == expected);
+
+  CHECK_THROWS(writer.write_page(directory.path() / "missing.svg"));
+}
+
+static
+void test_save_chunks()
+{
+  const test_directory directory;
+  const auto page = directory.path() / "page.svg";
+  std::ofstream{page, std::ios::out | std::ios::binary} << "<svg/>";
+
+  // the pages come before the events
+  std::ostringstream output;
+  save_chunks_to_stream(output, keyboard_events, cursor_boxes, bar_num_events, { "Piano" }, { page });
+  CHECK(output.str() == std::string("LPYP\x01", 5) + std::string("\x00\x01Piano\x00", 8) +
+	std::string("\x02", 1) + big_endian(6, 4) + "<svg/>" + get_events_chunk() + std::string("\x03", 1));
+}
+
+int main()
+{
+  test_chunks();
+  test_save_chunks();
+  return test_result();
+}
@@ -0,0 +1,111 @@
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <array>
+#include <stdexcept>
+#include "file_watcher.hh"
+
+// how long to wait for more changes once one was seen
+constexpr int settle_time_ms = 100;
+
+constexpr uint32_t watched_events = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE;
+
+file_watcher::file_watcher()
+  : _fd(::inotify_init1(IN_CLOEXEC))
+  , _files()
+  , _directories()
+{
+  if (_fd == -1)
+  {
+    throw std::runtime_error(std::string{"Error: failed to initialize inotify ("} + strerror(errno) + ")");
+  }
+}
+
+file_watcher::~file_watcher()
+{
+  ::close(_fd); // removes the watches
+}
+
+void file_watcher::watch(const std::vector<fs::path>& files)
+{
+  for (const auto& directory : _directories)
+  {
+    ::inotify_rm_watch(_fd, directory.first);
+  }
+  _directories.clear();
+  _files.clear();
+
+  for (const auto& file : files)
+  {
+    const auto absolute_file = fs::absolute(file);
+    _files.insert(absolute_file);
+
+    const auto directory = absolute_file.parent_path();
+    const auto wd = ::inotify_add_watch(_fd, directory.c_str(), watched_events);
+    if (wd == -1)
+    {
+      throw std::runtime_error(std::string{"Error: failed to watch '"} + directory.string() + "' (" + strerror(errno) + ")");
+    }
+
+    // adding the same directory again gives the same watch descriptor
+    _directories[wd] = directory;
+  }
+}
+
+bool file_watcher::read_events(int timeout_ms)
+{
+  struct pollfd poll_fd {};
+  poll_fd.fd = _fd;
+  poll_fd.events = POLLIN;
+
+  const auto nb_ready = ::poll(&poll_fd, 1, timeout_ms);
+  if (nb_ready == -1)
+  {
+    if (errno == EINTR)
+    {
+      return false;
+    }
+    throw std::runtime_error(std::string{"Error: failed to wait for file changes ("} + strerror(errno) + ")");
+  }
+
+  if (nb_ready == 0)
+  {
+    return false;
+  }
+
+  // inotify events are aligned like this structure, and a read gives whole events only
+  alignas(inotify_event) std::array<char, 4096> buffer;
+  const auto nb_read = ::read(_fd, buffer.data(), buffer.size());
+  if (nb_read <= 0)
+  {
+    return false;
+  }
+
+  bool res = false;
+  for (ssize_t pos = 0; pos < nb_read; )
+  {
+    const auto* event = reinterpret_cast<const inotify_event*>(buffer.data() + pos);
+    pos += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+
+    const auto directory = _directories.find(event->wd);
+    if ((directory != _directories.end()) and (event->len > 0) and
+	(_files.count(directory->second / event->name) != 0))
+    {
+      res = true;
+    }
+  }
+
+  return res;
+}
+
+void file_watcher::wait_for_change()
+{
+  while (not read_events(-1))
+  {
+  }
+
+  while (read_events(settle_time_ms))
+  {
+  }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <vector>
+#include "utils.hh"
+
+// tells when some files change, using inotify. The directories of the files are watched rather than
+// the files themselves, since editors often save a file by writing a new one and renaming it over
+// the former one, which a watch on the former file would miss.
+class file_watcher
+{
+  public:
+    file_watcher();
+    ~file_watcher();
+
+    file_watcher(const file_watcher&) = delete;
+    file_watcher& operator=(const file_watcher&) = delete;
+
+    // replaces the files watched so far
+    void watch(const std::vector<fs::path>& files);
+
+    // blocks until one of the watched files is written, created, renamed or deleted. Changes coming
+    // in a row, as when an editor saves several files, are reported once.
+    void wait_for_change();
+
+  private:
+    // waits at most timeout_ms milliseconds (-1 for ever) for events. Returns whether one of them
+    // concerned a watched file.
+    bool read_events(int timeout_ms);
+
+    int _fd;
+    std::set<fs::path> _files;
+    std::map<int, fs::path> _directories; // by watch descriptor
+};
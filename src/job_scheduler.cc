@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <atomic>
+#include <numeric>
+#include <thread>
+#include <stdexcept>
+#include "job_scheduler.hh"
+
+static
+job_result_t run_job(const job_t& job)
+{
+  const auto start = std::chrono::steady_clock::now();
+  job_result_t res { .success = false, .error_message = {}, .duration = {} };
+
+  try
+  {
+    job.run();
+    res.success = true;
+  }
+  catch (const std::exception& e)
+  {
+    res.error_message = e.what();
+  }
+  catch (...)
+  {
+    res.error_message = "unknown error";
+  }
+
+  res.duration = std::chrono::steady_clock::now() - start;
+  return res;
+}
+
+std::vector<job_result_t> run_jobs(const std::vector<job_t>& jobs, unsigned int nb_workers)
+{
+  if (nb_workers == 0)
+  {
+    throw std::invalid_argument("Error: at least one worker is needed to run jobs");
+  }
+
+  // longest expected job first
+  std::vector<size_t> order (jobs.size());
+  std::iota(order.begin(), order.end(), size_t{0});
+  std::stable_sort(order.begin(), order.end(), [&] (size_t a, size_t b) {
+      return jobs[a].expected_cost > jobs[b].expected_cost;
+    });
+
+  std::vector<job_result_t> res (jobs.size(), job_result_t{ .success = false, .error_message = {}, .duration = {} });
+  std::atomic<size_t> next_job { 0 };
+
+  // each worker takes the next job in the order until there are none left. Every job writes its
+  // result in its own slot, so there is no need to lock anything.
+  const auto worker = [&] () {
+    for (auto i = next_job++; i < order.size(); i = next_job++)
+    {
+      res[order[i]] = run_job(jobs[order[i]]);
+    }
+  };
+
+  const auto nb_threads = std::min(static_cast<size_t>(nb_workers), jobs.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < nb_threads; ++i)
+  {
+    threads.emplace_back(worker);
+  }
+
+  worker(); // the calling thread is one of the workers
+
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  return res;
+}
+
+task_graph::task_graph()
+  : _tasks()
+  , _mutex()
+  , _changed()
+  , _ready_tasks()
+  , _nb_tasks_left(0)
+  , _error()
+{
+}
+
+task_graph::task_id task_graph::add(const std::function<void()>& run, const std::vector<task_id>& dependencies)
+{
+  const auto res = _tasks.size();
+  for (const auto dependency : dependencies)
+  {
+    if (dependency >= res)
+    {
+      throw std::invalid_argument("Error: a task can only depend on the tasks added before it");
+    }
+    _tasks[dependency].dependents.push_back(res);
+  }
+
+  _tasks.push_back(task_t{ .run = run, .dependents = {}, .nb_dependencies_left = dependencies.size() });
+  return res;
+}
+
+void task_graph::run(unsigned int nb_threads)
+{
+  if (nb_threads == 0)
+  {
+    throw std::invalid_argument("Error: at least one thread is needed to run tasks");
+  }
+
+  const auto nb_workers = std::max(size_t{1}, std::min(static_cast<size_t>(nb_threads), _tasks.size()));
+  _ready_tasks.assign(nb_workers, {});
+  _nb_tasks_left = _tasks.size();
+  _error = nullptr;
+
+  // the tasks ready from the start are shared out between the threads
+  for (task_id task = 0; task < _tasks.size(); ++task)
+  {
+    if (_tasks[task].nb_dependencies_left == 0)
+    {
+      _ready_tasks[task % nb_workers].push_back(task);
+    }
+  }
+
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < nb_workers; ++i)
+  {
+    threads.emplace_back([this, i] () { work(i); });
+  }
+
+  work(0); // the calling thread is one of the workers
+
+  for (auto& thread : threads)
+  {
+    thread.join();
+  }
+
+  if (_error)
+  {
+    std::rethrow_exception(_error);
+  }
+}
+
+// takes the last task the thread made ready, or the first one of another thread. Called with _mutex
+// locked.
+bool task_graph::take_task(size_t thread, task_id& task)
+{
+  if (not _ready_tasks[thread].empty())
+  {
+    task = _ready_tasks[thread].back();
+    _ready_tasks[thread].pop_back();
+    return true;
+  }
+
+  for (size_t i = 1; i < _ready_tasks.size(); ++i)
+  {
+    auto& other_tasks = _ready_tasks[(thread + i) % _ready_tasks.size()];
+    if (not other_tasks.empty())
+    {
+      task = other_tasks.front();
+      other_tasks.pop_front();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void task_graph::work(size_t thread)
+{
+  std::unique_lock<std::mutex> lock (_mutex);
+  for (;;)
+  {
+    task_id task = 0;
+    _changed.wait(lock, [&] () {
+	return (_nb_tasks_left == 0) or _error or take_task(thread, task);
+      });
+    if ((_nb_tasks_left == 0) or _error)
+    {
+      return;
+    }
+
+    lock.unlock();
+    std::exception_ptr error;
+    try
+    {
+      _tasks[task].run();
+    }
+    catch (...)
+    {
+      error = std::current_exception();
+    }
+    lock.lock();
+
+    if (error)
+    {
+      if (not _error)
+      {
+	_error = error;
+      }
+      _changed.notify_all();
+      return;
+    }
+
+    --_nb_tasks_left;
+    for (const auto dependent : _tasks[task].dependents)
+    {
+      if (--_tasks[dependent].nb_dependencies_left == 0)
+      {
+	_ready_tasks[thread].push_back(dependent);
+      }
+    }
+    _changed.notify_all();
+  }
+}
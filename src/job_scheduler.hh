@@ -0,0 +1,72 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct job_t
+{
+    std::function<void()> run;
+
+    // only compared to the cost of the other jobs, the unit does not matter
+    uint64_t expected_cost;
+};
+
+struct job_result_t
+{
+    bool success;
+    std::string error_message; // what the job threw when it failed
+    std::chrono::steady_clock::duration duration;
+};
+
+// runs the jobs on nb_workers threads, starting with the most expensive ones so that a long job
+// doesn't end up running alone at the end. Results are given in the same order as the jobs.
+std::vector<job_result_t> run_jobs(const std::vector<job_t>& jobs, unsigned int nb_workers);
+
+// tasks which depend on each other, each one run as soon as the ones it depends on are done. Each
+// thread first runs the tasks its own tasks made ready, most recent first, so that a chain of
+// dependent tasks stays on the thread which has its data at hand, and steals the oldest task of
+// another thread when it has none left.
+class task_graph
+{
+  public:
+    using task_id = size_t;
+
+    task_graph();
+
+    task_graph(const task_graph&) = delete;
+    task_graph& operator=(const task_graph&) = delete;
+
+    // the dependencies must have been added before
+    task_id add(const std::function<void()>& run, const std::vector<task_id>& dependencies = {});
+
+    // runs the tasks on nb_threads threads, the calling one included, and returns once they are all
+    // done. Once a task threw, no other task starts, and what it threw is thrown once the running
+    // ones are done.
+    void run(unsigned int nb_threads);
+
+  private:
+    struct task_t
+    {
+	std::function<void()> run;
+	std::vector<task_id> dependents;
+	size_t nb_dependencies_left;
+    };
+
+    void work(size_t thread);
+    bool take_task(size_t thread, task_id& task);
+
+    std::vector<task_t> _tasks;
+
+    // while the tasks run
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    std::vector<std::deque<task_id>> _ready_tasks; // of each thread
+    size_t _nb_tasks_left;
+    std::exception_ptr _error;
+};
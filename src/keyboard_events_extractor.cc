@@ -171,7 +171,7 @@ void separate_release_pressed_events(std::vector<key_event>& key_events)
 
 
 
-std::vector<key_event> get_key_events(const std::vector<note_t>& notes)
+std::vector<key_event> get_key_events(const std::vector<note_t>& notes, const conversion_context& context)
 {
   std::vector<key_event> res;
   res.reserve(notes.size() * 2); // two events per note, the key down
@@ -219,6 +219,6 @@ std::vector<key_event> get_key_events(const std::vector<note_t>& notes)
   remove_duplicate_events(res); // handle the first corner cases
 
   separate_release_pressed_events(res);
-  debug_dump(res, "key_events_final");
+  debug_dump(context, res, "key_events_final");
   return res;
 }
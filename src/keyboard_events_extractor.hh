@@ -1,6 +1,7 @@
 #pragma once
 
 #include <vector>
+#include "conversion_context.hh"
 #include "utils.hh"
 
-std::vector<key_event> get_key_events(const std::vector<note_t>& notes);
+std::vector<key_event> get_key_events(const std::vector<note_t>& notes, const conversion_context& context);
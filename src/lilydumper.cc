@@ -0,0 +1,99 @@
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <system_error>
+#include "file_exporter.hh"
+#include "lilydumper.hh"
+
+namespace
+{
+  // the temporary directory of a single conversion, which also gets its log and debug dumps
+  class conversion_directory
+  {
+    public:
+      conversion_directory()
+	: _directory(get_temp_dir(true))
+	, _log((_directory / "logs").string())
+	, _context(_directory, _log)
+      {
+      }
+
+      ~conversion_directory()
+      {
+	_log.close();
+
+	std::error_code error;
+	fs::remove_all(_directory, error);
+      }
+
+      conversion_directory(const conversion_directory&) = delete;
+      conversion_directory& operator=(const conversion_directory&) = delete;
+
+      const conversion_context& context() const
+      {
+	return _context;
+      }
+
+    private:
+      const fs::path _directory;
+      std::ofstream _log;
+      const conversion_context _context;
+  };
+}
+
+static
+std::string read_file(const fs::path& filename)
+{
+  std::ifstream file (filename, std::ios::in | std::ios::binary);
+  if (not file.is_open())
+  {
+    throw std::runtime_error(std::string{"Error: failed to open '"} + filename.c_str() + "'");
+  }
+  return std::string{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+}
+
+std::string convert_to_lpyp(const std::string& lilypond_command,
+			    const std::string& lilypond_source,
+			    const fs::path& include_directory,
+			    const conversion_options& options)
+{
+  conversion_directory directory;
+  const auto song = generate_song_from_source(lilypond_command, lilypond_source, include_directory, options,
+					      directory.context());
+
+  std::ostringstream output (std::ios::out | std::ios::binary);
+  const auto save = options.progressive_output ? save_chunks_to_stream : save_to_stream;
+  save(output,
+       song.keyboard_events,
+       song.cursor_boxes,
+       song.bar_num_events,
+       song.staffs_to_instrument,
+       song.svg_files);
+  return output.str();
+}
+
+void convert_to_song(const std::string& lilypond_command,
+		     const std::string& lilypond_source,
+		     const fs::path& include_directory,
+		     const conversion_options& options,
+		     conversion_sink& sink)
+{
+  conversion_directory directory;
+  auto song = generate_song_from_source(lilypond_command, lilypond_source, include_directory, options,
+					directory.context());
+
+  std::vector<std::string> svg_pages;
+  for (const auto& svg_file : song.svg_files)
+  {
+    svg_pages.emplace_back(read_file(svg_file));
+  }
+
+  sink.on_song(converted_song_t{
+      .keyboard_events = std::move(song.keyboard_events),
+      .cursor_boxes = std::move(song.cursor_boxes),
+      .bar_num_events = std::move(song.bar_num_events),
+      .staffs_to_instrument = std::move(song.staffs_to_instrument),
+      .svg_pages = std::move(svg_pages),
+    });
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "command_executor.hh"
+
+// The entry points of liblilydumper, to convert a music sheet held in memory without going through
+// files. Each conversion works in a temporary directory of its own, removed once it is done, so
+// that several conversions can run at the same time from different threads.
+//
+// The conversion options are the ones of the command line, except for the cache
+// (conversion_options::cache_directory), which is not used, and the layout variants, which give
+// several songs and can't be used. With a worker pool, the workers look for the included files
+// next to the source, which is in the temporary directory: only absolute includes can be found.
+
+// a converted music sheet, as saved in the output file (see file_format.md)
+struct converted_song_t
+{
+    std::vector<key_event> keyboard_events;
+    std::vector<cursor_box_t> cursor_boxes;
+    std::vector<bar_num_event_t> bar_num_events;
+    std::vector<std::string> staffs_to_instrument;
+    std::vector<std::string> svg_pages; // the content of the pages, cursor_box_t::svg_file_pos is the index
+};
+
+// receives the result of a conversion
+class conversion_sink
+{
+  public:
+    virtual ~conversion_sink() = default;
+
+    virtual void on_song(converted_song_t&& song) = 0;
+};
+
+// converts lilypond_source, the content of a .ly file, and gives the content of the output file.
+// conversion_options::progressive_output gives the progressive version of the file format, all at
+// once.
+// include_directory is where lilypond looks for the files the source includes, empty for none.
+// Throws std::runtime_error when the conversion fails.
+std::string convert_to_lpyp(const std::string& lilypond_command,
+			    const std::string& lilypond_source,
+			    const fs::path& include_directory,
+			    const conversion_options& options);
+
+// same as convert_to_lpyp, but gives the song to the sink instead of encoding it
+void convert_to_song(const std::string& lilypond_command,
+		     const std::string& lilypond_source,
+		     const fs::path& include_directory,
+		     const conversion_options& options,
+		     conversion_sink& sink);
@@ -0,0 +1,63 @@
+\version "2.16.0"
+
+%% A lilypond process that converts the files it is asked to, one after the other, instead of a
+%% single set of files given on the command line. Starting lilypond (guile, the init files, the fonts
+%% and, for the notes pass, the patched music functions) takes most of the time of a small
+%% conversion, this is only paid once per worker.
+%%
+%% The worker is started with this file as its only input file. It reads the requests from its
+%% standard input, one per line:
+%%   ((log-file . "/path/to/log") (output-dir . "/path/to/dir")
+%%    (options ("name" "value" "description or #f") ...)
+%%    (files "/path/to/file.ly" ...))
+%% The values are scheme expressions, as the ones given with -dname=value. The options with a
+%% description are added with ly:add-option first. For each request it writes "ok" or "failed" on
+%% its file descriptor 3, and it exits when its standard input is closed.
+
+#(define (lilydumper-set-options options)
+   ;; gives the former values, to put them back once the request is done
+   (map (lambda (option)
+	  (let ((name (string->symbol (car option)))
+		(value (with-input-from-string (cadr option) read))
+		(description (caddr option)))
+	    (if description
+		(ly:add-option name #f description))
+	    (let ((former-value (ly:get-option name)))
+	      (ly:set-option name value)
+	      (cons name former-value))))
+	options))
+
+#(define (lilydumper-convert request)
+   (let* ((log-file (assq-ref request 'log-file))
+	  (output-dir (assq-ref request 'output-dir))
+	  (files (assq-ref request 'files))
+	  (former-values (lilydumper-set-options (assq-ref request 'options)))
+	  (success #t))
+     (ly:stderr-redirect log-file "w")
+     ;; the outputs are named after the input files and written in the current directory
+     (chdir output-dir)
+     (for-each
+      (lambda (file)
+	(catch #t
+	       (lambda ()
+		 (ly:parse-file file)
+		 (if (defined? 'ly:clear-anonymous-modules)
+		     (ly:clear-anonymous-modules)))
+	       (lambda (key . args)
+		 (ly:warning "failed to convert ~a (~a)" file key)
+		 (set! success #f))))
+      files)
+     (for-each (lambda (former-value)
+		 (ly:set-option (car former-value) (cdr former-value)))
+	       former-values)
+     success))
+
+#(let ((requests (current-input-port))
+       (replies (fdes->outport 3)))
+   (let loop ((request (read requests)))
+     (if (not (eof-object? request))
+	 (begin
+	   (display (if (lilydumper-convert request) "ok\n" "failed\n") replies)
+	   (force-output replies)
+	   (loop (read requests)))))
+   (exit 0))
@@ -0,0 +1,419 @@
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include "lilypond_worker_pool.hh"
+#include "common.h"
+
+// lilypond keeps some memory from each file it converts. Workers are restarted after that many runs
+// so that they don't grow forever.
+constexpr unsigned int max_runs_per_worker = 100;
+
+// the file descriptor the worker writes its replies to, see lilypond-worker.scm
+constexpr int replies_fd_in_worker = 3;
+
+// how often the should_stop of a run is called
+constexpr int stop_check_interval_ms = 50;
+
+// how long a worker has to exit once it was told to, before it is killed
+constexpr int worker_exit_timeout_ms = 2000;
+
+std::string to_scheme_string(const std::string& str)
+{
+  std::string res = "\"";
+  for (const auto c : str)
+  {
+    if ((c == '"') or (c == '\\'))
+    {
+      res += '\\';
+    }
+    res += c;
+  }
+  return res + "\"";
+}
+
+std::vector<std::string> get_cache_environment(const fs::path& runtime_directory, bool with_preloader)
+{
+  if (runtime_directory.empty())
+  {
+    return {};
+  }
+
+  // guile keeps its compiled files in $XDG_CACHE_HOME/guile, fontconfig its cache in
+  // $XDG_CACHE_HOME/fontconfig
+  std::vector<std::string> res { std::string{"XDG_CACHE_HOME="} + (runtime_directory / "xdg-cache").c_str() };
+  if (with_preloader)
+  {
+    res.push_back(std::string{PATCHED_CACHE_DIR} + "=" + (runtime_directory / "patched").c_str());
+  }
+  return res;
+}
+
+std::vector<char*> get_child_environment(const std::vector<std::string>& env_to_append)
+{
+  std::vector<char*> res;
+  for (unsigned int i = 0; environ[i] != nullptr; ++i)
+  {
+    const std::string inherited = environ[i];
+    const auto is_replaced = std::any_of(env_to_append.begin(), env_to_append.end(), [&] (const std::string& str) {
+	const auto name_end = str.find('=');
+	return (name_end != std::string::npos) and (inherited.compare(0, name_end + 1, str, 0, name_end + 1) == 0);
+      });
+
+    if (not is_replaced)
+    {
+      res.push_back(environ[i]);
+    }
+  }
+  for (const auto& str : env_to_append)
+  {
+    res.push_back(const_cast<char*>(str.c_str()));
+  }
+  res.push_back(nullptr);
+  return res;
+}
+
+// the request is written on a single line, see lilypond-worker.scm
+static
+std::string get_request(const lilypond_run_t& run)
+{
+  auto log_file = run.log_file;
+  log_file += ".log";
+
+  std::string res = "((log-file . " + to_scheme_string(log_file.string()) + ")" +
+                    " (output-dir . " + to_scheme_string(fs::absolute(run.output_directory).string()) + ")" +
+                    " (options";
+  for (const auto& option : run.options)
+  {
+    res += " (" + to_scheme_string(option.name) + " " + to_scheme_string(option.value) + " " +
+           (option.description.empty() ? std::string{"#f"} : to_scheme_string(option.description)) + ")";
+  }
+
+  res += ") (files";
+  for (const auto& input_file : run.input_files)
+  {
+    res += " " + to_scheme_string(fs::absolute(input_file).string());
+  }
+
+  return res + "))\n";
+}
+
+lilypond_worker_pool::lilypond_worker_pool(const std::string& lilypond_command,
+					   const fs::path& worker_file,
+					   const fs::path& preloader_file,
+					   const fs::path& directory,
+					   const fs::path& runtime_directory,
+					   unsigned int nb_workers)
+  : _lilypond_command(lilypond_command)
+  , _worker_file(fs::absolute(worker_file))
+  , _preloader_file(fs::absolute(preloader_file))
+  , _runtime_directory(runtime_directory)
+  , _mutex()
+  , _worker_released()
+  , _workers()
+{
+  if (nb_workers == 0)
+  {
+    throw std::invalid_argument("Error: a lilypond worker pool needs at least one worker of each kind");
+  }
+
+  for (const auto with_preloader : { true, false })
+  {
+    for (unsigned int i = 0; i < nb_workers; ++i)
+    {
+      const auto worker_directory = directory / ((with_preloader ? "worker-unfolded-" : "worker-") + std::to_string(i));
+      fs::create_directories(worker_directory);
+      _workers.push_back(worker_t{ .pid = -1, .socket_fd = -1, .with_preloader = with_preloader,
+	                           .busy = false, .nb_runs = 0, .directory = worker_directory });
+    }
+  }
+
+  try
+  {
+    for (auto& worker : _workers)
+    {
+      start_worker(worker);
+    }
+  }
+  catch (...)
+  {
+    for (auto& worker : _workers)
+    {
+      stop_worker(worker);
+    }
+    throw;
+  }
+}
+
+lilypond_worker_pool::~lilypond_worker_pool()
+{
+  for (auto& worker : _workers)
+  {
+    stop_worker(worker);
+  }
+}
+
+void lilypond_worker_pool::start_worker(worker_t& worker)
+{
+  // a single socket carries the requests and the replies. Unlike a pipe, writing to it when the
+  // worker died gives an error instead of a SIGPIPE.
+  int fds[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+  {
+    throw std::runtime_error(std::string{"Error: failed to create a socket for a lilypond worker ("} + strerror(errno) + ")");
+  }
+
+  const std::vector<std::string> command {
+    _lilypond_command,
+    std::string{"-dlog-file="} + (worker.directory / "startup").string(),
+    "-dno-point-and-click",
+    "-drelative-includes",
+    _worker_file.string() };
+
+  // only the pointers are copied, posix_spawn copies neither the strings nor the memory of this process
+  auto env_to_append = get_cache_environment(_runtime_directory, worker.with_preloader);
+  if (worker.with_preloader)
+  {
+    env_to_append.push_back(std::string{"LD_PRELOAD="} + _preloader_file.c_str());
+    env_to_append.push_back(std::string{DUMP_OUTPUT_DIR} + "=" + worker.directory.c_str());
+  }
+
+  std::vector<char*> c_command;
+  for (const auto& str : command)
+  {
+    c_command.push_back(const_cast<char*>(str.c_str()));
+  }
+  c_command.push_back(nullptr);
+
+  auto c_env = get_child_environment(env_to_append);
+
+  // dup2 clears close-on-exec on the new descriptors
+  posix_spawn_file_actions_t file_actions;
+  posix_spawn_file_actions_init(&file_actions);
+  posix_spawn_file_actions_adddup2(&file_actions, fds[1], STDIN_FILENO);
+  posix_spawn_file_actions_adddup2(&file_actions, fds[1], replies_fd_in_worker);
+
+  pid_t pid;
+  const auto error = ::posix_spawnp(&pid, c_command[0], &file_actions, nullptr, c_command.data(), c_env.data());
+  posix_spawn_file_actions_destroy(&file_actions);
+  if (error != 0)
+  {
+    ::close(fds[0]);
+    ::close(fds[1]);
+    throw std::runtime_error(std::string{"Error: failed to start a lilypond worker ("} + strerror(error) + ")");
+  }
+
+  ::close(fds[1]);
+  worker.pid = pid;
+  worker.socket_fd = fds[0];
+  worker.nb_runs = 0;
+}
+
+void lilypond_worker_pool::stop_worker(worker_t& worker)
+{
+  if (worker.pid == -1)
+  {
+    return;
+  }
+
+  // the worker exits when it reads the end of its requests, unless it is stuck in a run
+  ::shutdown(worker.socket_fd, SHUT_WR);
+  ::close(worker.socket_fd);
+
+  int status;
+  bool has_exited = false;
+  for (int waited_ms = 0; waited_ms < worker_exit_timeout_ms; waited_ms += stop_check_interval_ms)
+  {
+    const auto res = ::waitpid(worker.pid, &status, WNOHANG);
+    if ((res == worker.pid) or ((res == -1) and (errno != EINTR)))
+    {
+      has_exited = true;
+      break;
+    }
+    ::usleep(stop_check_interval_ms * 1000);
+  }
+
+  if (not has_exited)
+  {
+    ::kill(worker.pid, SIGKILL);
+    while ((::waitpid(worker.pid, &status, 0) == -1) and (errno == EINTR))
+    {
+    }
+  }
+  worker.pid = -1;
+  worker.socket_fd = -1;
+}
+
+bool lilypond_worker_pool::send_run(worker_t& worker,
+				    const lilypond_run_t& run,
+				    std::ostream& output_debug_file,
+				    const std::function<bool()>& should_stop)
+{
+  const auto request = get_request(run);
+  output_debug_file << "lilypond worker " << worker.pid << " request: " << request;
+
+  for (size_t written = 0; written < request.size(); )
+  {
+    const auto nb = ::send(worker.socket_fd, request.data() + written, request.size() - written, MSG_NOSIGNAL);
+    if ((nb == -1) and (errno == EINTR))
+    {
+      continue;
+    }
+    if (nb <= 0)
+    {
+      output_debug_file << "  failed to send the request (" << strerror(errno) << ")\n";
+      return false;
+    }
+    written += static_cast<size_t>(nb);
+  }
+
+  // the reply is a single line. When the run can be stopped, it is waited for a bit at a time.
+  std::string reply;
+  for (;;)
+  {
+    if (should_stop)
+    {
+      pollfd poll_fd { .fd = worker.socket_fd, .events = POLLIN, .revents = 0 };
+      const auto res = ::poll(&poll_fd, 1, stop_check_interval_ms);
+      if ((res == -1) and (errno == EINTR))
+      {
+	continue;
+      }
+
+      if (res == 0)
+      {
+	if (should_stop())
+	{
+	  // the worker is replaced once the run is reported as failed
+	  output_debug_file << "  stopped, terminating the worker\n";
+	  ::kill(worker.pid, SIGTERM);
+	  return false;
+	}
+	continue;
+      }
+    }
+
+    char c;
+    const auto nb = ::read(worker.socket_fd, &c, 1);
+    if ((nb == -1) and (errno == EINTR))
+    {
+      continue;
+    }
+
+    if (nb != 1)
+    {
+      output_debug_file << "  the worker died\n";
+      return false;
+    }
+
+    if (c == '\n')
+    {
+      break;
+    }
+    reply += c;
+  }
+
+  output_debug_file << "  reply: " << reply << "\n";
+  if (reply != "ok")
+  {
+    return false;
+  }
+
+  // the preloader writes the patched music functions when lilypond loads them, which proves the
+  // repeats were unfolded
+  if (worker.with_preloader)
+  {
+    const auto patched_file = worker.directory / PATCHED_FILE_NAME;
+    if ((not fs::is_regular_file(patched_file)) or fs::is_empty(patched_file))
+    {
+      output_debug_file << "  Failed to create [" << patched_file.c_str() << "]\n";
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool lilypond_worker_pool::run(const lilypond_run_t& run,
+			       std::ostream& output_debug_file,
+			       const std::function<bool()>& should_stop)
+{
+  const bool with_preloader = not run.preloader_file.empty();
+
+  std::unique_lock<std::mutex> lock (_mutex);
+  auto worker = _workers.end();
+  const auto find_idle_worker = [&] () {
+    worker = std::find_if(_workers.begin(), _workers.end(), [&] (const worker_t& w) {
+	return (w.with_preloader == with_preloader) and (not w.busy);
+      });
+    return worker != _workers.end();
+  };
+
+  if (not should_stop)
+  {
+    _worker_released.wait(lock, find_idle_worker);
+  }
+  else
+  {
+    while (not _worker_released.wait_for(lock, std::chrono::milliseconds(stop_check_interval_ms), find_idle_worker))
+    {
+      if (should_stop())
+      {
+	output_debug_file << "lilypond run stopped before it started\n";
+	return false;
+      }
+    }
+  }
+  worker->busy = true;
+  lock.unlock();
+
+  // the worker stays busy while it is started or restarted, so that nobody else takes it, and the
+  // others are not held back meanwhile
+  const auto release_worker = [&] () {
+    lock.lock();
+    worker->busy = false;
+    lock.unlock();
+    _worker_released.notify_all();
+  };
+
+  // its last restart failed
+  if (worker->pid == -1)
+  {
+    try
+    {
+      start_worker(*worker);
+    }
+    catch (...)
+    {
+      release_worker();
+      throw;
+    }
+  }
+
+  const auto success = send_run(*worker, run, output_debug_file, should_stop);
+
+  // a worker which failed could be in any state, it is replaced by a new one. When the new one
+  // can't be started, the next run using it tries again.
+  ++worker->nb_runs;
+  if ((not success) or (worker->nb_runs >= max_runs_per_worker))
+  {
+    stop_worker(*worker);
+    try
+    {
+      start_worker(*worker);
+    }
+    catch (const std::exception& e)
+    {
+      output_debug_file << "  failed to restart the worker: " << e.what() << "\n";
+    }
+  }
+  release_worker();
+
+  return success;
+}
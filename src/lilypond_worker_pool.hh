@@ -0,0 +1,109 @@
+#pragma once
+
+#include <sys/types.h>
+#include <condition_variable>
+#include <functional>
+#include <ostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "utils.hh"
+
+// a lilypond option set for a single run, as given with -d<name>=<value>
+struct lilypond_option_t
+{
+    std::string name;
+    std::string value; // a scheme expression, e.g. svg or "/path/to/file"
+    std::string description; // empty for the options lilypond already knows
+};
+
+// what a lilypond run has to do, whether it is done by a new process or by a worker
+struct lilypond_run_t
+{
+    std::vector<fs::path> input_files;
+    // where lilypond looks for the files they include. Workers look for them next to the including
+    // file instead.
+    fs::path include_directory;
+    fs::path output_directory;
+    fs::path log_file; // where a worker writes what lilypond prints, once the .log extension is added
+    std::vector<lilypond_option_t> options;
+
+    // the preloader patching the music functions to unfold the repeats. Empty when not needed.
+    fs::path preloader_file;
+};
+
+// quotes the string for scheme, e.g. to give a path as the value of an option
+std::string to_scheme_string(const std::string& str);
+
+// the environment variables making a lilypond process keep its caches in runtime_directory (see
+// prepare_runtime_directory): guile's compiled files, fontconfig's cache and, with the preloader,
+// the patched music functions. Nothing when runtime_directory is empty.
+std::vector<std::string> get_cache_environment(const fs::path& runtime_directory, bool with_preloader);
+
+// the environment of a child process, as posix_spawn wants it: ours, where the variables of
+// env_to_append replace the ones of the same name (getenv would give the inherited one otherwise).
+// Only the pointers are copied, env_to_append must outlive the result.
+std::vector<char*> get_child_environment(const std::vector<std::string>& env_to_append);
+
+// Lilypond processes started in advance, which convert the files they are sent instead of the ones
+// given on their command line (see lilypond-worker.scm). This saves lilypond's startup for each
+// run, which is most of the time spent on small music sheets.
+//
+// The workers run with relative includes instead of --include, so that the same worker can convert
+// files of any directory. Runs using the preloader go to workers started with it, the other ones to
+// workers started without it.
+class lilypond_worker_pool
+{
+  public:
+    // starts nb_workers workers of each kind. worker_file is lilypond-worker.scm, directory is where
+    // the workers keep their own files, runtime_directory where they keep their caches (empty for
+    // the default ones).
+    lilypond_worker_pool(const std::string& lilypond_command,
+			 const fs::path& worker_file,
+			 const fs::path& preloader_file,
+			 const fs::path& directory,
+			 const fs::path& runtime_directory,
+			 unsigned int nb_workers);
+    ~lilypond_worker_pool();
+
+    lilypond_worker_pool(const lilypond_worker_pool&) = delete;
+    lilypond_worker_pool& operator=(const lilypond_worker_pool&) = delete;
+
+    // waits for an idle worker and gives it the run. Returns whether lilypond succeeded. Can be
+    // called from several threads at the same time.
+    //
+    // should_stop, when given, is called regularly while waiting. Once it returns true, the run is
+    // not started, or its worker is terminated and replaced, and it is reported as failed.
+    //
+    // Throws when the worker could not be restarted after its previous run and still can't be.
+    bool run(const lilypond_run_t& run,
+	     std::ostream& output_debug_file,
+	     const std::function<bool()>& should_stop = {});
+
+  private:
+    struct worker_t
+    {
+	pid_t pid;
+	int socket_fd; // carries the requests and the replies
+	bool with_preloader;
+	bool busy;
+	unsigned int nb_runs;
+	fs::path directory;
+    };
+
+    void start_worker(worker_t& worker);
+    void stop_worker(worker_t& worker);
+    bool send_run(worker_t& worker,
+		  const lilypond_run_t& run,
+		  std::ostream& output_debug_file,
+		  const std::function<bool()>& should_stop);
+
+    const std::string _lilypond_command;
+    const fs::path _worker_file;
+    const fs::path _preloader_file;
+    const fs::path _runtime_directory;
+
+    std::mutex _mutex;
+    std::condition_variable _worker_released;
+    std::vector<worker_t> _workers;
+};
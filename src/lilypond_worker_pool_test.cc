@@ -0,0 +1,183 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include "lilypond_worker_pool.hh"
+#include "common.h"
+#include "unit_test.hh"
+
+static
+void test_to_scheme_string()
+{
+  CHECK(to_scheme_string("") == "\"\"");
+  CHECK(to_scheme_string("/tmp/a b.ly") == "\"/tmp/a b.ly\"");
+  CHECK(to_scheme_string("say \"hi\"") == "\"say \\\"hi\\\"\"");
+  CHECK(to_scheme_string("C:\\dir") == "\"C:\\\\dir\"");
+}
+
+static
+void test_get_cache_environment()
+{
+  CHECK(get_cache_environment("", true).empty());
+
+  CHECK(get_cache_environment("/cache/runtime-1", false) ==
+	std::vector<std::string>{ "XDG_CACHE_HOME=/cache/runtime-1/xdg-cache" });
+
+  CHECK((get_cache_environment("/cache/runtime-1", true) ==
+	 std::vector<std::string>{ "XDG_CACHE_HOME=/cache/runtime-1/xdg-cache",
+				   std::string{PATCHED_CACHE_DIR} + "=/cache/runtime-1/patched" }));
+}
+
+static
+size_t count_entries(const std::vector<char*>& env, const std::string& entry)
+{
+  return static_cast<size_t>(std::count_if(env.begin(), env.end(), [&] (const char* str) {
+	return (str != nullptr) and (entry == str);
+      }));
+}
+
+static
+size_t count_variables(const std::vector<char*>& env, const std::string& name)
+{
+  return static_cast<size_t>(std::count_if(env.begin(), env.end(), [&] (const char* str) {
+	return (str != nullptr) and (strncmp(str, (name + "=").c_str(), name.size() + 1) == 0);
+      }));
+}
+
+static
+void test_get_child_environment()
+{
+  ::setenv("XDG_CACHE_HOME", "/home/user/.cache", 1);
+  ::setenv("XDG_CACHE_HOME_OTHER", "kept", 1);
+  ::setenv("LILYDUMPER_TEST_KEPT", "yes", 1);
+
+  const std::vector<std::string> env_to_append { "XDG_CACHE_HOME=/cache/xdg-cache", "LILYDUMPER_TEST_ADDED=1" };
+  const auto env = get_child_environment(env_to_append);
+
+  CHECK((not env.empty()) and (env.back() == nullptr));
+  CHECK(count_variables(env, "XDG_CACHE_HOME") == 1);
+  CHECK(count_entries(env, "XDG_CACHE_HOME=/cache/xdg-cache") == 1);
+  CHECK(count_entries(env, "XDG_CACHE_HOME_OTHER=kept") == 1);
+  CHECK(count_entries(env, "LILYDUMPER_TEST_KEPT=yes") == 1);
+  CHECK(count_entries(env, "LILYDUMPER_TEST_ADDED=1") == 1);
+
+  // the appended variables are not copied
+  CHECK(std::find(env.begin(), env.end(), env_to_append[0].c_str()) != env.end());
+
+  // nothing is lost when nothing is replaced
+  size_t nb_inherited = 0;
+  while (environ[nb_inherited] != nullptr)
+  {
+    ++nb_inherited;
+  }
+  CHECK(get_child_environment({}).size() == nb_inherited + 1);
+}
+
+// the tests start this program as their lilypond command, which then stands in for lilypond running
+// lilypond-worker.scm. What it does with a request depends on the name of its file: failing.ly fails,
+// endless.ly never ends and stubborn.ly fails, and then neither exits nor can be terminated.
+static const char * const stand_in_worker_file = "stand-in-worker.scm";
+
+static
+int run_stand_in_worker()
+{
+  // as lilypond loading the music functions with the preloader
+  const char* const output_dir = ::getenv(DUMP_OUTPUT_DIR);
+  if (output_dir != nullptr)
+  {
+    std::ofstream{fs::path{output_dir} / PATCHED_FILE_NAME} << "patched\n";
+  }
+
+  std::string request;
+  while (std::getline(std::cin, request))
+  {
+    const auto is_about = [&] (const std::string& name) {
+      return request.find("/" + name + "\"") != std::string::npos;
+    };
+
+    if (is_about("endless.ly"))
+    {
+      for (;;)
+      {
+	::pause();
+      }
+    }
+
+    const std::string reply = (is_about("failing.ly") or is_about("stubborn.ly")) ? "failed\n" : "ok\n";
+    if (::write(3, reply.data(), reply.size()) != static_cast<ssize_t>(reply.size()))
+    {
+      return 1;
+    }
+
+    if (is_about("stubborn.ly"))
+    {
+      ::signal(SIGTERM, SIG_IGN);
+      for (;;)
+      {
+	::pause();
+      }
+    }
+  }
+  return 0;
+}
+
+static
+lilypond_run_t get_run(const fs::path& directory, const std::string& input_file, bool with_preloader)
+{
+  return lilypond_run_t{ .input_files = { directory / input_file },
+			 .include_directory = directory,
+			 .output_directory = directory,
+			 .log_file = directory / fs::path{input_file}.stem(),
+			 .options = { lilypond_option_t{ .name = "backend", .value = "svg", .description = {} } },
+			 .preloader_file = with_preloader ? "open_preloader.so" : "" };
+}
+
+static
+void test_worker_pool()
+{
+  const test_directory directory;
+  const auto& dir = directory.path();
+  lilypond_worker_pool pool (fs::canonical("/proc/self/exe").string(), dir / stand_in_worker_file, "open_preloader.so",
+			     dir / "workers", "", 1);
+
+  std::ostringstream log;
+  CHECK(pool.run(get_run(dir, "song.ly", false), log));
+  CHECK(pool.run(get_run(dir, "song.ly", true), log));
+  CHECK(log.str().find(" request: ((log-file . \"" + (dir / "song.log").string() + "\") (output-dir . \"" +
+		       dir.string() + "\") (options (\"backend\" \"svg\" #f)) (files \"" +
+		       (dir / "song.ly").string() + "\"))\n") != std::string::npos);
+  CHECK(log.str().find("  reply: ok\n") != std::string::npos);
+
+  // a failed worker is replaced
+  CHECK(not pool.run(get_run(dir, "failing.ly", false), log));
+  CHECK(pool.run(get_run(dir, "song.ly", false), log));
+
+  // and so is a stopped one
+  const auto start = std::chrono::steady_clock::now();
+  CHECK(not pool.run(get_run(dir, "endless.ly", false), log, [] () noexcept { return true; }));
+  CHECK(std::chrono::steady_clock::now() - start < std::chrono::seconds(1));
+  CHECK(pool.run(get_run(dir, "song.ly", false), log));
+
+  // a worker which doesn't exit once its requests end is killed
+  CHECK(not pool.run(get_run(dir, "stubborn.ly", true), log));
+  CHECK(pool.run(get_run(dir, "song.ly", true), log));
+}
+
+int main(int argc, char* argv[])
+{
+  if ((argc > 1) and (fs::path{argv[argc - 1]}.filename() == stand_in_worker_file))
+  {
+    return run_stand_in_worker();
+  }
+
+  test_to_scheme_string();
+  test_get_cache_environment();
+  test_get_child_environment();
+  test_worker_pool();
+  return test_result();
+}
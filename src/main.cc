@@ -1,32 +1,140 @@
+#include <algorithm>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <sstream>
 #include <vector>
 #include <fstream>
+#include <thread>
 #include "utils.hh"
 #include "command_executor.hh"
-
-extern const char * debug_data_dir;
-
-// it would be better not to use a raw pointer for debug_data_dir
-// however since it is a global variable, it requires an exit-time destructor
-// and a global constructor. so I can't use a std::string.
-const char * debug_data_dir = nullptr;
+#include "job_scheduler.hh"
+#include "conversion_cache.hh"
+#include "conversion_server.hh"
+#include "file_watcher.hh"
+#include "lilypond_worker_pool.hh"
 
 struct options
 {
     options()
-      : input_filename()
+      : input_filenames()
       , output_filename()
+      , output_dir()
+      , timings_file()
+      , nb_jobs(0)
+      , group_size(0)
+      , nb_lilypond_workers(0)
+      , watch(false)
+      , serve_socket()
+      , keep_intermediates(false)
       , debug_data_dir()
+      , intermediates_in_memory(false)
       , lilypond_command()
+      , reuse_intermediates_dir()
+      , runtime_cache_dir()
+      , no_runtime_cache(false)
+      , conversion{ .max_concurrent_passes = 0,
+		    .extraction_threads = 0,
+		    .verify_clean_svgs = false,
+		    .timing_source = timing_source_t::notes_pass,
+		    .cache_directory = {},
+		    .lilypond_job_count = 0,
+		    .split_parts = false,
+		    .runtime_directory = {},
+		    .worker_pool = nullptr,
+		    .bars = { .first = 0, .last = 0 },
+		    .events_only = false,
+		    .progressive_output = false,
+		    .layout_variants = {},
+		    .stream_pages = false }
     {
     }
 
-    fs::path input_filename;
+    std::vector<fs::path> input_filenames;
     fs::path output_filename;
+    fs::path output_dir; // where the output files go when no output file is given
+    fs::path timings_file; // how long each input took to convert in previous batches
+    unsigned int nb_jobs; // how many scores are converted at the same time in batch mode
+    unsigned int group_size; // how many scores share the same lilypond runs in batch mode
+    unsigned int nb_lilypond_workers; // lilypond processes started in advance, of each kind. 0 for none
+    bool watch; // convert the input file again each time it changes
+    fs::path serve_socket; // where conversion requests are received, see serve
+    bool keep_intermediates; // keep the files of the lilypond runs, on disk, even when the conversion succeeded
     fs::path debug_data_dir;
+    bool intermediates_in_memory; // debug_data_dir is a temporary directory in memory, removed at the end in all cases
     std::string lilypond_command;
+    fs::path reuse_intermediates_dir;
+    fs::path runtime_cache_dir; // where the lilypond runs keep their caches from one lilydumper run to the other
+    bool no_runtime_cache;
+    conversion_options conversion;
 };
 
+static
+unsigned int get_strictly_positive_number(const std::string& option, const char* const value)
+{
+  const std::string str {value};
+  if (str.empty() or (str.find_first_not_of("0123456789") != std::string::npos))
+  {
+    throw std::runtime_error(std::string{"Error: '"} + option + "' must be followed by a positive number. Got '" + str + "'");
+  }
+
+  const auto res = std::stoul(str);
+  if ((res == 0) or (res > std::numeric_limits<unsigned int>::max()))
+  {
+    throw std::runtime_error(std::string{"Error: invalid value '"} + str + "' for '" + option + "'");
+  }
+
+  return static_cast<unsigned int>(res);
+}
+
+// a manifest lists one input file per line. Empty lines and lines starting with '#' are ignored.
+// Relative paths are relative to the directory of the manifest.
+static
+std::vector<fs::path> read_manifest(const fs::path& manifest)
+{
+  std::ifstream file (manifest, std::ios::in);
+  if (not file.is_open())
+  {
+    throw std::runtime_error(std::string{"Error: failed to open '"} + manifest.c_str() + "'");
+  }
+
+  std::vector<fs::path> res;
+  for (std::string line; std::getline(file, line); )
+  {
+    const auto begin = line.find_first_not_of(" \t\r");
+    if ((begin == std::string::npos) or (line[begin] == '#'))
+    {
+      continue;
+    }
+
+    const auto end = line.find_last_not_of(" \t\r");
+    const fs::path input = line.substr(begin, end - begin + 1);
+    res.push_back(input.is_absolute() ? input : (manifest.parent_path() / input));
+  }
+
+  return res;
+}
+
+// $XDG_CACHE_HOME/lilydumper, or ~/.cache/lilydumper. Empty when neither is set.
+static
+fs::path get_user_cache_dir()
+{
+  const char* const cache_home = ::getenv("XDG_CACHE_HOME");
+  if ((cache_home != nullptr) and (*cache_home != '\0'))
+  {
+    return fs::path{cache_home} / "lilydumper";
+  }
+
+  const char* const home = ::getenv("HOME");
+  if ((home != nullptr) and (*home != '\0'))
+  {
+    return fs::path{home} / ".cache" / "lilydumper";
+  }
+
+  return {};
+}
+
 static
 struct options get_options(const int argc, const char * const * argv)
 {
@@ -80,13 +188,123 @@ struct options get_options(const int argc, const char * const * argv)
 	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by a filename");
       }
 
-      if (not res.input_filename.empty())
+      ++i;
+      res.input_filenames.emplace_back(argv[i]);
+    }
+    else if (str == "--manifest")
+    {
+      // next parameter will be a file listing input files
+      if (i == static_cast<decltype(i)>(argc) - 1)
+      {
+	// was the last parameter, so there is no manifest behind it!
+	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by a filename");
+      }
+
+      ++i;
+      const auto inputs = read_manifest(argv[i]);
+      res.input_filenames.insert(res.input_filenames.end(), inputs.begin(), inputs.end());
+    }
+    else if (str == "--output-dir")
+    {
+      // next parameter will be the directory receiving the output files
+      if (i == static_cast<decltype(i)>(argc) - 1)
+      {
+	// was the last parameter, so there is no directory behind it!
+	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by a directory name");
+      }
+
+      if (not res.output_dir.empty())
+      {
+	throw std::runtime_error("Error, the output directory must be specified only once.");
+      }
+
+      ++i;
+      res.output_dir = argv[i];
+    }
+    else if ((str == "-j") or (str == "--jobs"))
+    {
+      // next parameter will be the number of scores to convert at the same time
+      if (i == static_cast<decltype(i)>(argc) - 1)
+      {
+	// was the last parameter, so there is no number behind it!
+	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by a number");
+      }
+
+      if (res.nb_jobs != 0)
+      {
+	throw std::runtime_error("Error, the number of jobs must be specified only once.");
+      }
+
+      ++i;
+      res.nb_jobs = get_strictly_positive_number(str, argv[i]);
+    }
+    else if (str == "--group-size")
+    {
+      // next parameter will be the number of scores converted by the same lilypond runs
+      if (i == static_cast<decltype(i)>(argc) - 1)
+      {
+	// was the last parameter, so there is no number behind it!
+	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by a number");
+      }
+
+      if (res.group_size != 0)
+      {
+	throw std::runtime_error("Error, the group size must be specified only once.");
+      }
+
+      ++i;
+      res.group_size = get_strictly_positive_number(str, argv[i]);
+    }
+    else if (str == "--lilypond-job-count")
+    {
+      // next parameter will be the number of processes lilypond splits a group of scores between
+      if (i == static_cast<decltype(i)>(argc) - 1)
+      {
+	// was the last parameter, so there is no number behind it!
+	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by a number");
+      }
+
+      if (res.conversion.lilypond_job_count != 0)
+      {
+	throw std::runtime_error("Error, the lilypond job count must be specified only once.");
+      }
+
+      ++i;
+      res.conversion.lilypond_job_count = get_strictly_positive_number(str, argv[i]);
+    }
+    else if (str == "--lilypond-workers")
+    {
+      // next parameter will be the number of lilypond processes to start in advance
+      if (i == static_cast<decltype(i)>(argc) - 1)
+      {
+	// was the last parameter, so there is no number behind it!
+	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by a number");
+      }
+
+      if (res.nb_lilypond_workers != 0)
+      {
+	throw std::runtime_error("Error, the number of lilypond workers must be specified only once.");
+      }
+
+      ++i;
+      res.nb_lilypond_workers = get_strictly_positive_number(str, argv[i]);
+    }
+    else if (str == "--timings-file")
+    {
+      // next parameter will be the file keeping the conversion times of previous batches
+      if (i == static_cast<decltype(i)>(argc) - 1)
+      {
+	// was the last parameter, so there is no filename behind it!
+	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by a filename");
+      }
+
+      if (not res.timings_file.empty())
       {
-	throw std::runtime_error("Error, the input filename must be specified only once.");
+	throw std::runtime_error("Error, the timings file must be specified only once.");
       }
 
       ++i;
-      res.input_filename = argv[i];
+      res.timings_file = argv[i];
     }
     else if ((str == "-c") or (str == "--lilypond-command"))
     {
@@ -105,6 +323,182 @@ struct options get_options(const int argc, const char * const * argv)
       ++i;
       res.lilypond_command = argv[i];
     }
+    else if (str == "--max-concurrent-passes")
+    {
+      // next parameter will be the maximum number of lilypond processes
+      if (i == static_cast<decltype(i)>(argc) - 1)
+      {
+	// was the last parameter, so there is no number behind it!
+	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by a number");
+      }
+
+      if (res.conversion.max_concurrent_passes != 0)
+      {
+	throw std::runtime_error("Error, the maximum number of concurrent passes must be specified only once.");
+      }
+
+      ++i;
+      res.conversion.max_concurrent_passes = get_strictly_positive_number(str, argv[i]);
+    }
+    else if (str == "--keep-intermediates")
+    {
+      res.keep_intermediates = true;
+    }
+    else if (str == "--watch")
+    {
+      res.watch = true;
+    }
+    else if (str == "--serve")
+    {
+      // next parameter will be the socket
+      if (i == static_cast<decltype(i)>(argc) - 1)
+      {
+	// was the last parameter, so there is no socket behind it!
+	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by a socket path");
+      }
+
+      if (not res.serve_socket.empty())
+      {
+	throw std::runtime_error("Error, the socket to serve on must be specified only once.");
+      }
+
+      ++i;
+      res.serve_socket = argv[i];
+    }
+    else if (str == "--split-parts")
+    {
+      res.conversion.split_parts = true;
+    }
+    else if (str == "--progressive")
+    {
+      res.conversion.progressive_output = true;
+    }
+    else if (str == "--stream-pages")
+    {
+      res.conversion.stream_pages = true;
+    }
+    else if (str == "--events-only")
+    {
+      res.conversion.events_only = true;
+    }
+    else if (str == "--verify-clean-svgs")
+    {
+      res.conversion.verify_clean_svgs = true;
+    }
+    else if (str == "--reuse-intermediates")
+    {
+      // next parameter will be the debug-dump directory of a previous run
+      if (i == static_cast<decltype(i)>(argc) - 1)
+      {
+	// was the last parameter, so there is no directory behind it!
+	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by a directory name");
+      }
+
+      if (not res.reuse_intermediates_dir.empty())
+      {
+	throw std::runtime_error("Error, the directory to reuse must be specified only once.");
+      }
+
+      ++i;
+      res.reuse_intermediates_dir = argv[i];
+    }
+    else if (str == "--runtime-cache-dir")
+    {
+      // next parameter will be the runtime cache directory
+      if (i == static_cast<decltype(i)>(argc) - 1)
+      {
+	// was the last parameter, so there is no directory behind it!
+	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by a directory name");
+      }
+
+      if (not res.runtime_cache_dir.empty())
+      {
+	throw std::runtime_error("Error, the runtime cache directory must be specified only once.");
+      }
+
+      ++i;
+      res.runtime_cache_dir = argv[i];
+    }
+    else if (str == "--no-runtime-cache")
+    {
+      res.no_runtime_cache = true;
+    }
+    else if (str == "--cache-dir")
+    {
+      // next parameter will be the cache directory
+      if (i == static_cast<decltype(i)>(argc) - 1)
+      {
+	// was the last parameter, so there is no directory behind it!
+	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by a directory name");
+      }
+
+      if (not res.conversion.cache_directory.empty())
+      {
+	throw std::runtime_error("Error, the cache directory must be specified only once.");
+      }
+
+      ++i;
+      res.conversion.cache_directory = argv[i];
+    }
+    else if (str == "--timing-source")
+    {
+      // next parameter will be where the note timings come from
+      if (i == static_cast<decltype(i)>(argc) - 1)
+      {
+	// was the last parameter, so there is no source behind it!
+	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by 'notes-pass' or 'midi'");
+      }
+
+      ++i;
+      const std::string source {argv[i]};
+      if (source == "notes-pass")
+      {
+	res.conversion.timing_source = timing_source_t::notes_pass;
+      }
+      else if (source == "midi")
+      {
+	res.conversion.timing_source = timing_source_t::midi;
+      }
+      else
+      {
+	throw std::runtime_error(std::string{"Error: unknown timing source '"} + source + "'. Expected 'notes-pass' or 'midi'");
+      }
+    }
+    else if (str == "--bars")
+    {
+      // next parameter will be the range of bars to keep
+      if (i == static_cast<decltype(i)>(argc) - 1)
+      {
+	// was the last parameter, so there is no range behind it!
+	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by a range of bars, as FROM:TO");
+      }
+
+      if (res.conversion.bars.last != 0)
+      {
+	throw std::runtime_error("Error, the range of bars must be specified only once.");
+      }
+
+      ++i;
+      res.conversion.bars = parse_bar_range(argv[i]);
+    }
+    else if (str == "--layout-variant")
+    {
+      // next parameter will be the layout variant, as NAME=PAPER_FILE
+      if (i == static_cast<decltype(i)>(argc) - 1)
+      {
+	// was the last parameter, so there is no layout behind it!
+	throw std::runtime_error(std::string{"Error: '"} + str + "' must be followed by a layout variant, as NAME=PAPER_FILE");
+      }
+
+      ++i;
+      auto layout = parse_layout_variant(argv[i]);
+      auto& layouts = res.conversion.layout_variants;
+      if (std::any_of(layouts.begin(), layouts.end(), [&] (const layout_variant_t& other) { return other.name == layout.name; }))
+      {
+	throw std::runtime_error("Error, the layout variant '" + layout.name + "' is specified more than once.");
+      }
+      layouts.push_back(std::move(layout));
+    }
     else
     {
       throw std::runtime_error(std::string{"Error, unknown option '"} + str + "'.");
@@ -113,27 +507,172 @@ struct options get_options(const int argc, const char * const * argv)
 
   // finished parsing options
 
-  // ensures all mandatory fields have been set
-  if (res.input_filename.empty())
+  // ensures all mandatory fields have been set. When reusing the files of a previous run, the input
+  // file is only used to name the output file.
+  const bool reuse_intermediates = not res.reuse_intermediates_dir.empty();
+  const bool serve = not res.serve_socket.empty();
+  if (serve and (not res.input_filenames.empty() or not res.output_filename.empty() or not res.output_dir.empty() or
+		 reuse_intermediates or res.watch))
+  {
+    throw std::runtime_error("Error, '--serve' gets the files to convert from its clients.");
+  }
+
+  if (res.input_filenames.empty() and not (serve or (reuse_intermediates and not res.output_filename.empty())))
   {
     throw std::runtime_error(std::string{"Error, missing input file"});
   }
 
+  const bool is_batch = (res.input_filenames.size() > 1);
+  if (is_batch and reuse_intermediates)
+  {
+    throw std::runtime_error("Error, '--reuse-intermediates' works on a single input file.");
+  }
+
+  if (is_batch and not res.output_filename.empty())
+  {
+    throw std::runtime_error("Error, there are several input files. Use '--output-dir' instead of '--output-file'.");
+  }
+
+  // the files of a directory given by the user are what they asked for
+  if (not res.debug_data_dir.empty())
+  {
+    res.keep_intermediates = true;
+  }
+
+  if (reuse_intermediates and not res.conversion.cache_directory.empty())
+  {
+    throw std::runtime_error("Error, '--reuse-intermediates' and '--cache-dir' can't be used together.");
+  }
+
+  if (reuse_intermediates and res.conversion.split_parts)
+  {
+    throw std::runtime_error("Error, '--reuse-intermediates' and '--split-parts' can't be used together.");
+  }
+
+  if (res.conversion.events_only and ((res.conversion.timing_source == timing_source_t::midi) or
+				      res.conversion.verify_clean_svgs or (res.conversion.bars.last != 0)))
+  {
+    throw std::runtime_error("Error, '--events-only' renders no page: it takes the timings from the notes pass, and "
+			     "can't be used with '--verify-clean-svgs' or '--bars'.");
+  }
+
+  if ((res.conversion.bars.last != 0) and
+      ((res.conversion.timing_source == timing_source_t::midi) or res.conversion.split_parts))
+  {
+    throw std::runtime_error("Error, '--bars' only engraves the bars of the range and takes the timings from the notes "
+			     "pass: it can't be used with '--timing-source midi' or '--split-parts'.");
+  }
+
+  if ((not res.conversion.layout_variants.empty()) and
+      ((res.conversion.timing_source == timing_source_t::midi) or res.conversion.verify_clean_svgs or
+       res.conversion.events_only or reuse_intermediates))
+  {
+    throw std::runtime_error("Error, '--layout-variant' shares the notes pass: it takes the timings from it, and "
+			     "can't be used with '--verify-clean-svgs', '--events-only' or '--reuse-intermediates'.");
+  }
+
+  if (res.conversion.stream_pages and res.conversion.progressive_output)
+  {
+    throw std::runtime_error("Error, '--stream-pages' extracts the pages once lilypond is done, and can't be used with "
+			     "'--progressive'.");
+  }
+
+  if (res.no_runtime_cache and not res.runtime_cache_dir.empty())
+  {
+    throw std::runtime_error("Error, '--runtime-cache-dir' and '--no-runtime-cache' can't be used together.");
+  }
+
+  if (res.watch and (is_batch or reuse_intermediates))
+  {
+    throw std::runtime_error("Error, '--watch' works on a single input file, and runs lilypond.");
+  }
+
   // set defaults values for optional and unset values
   if (res.lilypond_command.empty())
   {
     res.lilypond_command = "lilypond";
   }
 
+  // hardware_concurrency can return 0 when the value is not computable.
+  const auto nb_cores = std::max(1u, std::thread::hardware_concurrency());
+  if (res.nb_jobs == 0)
+  {
+    res.nb_jobs = (is_batch or serve) ? nb_cores : 1;
+  }
+
+  if (res.watch and (res.nb_lilypond_workers == 0))
+  {
+    // the point of watching is to convert again quickly
+    res.nb_lilypond_workers = 1;
+  }
+
+  if (serve and (res.nb_lilypond_workers == 0))
+  {
+    // enough for each client being served
+    res.nb_lilypond_workers = res.nb_jobs;
+  }
+
+  if (res.group_size == 0)
+  {
+    res.group_size = 1;
+  }
+
+  if (res.conversion.lilypond_job_count == 0)
+  {
+    // the parts of a file are converted by the same lilypond runs, and lilypond's own processes
+    // share them
+    res.conversion.lilypond_job_count = res.conversion.split_parts ? std::max(1u, nb_cores / res.nb_jobs) : 1;
+  }
+
+  if (res.conversion.max_concurrent_passes == 0)
+  {
+    // there is no point in allowing more than the lilypond runs of a conversion: the notes pass,
+    // the svg run of each layout and the one without skylines. When several scores are converted at
+    // the same time, they share the cores.
+    const auto& conversion = res.conversion;
+    const auto nb_layouts = static_cast<unsigned int>(std::max<size_t>(1, conversion.layout_variants.size()));
+    const auto nb_runs = ((conversion.timing_source == timing_source_t::notes_pass) ? 1u : 0u) +
+      (conversion.events_only ? 0u : nb_layouts) + (conversion.verify_clean_svgs ? 1u : 0u);
+    res.conversion.max_concurrent_passes = std::max(1u, std::min(nb_runs, nb_cores / res.nb_jobs));
+  }
+
+  if (res.conversion.extraction_threads == 0)
+  {
+    // as for the lilypond runs, the conversions done at the same time share the cores
+    res.conversion.extraction_threads = std::max(1u, nb_cores / res.nb_jobs);
+  }
+
+  if (res.runtime_cache_dir.empty() and not (res.no_runtime_cache or reuse_intermediates))
+  {
+    res.runtime_cache_dir = get_user_cache_dir();
+  }
+
   if (res.debug_data_dir.empty())
   {
-    res.debug_data_dir = get_temp_dir().string();
-    std::cout << "Using directory '" << res.debug_data_dir << "'.\n";
+    // kept intermediates are on disk, the others never outlive the conversion
+    res.intermediates_in_memory = not res.keep_intermediates;
+    res.debug_data_dir = get_temp_dir(res.intermediates_in_memory).string();
+
+    // otherwise the directory is removed at the end, unless the conversion fails
+    if (res.keep_intermediates)
+    {
+      std::cout << "Using directory '" << res.debug_data_dir << "'.\n";
+    }
+  }
+
+  // the output files are on disk, next to the kept intermediates or in a directory of their own
+  if (res.output_filename.empty() and res.output_dir.empty() and not serve)
+  {
+    res.output_dir = res.intermediates_in_memory ? get_temp_dir(false) : res.debug_data_dir;
+    if (res.intermediates_in_memory)
+    {
+      std::cout << "Using directory '" << res.output_dir.string() << "' for the output files.\n";
+    }
   }
 
-  if (res.output_filename.empty())
+  if (res.output_filename.empty() and not (is_batch or serve))
   {
-    res.output_filename = fs::path{res.debug_data_dir} / res.input_filename.filename().replace_extension("bin");
+    res.output_filename = res.output_dir / res.input_filenames[0].filename().replace_extension("bin");
   }
 
   return res;
@@ -145,13 +684,387 @@ static void usage(std::ostream& out, const char* const prog_name)
     "[--debug-dump-dir <dirname>] "
     "[-o|--output-file <filename>] "
     "[-c|--lilypond-command <filename>] "
-    "-i|--input-file <filename>"
+    "[--max-concurrent-passes <number>] "
+    "[--verify-clean-svgs] "
+    "[--split-parts] "
+    "[--timing-source notes-pass|midi] "
+    "[--bars <from>:<to>] "
+    "[--events-only] "
+    "[--progressive] "
+    "[--layout-variant <name>=<paper file>]... "
+    "[--stream-pages] "
+    "[--cache-dir <dirname>] "
+    "[--runtime-cache-dir <dirname>|--no-runtime-cache] "
+    "[--reuse-intermediates <dirname>] "
+    "[--output-dir <dirname>] "
+    "[-j|--jobs <number>] "
+    "[--group-size <number>] "
+    "[--lilypond-job-count <number>] "
+    "[--lilypond-workers <number>] "
+    "[--watch] "
+    "[--serve <socket>] "
+    "[--keep-intermediates] "
+    "[--timings-file <filename>] "
+    "[--manifest <filename>]... "
+    "-i|--input-file <filename>..."
     "\n"
     "\n";
 }
 
+// each line is the number of milliseconds the conversion took, followed by the absolute path of the input file
+static
+std::map<std::string, uint64_t> read_timings(const fs::path& timings_file)
+{
+  std::map<std::string, uint64_t> res;
+  std::ifstream file (timings_file, std::ios::in);
+  for (std::string line; std::getline(file, line); )
+  {
+    std::istringstream str (line);
+    uint64_t milliseconds;
+    std::string path;
+    if ((str >> milliseconds) and std::getline(str >> std::ws, path))
+    {
+      res[path] = milliseconds;
+    }
+  }
+
+  return res;
+}
+
+static
+void write_timings(const fs::path& timings_file, const std::map<std::string, uint64_t>& timings)
+{
+  // written aside and renamed, so that a concurrent batch never reads a partial file
+  auto tmp_file = timings_file;
+  tmp_file += ".tmp";
+  {
+    std::ofstream file (tmp_file, std::ios::out | std::ios::trunc);
+    for (const auto& timing : timings)
+    {
+      file << timing.second << " " << timing.first << "\n";
+    }
+  }
+  fs::rename(tmp_file, timings_file);
+}
+
+static
+int convert_batch(const struct options& options)
+{
+  auto timings = options.timings_file.empty() ? std::map<std::string, uint64_t>{} : read_timings(options.timings_file);
+
+  // inputs converted before are expected to take as long as last time. The other ones are expected to
+  // take a time proportional to their size, using the ratio seen on the known ones.
+  uint64_t known_milliseconds = 0;
+  uint64_t known_bytes = 0;
+  for (const auto& input : options.input_filenames)
+  {
+    const auto timing = timings.find(fs::absolute(input).string());
+    if (timing != timings.end())
+    {
+      known_milliseconds += timing->second;
+      known_bytes += fs::file_size(input);
+    }
+  }
+
+  const auto get_expected_cost = [&] (const fs::path& input) {
+    const auto timing = timings.find(fs::absolute(input).string());
+    if (timing != timings.end())
+    {
+      return timing->second;
+    }
+
+    const auto size = fs::file_size(input);
+    return (known_bytes == 0) ? size : (size * known_milliseconds / known_bytes);
+  };
+
+  const auto& output_dir = options.output_dir;
+  std::vector<fs::path> output_files;
+  std::vector<fs::path> all_output_files; // with the ones of each layout variant
+  for (const auto& input : options.input_filenames)
+  {
+    const auto output = output_dir / fs::path{input.filename()}.replace_extension("bin");
+    for (const auto& output_file : get_output_files(output, options.conversion))
+    {
+      if (std::find(all_output_files.begin(), all_output_files.end(), output_file) != all_output_files.end())
+      {
+	throw std::runtime_error(std::string{"Error: several input files would be converted to '"} + output_file.string() + "'");
+      }
+      all_output_files.push_back(output_file);
+    }
+    output_files.push_back(output);
+  }
+
+  // scores of similar cost are grouped together, so that a group is not held back by a single long
+  // score. A score only joins a group it can share the lilypond runs with.
+  std::vector<size_t> order (options.input_filenames.size());
+  std::iota(order.begin(), order.end(), size_t{0});
+  std::stable_sort(order.begin(), order.end(), [&] (size_t a, size_t b) {
+      return get_expected_cost(options.input_filenames[a]) > get_expected_cost(options.input_filenames[b]);
+    });
+
+  std::vector<std::vector<size_t>> groups;
+  for (const auto i : order)
+  {
+    const auto& input = options.input_filenames[i];
+    const auto group = std::find_if(groups.begin(), groups.end(), [&] (const std::vector<size_t>& g) {
+	return (g.size() < options.group_size) and
+	       std::all_of(g.begin(), g.end(), [&] (size_t j) {
+		   return can_share_lilypond_run(options.input_filenames[j], input);
+		 });
+      });
+
+    if (group == groups.end())
+    {
+      groups.push_back({ i });
+    }
+    else
+    {
+      group->push_back(i);
+    }
+  }
+
+  // every group writes the errors of its own scores only, so there is no need to lock anything
+  std::vector<std::string> errors (options.input_filenames.size());
+  std::vector<job_t> jobs;
+  for (size_t g = 0; g < groups.size(); ++g)
+  {
+    std::vector<fs::path> inputs;
+    std::vector<fs::path> outputs;
+    uint64_t expected_cost = 0;
+    for (const auto i : groups[g])
+    {
+      inputs.push_back(options.input_filenames[i]);
+      outputs.push_back(output_files[i]);
+      expected_cost += get_expected_cost(options.input_filenames[i]);
+    }
+
+    // every group gets its own directory for the lilypond runs, its logs and debug data
+    const auto job_dir = options.debug_data_dir / (std::to_string(g) + "-" + inputs[0].stem().string());
+    fs::create_directories(job_dir);
+
+    jobs.emplace_back(job_t{
+	.run = [&options, &errors, group = groups[g], inputs, outputs, job_dir] () {
+	  std::ofstream log_stream ((job_dir / "logs").string());
+	  for (size_t i = 0; i < inputs.size(); ++i)
+	  {
+	    log_stream << "Converting '" << inputs[i].string() << "' to '" << outputs[i].string() << "'\n";
+	  }
+	  log_stream << "\n";
+
+	  const auto group_errors = generate_bin_files(options.lilypond_command, inputs, outputs, options.conversion,
+						       conversion_context(job_dir, log_stream));
+	  for (size_t i = 0; i < group.size(); ++i)
+	  {
+	    errors[group[i]] = group_errors[i];
+	  }
+
+	  // the files of a failed conversion are kept to look at what went wrong
+	  const bool success = std::all_of(group_errors.begin(), group_errors.end(), [] (const std::string& error) {
+	      return error.empty();
+	    });
+	  if (success and not options.keep_intermediates)
+	  {
+	    log_stream.close();
+	    fs::remove_all(job_dir);
+	  }
+	},
+	.expected_cost = expected_cost });
+  }
+
+  const auto group_results = run_jobs(jobs, options.nb_jobs);
+
+  // the scores of a group share its duration
+  std::vector<job_result_t> results (options.input_filenames.size(),
+				     job_result_t{ .success = false, .error_message = {}, .duration = {} });
+  for (size_t g = 0; g < groups.size(); ++g)
+  {
+    for (const auto i : groups[g])
+    {
+      results[i].duration = group_results[g].duration / static_cast<int>(groups[g].size());
+      results[i].error_message = group_results[g].success ? errors[i] : group_results[g].error_message;
+      results[i].success = results[i].error_message.empty();
+    }
+  }
+
+  unsigned int nb_failures = 0;
+  std::cout << "\nSummary:\n";
+  for (size_t i = 0; i < results.size(); ++i)
+  {
+    const auto& input = options.input_filenames[i];
+    const auto milliseconds = std::chrono::duration_cast<std::chrono::milliseconds>(results[i].duration).count();
+    if (results[i].success)
+    {
+      std::cout << "  [ ok ] " << input.string() << " (" << milliseconds << "ms) ->";
+      for (const auto& output_file : get_output_files(output_files[i], options.conversion))
+      {
+	std::cout << " " << output_file.string();
+      }
+      std::cout << "\n";
+      timings[fs::absolute(input).string()] = static_cast<uint64_t>(milliseconds);
+    }
+    else
+    {
+      ++nb_failures;
+      std::cout << "  [fail] " << input.string() << " (" << milliseconds << "ms)\n";
+      std::istringstream message (results[i].error_message);
+      for (std::string line; std::getline(message, line); )
+      {
+	std::cout << "           " << line << "\n";
+      }
+    }
+  }
+  std::cout << (results.size() - nb_failures) << " succeeded, " << nb_failures << " failed\n";
+
+  if (not options.timings_file.empty())
+  {
+    write_timings(options.timings_file, timings);
+  }
+
+  return (nb_failures == 0) ? 0 : 2;
+}
+
+// converts the input file, and then again each time it or one of the files it includes changes. The
+// lilypond workers stay warm between the conversions. Only stops when killed.
+static
+void watch_and_convert(const struct options& options)
+{
+  const auto& input = options.input_filenames[0];
+  const auto run_directory = options.debug_data_dir / "watch";
+  auto tmp_output = options.output_filename;
+  tmp_output += ".tmp";
+
+  file_watcher watcher;
+  std::string converted_key;
+  for (;;)
+  {
+    // watched before converting, so that a change made during the conversion is not missed. The
+    // input can be missing for a moment while an editor saves it.
+    std::vector<fs::path> files { input };
+    std::string key;
+    try
+    {
+      files = get_input_and_included_files(input);
+      std::ofstream dummy_log;
+      key = get_cache_key(input, {}, dummy_log);
+    }
+    catch (const std::exception& e)
+    {
+      std::cout << e.what() << "\n";
+    }
+    watcher.watch(files);
+
+    // saving a file without changing it doesn't need a new conversion
+    if ((not key.empty()) and (key != converted_key))
+    {
+      converted_key = key;
+
+      // the same directory is used for each conversion
+      fs::remove_all(run_directory);
+      fs::create_directories(run_directory);
+      std::ofstream log_stream ((run_directory / "logs").string());
+
+      const auto start = std::chrono::steady_clock::now();
+      try
+      {
+	generate_bin_file(options.lilypond_command, input, tmp_output, options.conversion,
+			  conversion_context(run_directory, log_stream));
+
+	// the player reading the output file never sees a partially written one
+	const auto tmp_outputs = get_output_files(tmp_output, options.conversion);
+	const auto outputs = get_output_files(options.output_filename, options.conversion);
+	for (size_t i = 0; i < outputs.size(); ++i)
+	{
+	  fs::rename(tmp_outputs[i], outputs[i]);
+	}
+	const auto duration = std::chrono::steady_clock::now() - start;
+	std::cout << "Converted '" << input.string() << "' to '" << options.output_filename.string() << "' ("
+		  << std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() << "ms)\n";
+      }
+      catch (const std::exception& e)
+      {
+	std::cout << "Failed to convert '" << input.string() << "':\n" << e.what() << "\n";
+      }
+    }
+
+    std::cout << "Waiting for changes..." << std::endl;
+    watcher.wait_for_change();
+  }
+}
+
+// the runtime directory in cache_dir, see prepare_runtime_directory. The caches only save time, the
+// conversions go on without them when the directory can't be written.
+static
+std::unique_ptr<runtime_directory> get_runtime_directory(const fs::path& cache_dir, std::ofstream& log_stream)
+{
+  try
+  {
+    return prepare_runtime_directory(cache_dir);
+  }
+  catch (const std::exception& e)
+  {
+    log_stream << "Not using the runtime cache directory " << cache_dir << " (" << e.what() << ")\n";
+    return {};
+  }
+}
+
+// removes what the conversions left in the temporary directory, apart from the output files which
+// were asked for there
+static
+void remove_intermediates(const fs::path& directory, const std::vector<fs::path>& output_files)
+{
+  bool is_empty = true;
+  for (const auto& entry : fs::directory_iterator(directory))
+  {
+    const auto is_output = std::any_of(output_files.begin(), output_files.end(), [&] (const fs::path& output) {
+	return fs::exists(output) and fs::equivalent(output, entry.path());
+      });
+
+    if (is_output)
+    {
+      is_empty = false;
+    }
+    else
+    {
+      fs::remove_all(entry.path());
+    }
+  }
+
+  if (is_empty)
+  {
+    fs::remove(directory);
+  }
+}
+
+// the files of a failed conversion are kept to be looked at, but not in memory where nothing would ever remove them:
+// they are moved to disk. Gives where they are.
+static
+fs::path keep_on_disk(const fs::path& directory, bool is_in_memory)
+{
+  if (not is_in_memory)
+  {
+    return directory;
+  }
+
+  try
+  {
+    const auto disk_directory = get_temp_dir(false);
+    fs::copy(directory, disk_directory, fs::copy_options::recursive | fs::copy_options::copy_symlinks);
+    fs::remove_all(directory);
+    return disk_directory;
+  }
+  catch (const std::exception& e)
+  {
+    std::cerr << "Unable to move the intermediate files to disk (" << e.what() << ")\n";
+    return directory;
+  }
+}
+
 int main(int argc, const char * const * argv)
 {
+  // where the files of a failed conversion can be looked at
+  fs::path kept_intermediates_dir;
+  bool intermediates_in_memory = false;
+
   try
   {
     if (argc == 1)
@@ -160,8 +1073,9 @@ int main(int argc, const char * const * argv)
       return 1;
     }
 
-    const auto options = get_options(argc, argv);
-    debug_data_dir = options.debug_data_dir.c_str();
+    auto options = get_options(argc, argv);
+    kept_intermediates_dir = options.debug_data_dir;
+    intermediates_in_memory = options.intermediates_in_memory;
     const auto debug_output_file = options.debug_data_dir / "logs";
     std::ofstream log_stream (debug_output_file.string());
 
@@ -172,13 +1086,92 @@ int main(int argc, const char * const * argv)
     }
     log_stream << "\n\n";
 
-    generate_bin_file(options.lilypond_command, options.input_filename, options.output_filename,
-		      options.debug_data_dir, log_stream);
+    int res = 0;
+    {
+      // released at the end of this block, once the workers are stopped
+      std::unique_ptr<runtime_directory> runtime_dir;
+      if (not options.runtime_cache_dir.empty())
+      {
+	runtime_dir = get_runtime_directory(options.runtime_cache_dir, log_stream);
+	if (runtime_dir != nullptr)
+	{
+	  options.conversion.runtime_directory = runtime_dir->directory();
+	}
+      }
+
+      // stopped at the end of this block, once every conversion is done
+      std::unique_ptr<lilypond_worker_pool> worker_pool;
+
+      if ((options.nb_lilypond_workers != 0) and options.reuse_intermediates_dir.empty())
+      {
+	worker_pool = start_lilypond_workers(options.lilypond_command, options.debug_data_dir / "lilypond-workers",
+					     options.conversion.runtime_directory, options.nb_lilypond_workers);
+	options.conversion.worker_pool = worker_pool.get();
+      }
+
+      if (not options.serve_socket.empty())
+      {
+	const bool all_succeeded = serve(server_options{ .socket_file = options.serve_socket,
+							 .lilypond_command = options.lilypond_command,
+							 .conversion = options.conversion,
+							 .directory = options.debug_data_dir,
+							 .nb_jobs = options.nb_jobs,
+							 .keep_intermediates = options.keep_intermediates });
+	res = all_succeeded ? 0 : 1;
+      }
+      else if (options.input_filenames.size() > 1)
+      {
+	res = convert_batch(options);
+      }
+      else if (options.watch)
+      {
+	watch_and_convert(options);
+      }
+      else if (options.reuse_intermediates_dir.empty())
+      {
+	generate_bin_file(options.lilypond_command, options.input_filenames[0], options.output_filename,
+			  options.conversion, conversion_context(options.debug_data_dir, log_stream));
+      }
+      else
+      {
+	generate_bin_file_from_intermediates(options.reuse_intermediates_dir, options.output_filename,
+					     options.conversion, conversion_context(options.debug_data_dir, log_stream));
+      }
+    }
+
+    log_stream.close();
+    if ((res == 0) and not options.keep_intermediates)
+    {
+      // the output files may have been asked for in the directory given with --debug-dump-dir
+      auto output_files = get_output_files(options.output_filename, options.conversion);
+      if (options.input_filenames.size() > 1)
+      {
+	output_files.clear();
+	for (const auto& input : options.input_filenames)
+	{
+	  const auto outputs = get_output_files(options.output_dir / fs::path{input.filename()}.replace_extension("bin"),
+						options.conversion);
+	  output_files.insert(output_files.end(), outputs.begin(), outputs.end());
+	}
+      }
+      remove_intermediates(options.debug_data_dir, output_files);
+    }
+    else if (res != 0)
+    {
+      std::cout << "The intermediate files are kept in '"
+		<< keep_on_disk(kept_intermediates_dir, intermediates_in_memory).string() << "'.\n";
+    }
+
+    return res;
   }
   catch (const std::exception& e)
   {
     std::cerr << e.what() << "\n";
+    if (not kept_intermediates_dir.empty())
+    {
+      std::cerr << "The intermediate files are kept in '"
+		<< keep_on_disk(kept_intermediates_dir, intermediates_in_memory).string() << "'.\n";
+    }
     return 2;
   }
-  return 0;
 }
@@ -0,0 +1,708 @@
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "midi_file_extractor.hh"
+#include "notes_file_extractor.hh"
+#include "utils.hh"
+
+namespace
+{
+  // big endian reader checking that it never reads past the end of the midi file.
+  class midi_reader
+  {
+    public:
+      midi_reader(const std::vector<uint8_t>& data, const fs::path& filename)
+	: _data(data)
+	, _filename(filename)
+	, _pos(0)
+      {
+      }
+
+      size_t position() const
+      {
+	return _pos;
+      }
+
+      bool at_end() const
+      {
+	return _pos >= _data.size();
+      }
+
+      uint8_t peek_u8() const
+      {
+	check_available(1);
+	return _data[_pos];
+      }
+
+      uint8_t read_u8()
+      {
+	check_available(1);
+	return _data[_pos++];
+      }
+
+      uint32_t read_u16()
+      {
+	const uint32_t high = read_u8();
+	return (high << 8) | read_u8();
+      }
+
+      uint32_t read_u24()
+      {
+	const uint32_t high = read_u16();
+	return (high << 8) | read_u8();
+      }
+
+      uint32_t read_u32()
+      {
+	const uint32_t high = read_u16();
+	return (high << 16) | read_u16();
+      }
+
+      // variable length quantities are stored on at most four bytes, 7 bits per byte, the highest
+      // bit being set on all the bytes but the last one.
+      uint32_t read_variable_length()
+      {
+	uint32_t res = 0;
+	for (unsigned int i = 0; i < 4; ++i)
+	{
+	  const uint8_t byte = read_u8();
+	  res = (res << 7) | (byte & 0x7Fu);
+	  if ((byte & 0x80u) == 0)
+	  {
+	    return res;
+	  }
+	}
+
+	error("variable length quantity longer than 4 bytes");
+      }
+
+      std::string read_string(size_t length)
+      {
+	check_available(length);
+	const auto begin = _data.cbegin() + static_cast<std::vector<uint8_t>::difference_type>(_pos);
+	_pos += length;
+	return std::string(begin, begin + static_cast<std::vector<uint8_t>::difference_type>(length));
+      }
+
+      void skip(size_t nb_bytes)
+      {
+	check_available(nb_bytes);
+	_pos += nb_bytes;
+      }
+
+      [[noreturn]] void error(const std::string& message) const
+      {
+	throw std::runtime_error(std::string{"Error in midi file '"} + _filename.string() + "' at offset " +
+				 std::to_string(_pos) + "\n  " + message);
+      }
+
+    private:
+      void check_available(size_t nb_bytes) const
+      {
+	if (nb_bytes > _data.size() - _pos)
+	{
+	  error("unexpected end of file");
+	}
+      }
+
+      const std::vector<uint8_t>& _data;
+      const fs::path& _filename;
+      size_t _pos;
+  };
+
+  struct tempo_change
+  {
+      uint64_t tick;
+      uint32_t microseconds_per_quarter;
+  };
+
+  struct midi_key_event
+  {
+      uint64_t tick;
+      uint16_t track;
+      uint8_t channel;
+      uint8_t pitch;
+      bool pressed;
+  };
+
+  struct midi_content
+  {
+      uint32_t ticks_per_quarter;
+      std::vector<tempo_change> tempo_changes;
+      std::vector<midi_key_event> key_events;
+  };
+
+  struct midi_note
+  {
+      uint64_t start_time;
+      uint64_t stop_time;
+      uint8_t pitch;
+      uint64_t tolerance; // how far the times can be from the exact ones, as they are stored in ticks
+  };
+
+  // converts the ticks of a midi file to nanoseconds by following its tempo changes
+  class tempo_map
+  {
+    public:
+      explicit tempo_map(const midi_content& content)
+	: _ticks_per_quarter(content.ticks_per_quarter)
+	, _segments()
+      {
+	auto changes = content.tempo_changes;
+	std::stable_sort(changes.begin(), changes.end(), [] (const auto& a, const auto& b) {
+	    return a.tick < b.tick;
+	  });
+
+	// the default tempo of a midi file is 120 quarter notes per minute. lilypond always writes
+	// the tempo at the start of the tracks though.
+	_segments.emplace_back(segment{ .tick = 0, .time = 0, .microseconds_per_quarter = 500000 });
+	for (const auto& change : changes)
+	{
+	  const auto time = to_nanoseconds(change.tick);
+	  if (_segments.back().tick == change.tick)
+	  {
+	    _segments.back().microseconds_per_quarter = change.microseconds_per_quarter;
+	  }
+	  else
+	  {
+	    _segments.emplace_back(segment{ .tick = change.tick,
+					    .time = time,
+					    .microseconds_per_quarter = change.microseconds_per_quarter });
+	  }
+	}
+      }
+
+      uint64_t to_nanoseconds(uint64_t tick) const
+      {
+	const auto& seg = find_segment(tick);
+	return seg.time + (tick - seg.tick) * seg.microseconds_per_quarter * 1000 / _ticks_per_quarter;
+      }
+
+      // duration of one tick at the given position, rounded up
+      uint64_t tick_duration(uint64_t tick) const
+      {
+	const auto& seg = find_segment(tick);
+	return (uint64_t{seg.microseconds_per_quarter} * 1000 + _ticks_per_quarter - 1) / _ticks_per_quarter;
+      }
+
+    private:
+      struct segment
+      {
+	  uint64_t tick;
+	  uint64_t time;
+	  uint64_t microseconds_per_quarter;
+      };
+
+      const segment& find_segment(uint64_t tick) const
+      {
+	const auto it = std::upper_bound(_segments.cbegin(), _segments.cend(), tick, [] (uint64_t t, const segment& seg) {
+	    return t < seg.tick;
+	  });
+	return *std::prev(it); // the first segment starts at tick 0, so there is always one before
+      }
+
+      uint64_t _ticks_per_quarter;
+      std::vector<segment> _segments;
+  };
+}
+
+static
+std::vector<uint8_t> get_file_content(const fs::path& filename)
+{
+  std::ifstream file (filename, std::ios::in | std::ios::binary);
+  if (not file.is_open())
+  {
+    throw std::runtime_error(std::string{"Error: failed to open '"} + filename.c_str() + "'");
+  }
+
+  return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+static
+void read_track(midi_reader& reader, size_t track_end, uint16_t track_number, midi_content& content)
+{
+  uint64_t tick = 0;
+  uint8_t running_status = 0;
+
+  while (reader.position() < track_end)
+  {
+    tick += reader.read_variable_length();
+
+    // with running status, the status byte is omitted when it is the same as the previous event's
+    uint8_t status = reader.peek_u8();
+    if (status >= 0x80)
+    {
+      reader.read_u8();
+    }
+    else if (running_status == 0)
+    {
+      reader.error("data byte found while no status is active");
+    }
+    else
+    {
+      status = running_status;
+    }
+
+    if (status == 0xFF)
+    {
+      // meta event, only the tempo is of interest
+      const auto type = reader.read_u8();
+      const auto length = reader.read_variable_length();
+      if (type == 0x51)
+      {
+	if (length != 3)
+	{
+	  reader.error("tempo meta event with a length of " + std::to_string(length) + " instead of 3");
+	}
+	content.tempo_changes.emplace_back(tempo_change{ .tick = tick, .microseconds_per_quarter = reader.read_u24() });
+      }
+      else
+      {
+	reader.skip(length);
+      }
+      running_status = 0;
+    }
+    else if ((status == 0xF0) or (status == 0xF7))
+    {
+      // system exclusive event
+      reader.skip(reader.read_variable_length());
+      running_status = 0;
+    }
+    else if (status > 0xF0)
+    {
+      reader.error("unexpected system message " + std::to_string(static_cast<unsigned int>(status)) + " in a track");
+    }
+    else
+    {
+      running_status = status;
+      const auto message = static_cast<uint8_t>(status & 0xF0);
+      const auto channel = static_cast<uint8_t>(status & 0x0F);
+
+      if ((message == 0x80) or (message == 0x90))
+      {
+	const auto pitch = reader.read_u8();
+	const auto velocity = reader.read_u8();
+	content.key_events.emplace_back(midi_key_event{ .tick = tick,
+							.track = track_number,
+							.channel = channel,
+							.pitch = pitch,
+							// a note on with a velocity of 0 is a note off
+							.pressed = (message == 0x90) and (velocity != 0) });
+      }
+      else if ((message == 0xC0) or (message == 0xD0))
+      {
+	reader.skip(1); // program change and channel pressure have a single data byte
+      }
+      else
+      {
+	reader.skip(2);
+      }
+    }
+  }
+
+  if (reader.position() != track_end)
+  {
+    reader.error("the last event of the track goes past the end of the track");
+  }
+}
+
+static
+midi_content read_midi_file(const fs::path& filename)
+{
+  const auto data = get_file_content(filename);
+  midi_reader reader (data, filename);
+
+  if (reader.read_string(4) != "MThd")
+  {
+    reader.error("not a midi file, it does not start by 'MThd'");
+  }
+
+  const auto header_length = reader.read_u32();
+  if (header_length < 6)
+  {
+    reader.error("header is too short");
+  }
+
+  reader.read_u16(); // format: the tracks are merged anyway
+  const auto nb_tracks = reader.read_u16();
+  const auto division = reader.read_u16();
+  reader.skip(header_length - 6);
+
+  if ((division & 0x8000) != 0)
+  {
+    reader.error("SMPTE time division is not supported, only ticks per quarter note");
+  }
+
+  if (division == 0)
+  {
+    reader.error("the number of ticks per quarter note can't be 0");
+  }
+
+  midi_content res { .ticks_per_quarter = division, .tempo_changes = {}, .key_events = {} };
+
+  uint16_t track_number = 0;
+  while ((not reader.at_end()) and (track_number < nb_tracks))
+  {
+    const auto chunk_type = reader.read_string(4);
+    const auto chunk_length = reader.read_u32();
+
+    if (chunk_type == "MTrk")
+    {
+      read_track(reader, reader.position() + chunk_length, track_number, res);
+      ++track_number;
+    }
+    else
+    {
+      reader.skip(chunk_length); // unknown chunks must be ignored
+    }
+  }
+
+  if (track_number != nb_tracks)
+  {
+    reader.error("the header announces " + std::to_string(static_cast<unsigned int>(nb_tracks)) + " tracks, but only " +
+		 std::to_string(static_cast<unsigned int>(track_number)) + " were found");
+  }
+
+  return res;
+}
+
+static
+std::vector<midi_note> get_midi_notes(const fs::path& filename)
+{
+  auto content = read_midi_file(filename);
+  const tempo_map tempo (content);
+
+  // events of different tracks are interleaved by time, while keeping their order inside a track
+  std::stable_sort(content.key_events.begin(), content.key_events.end(), [] (const auto& a, const auto& b) {
+      return a.tick < b.tick;
+    });
+
+  // a note off ends the earliest note still pressed on the same track, channel and key
+  std::map<std::tuple<uint16_t, uint8_t, uint8_t>, std::deque<uint64_t>> pressed_keys;
+  std::vector<midi_note> res;
+  for (const auto& event : content.key_events)
+  {
+    auto& starts = pressed_keys[std::make_tuple(event.track, event.channel, event.pitch)];
+    if (event.pressed)
+    {
+      starts.push_back(event.tick);
+    }
+    else if (not starts.empty())
+    {
+      const auto start = starts.front();
+      starts.pop_front();
+
+      if (start < event.tick)
+      {
+	res.emplace_back(midi_note{ .start_time = tempo.to_nanoseconds(start),
+				    .stop_time = tempo.to_nanoseconds(event.tick),
+				    .pitch = event.pitch,
+				    // the listener times are exact, the midi ones are off by less than a
+				    // tick. Leave one more tick for the tempo changes that are also rounded.
+				    .tolerance = 2 * tempo.tick_duration(start) });
+      }
+    }
+  }
+
+  std::stable_sort(res.begin(), res.end(), [] (const auto& a, const auto& b) {
+      return std::tie(a.start_time, a.pitch) < std::tie(b.start_time, b.pitch);
+    });
+
+  return res;
+}
+
+static
+bool has_tie_attached(const note_t& note)
+{
+  return note.id.find("#has-tie-attached=yes#") != std::string::npos;
+}
+
+static
+bool is_grace_note(const note_t& note)
+{
+  return note.id.find("#is-grace-note=yes#") != std::string::npos;
+}
+
+static
+bool is_transparent(const note_t& note)
+{
+  return note.id.find("#is-transparent=yes#") != std::string::npos;
+}
+
+static
+int64_t as_signed(uint64_t time)
+{
+  return static_cast<int64_t>(time);
+}
+
+namespace
+{
+  // The listener sees the score with its repeats folded, while the midi file has them unfolded. The
+  // difference between the time a note is played in the midi file and the time the listener saw it
+  // is called the offset. It stays the same until the midi file jumps back to the start of a
+  // repeat, or to one of its alternatives.
+  //
+  // A listener note can be matched several times (once per repeat), but only once per offset.
+  class notes_matcher
+  {
+    public:
+      notes_matcher(const std::vector<midi_note>& midi_notes, const std::vector<note_t>& listener_notes)
+	: _midi_notes(midi_notes)
+	, _listener_notes(listener_notes)
+	, _by_pitch()
+	, _used()
+      {
+	for (size_t i = 0; i < listener_notes.size(); ++i)
+	{
+	  _by_pitch[listener_notes[i].pitch].push_back(i);
+	}
+
+	for (auto& indexes : _by_pitch)
+	{
+	  std::stable_sort(indexes.begin(), indexes.end(), [&] (size_t a, size_t b) {
+	      return listener_notes[a].start_time < listener_notes[b].start_time;
+	    });
+	}
+      }
+
+      static constexpr size_t not_found = static_cast<size_t>(-1);
+
+      // finds the listener note not yet used for this offset that is the closest to the expected time
+      size_t find(uint8_t pitch, int64_t expected_start, uint64_t tolerance, int64_t offset) const
+      {
+	const auto& indexes = _by_pitch[pitch & 0x7Fu];
+	const auto min_start = expected_start - as_signed(tolerance);
+	const auto max_start = expected_start + as_signed(tolerance);
+
+	auto it = std::lower_bound(indexes.cbegin(), indexes.cend(), min_start, [&] (size_t index, int64_t time) {
+	    return as_signed(_listener_notes[index].start_time) < time;
+	  });
+
+	size_t res = not_found;
+	int64_t best_distance = 0;
+	for (; (it != indexes.cend()) and (as_signed(_listener_notes[*it].start_time) <= max_start); ++it)
+	{
+	  const auto distance = std::abs(as_signed(_listener_notes[*it].start_time) - expected_start);
+	  if ((not is_used(*it, offset)) and ((res == not_found) or (distance < best_distance)))
+	  {
+	    res = *it;
+	    best_distance = distance;
+	  }
+	}
+
+	return res;
+      }
+
+      // counts how many midi notes, starting from the given one, would find a listener note with this offset
+      size_t score(size_t first_midi_note, size_t nb_midi_notes, int64_t offset) const
+      {
+	const auto last = std::min(_midi_notes.size(), first_midi_note + nb_midi_notes);
+	size_t res = 0;
+	for (auto i = first_midi_note; i < last; ++i)
+	{
+	  const auto& note = _midi_notes[i];
+	  if (find(note.pitch, as_signed(note.start_time) - offset, note.tolerance, offset) != not_found)
+	  {
+	    ++res;
+	  }
+	}
+	return res;
+      }
+
+      // all the offsets that would make a listener note of the same pitch start with this midi note
+      std::set<int64_t> possible_offsets(const midi_note& note) const
+      {
+	std::set<int64_t> res;
+	for (const auto index : _by_pitch[note.pitch & 0x7Fu])
+	{
+	  if (_listener_notes[index].start_time <= note.start_time + note.tolerance)
+	  {
+	    res.insert(as_signed(note.start_time) - as_signed(_listener_notes[index].start_time));
+	  }
+	}
+	return res;
+      }
+
+      // the note that the tie of the given one is attached to
+      size_t find_tied_note(const note_t& note, int64_t offset) const
+      {
+	for (const auto index : _by_pitch[note.pitch])
+	{
+	  const auto& candidate = _listener_notes[index];
+	  if ((candidate.start_time == note.stop_time) and (candidate.staff_number == note.staff_number) and
+	      (not is_used(index, offset)))
+	  {
+	    return index;
+	  }
+	}
+	return not_found;
+      }
+
+      void use(size_t listener_note, int64_t offset)
+      {
+	_used.emplace(listener_note, offset);
+      }
+
+    private:
+      bool is_used(size_t listener_note, int64_t offset) const
+      {
+	return _used.count(std::make_pair(listener_note, offset)) != 0;
+      }
+
+      const std::vector<midi_note>& _midi_notes;
+      const std::vector<note_t>& _listener_notes;
+      std::array<std::vector<size_t>, 128> _by_pitch;
+      std::set<std::pair<size_t, int64_t>> _used;
+  };
+}
+
+std::vector<note_t> get_unprocessed_notes_from_midi(const fs::path& midi_file,
+						    const fs::path& listener_notes_file,
+						    const conversion_context& context)
+{
+  const auto midi_notes = get_midi_notes(midi_file);
+  const auto listener_notes = get_unprocessed_notes_with_transparent_ones(listener_notes_file);
+  notes_matcher matcher (midi_notes, listener_notes);
+
+  // how many midi notes after a jump are used to choose the new offset. Repeated passages are common,
+  // so looking at the very first notes only often gives several equally good offsets.
+  constexpr size_t nb_notes_to_choose_offset = 32;
+
+  // grace notes are not played at the same time in midi files as the listener reports them
+  constexpr uint64_t grace_note_tolerance = 1000000000; // nanoseconds
+
+  std::vector<note_t> res;
+  std::vector<const midi_note*> unmatched;
+  unsigned int nb_jumps = 0;
+  int64_t offset = 0;
+
+  size_t group_start = 0;
+  while (group_start < midi_notes.size())
+  {
+    // the notes starting at the same time are played with the same offset
+    size_t group_end = group_start;
+    while ((group_end < midi_notes.size()) and (midi_notes[group_end].start_time == midi_notes[group_start].start_time))
+    {
+      ++group_end;
+    }
+    const auto group_size = group_end - group_start;
+
+    if (matcher.score(group_start, group_size, offset) != group_size)
+    {
+      auto best_offset = offset;
+      auto best_score = matcher.score(group_start, nb_notes_to_choose_offset, offset);
+      for (auto i = group_start; i < group_end; ++i)
+      {
+	for (const auto candidate : matcher.possible_offsets(midi_notes[i]))
+	{
+	  const auto candidate_score = matcher.score(group_start, nb_notes_to_choose_offset, candidate);
+	  if ((candidate_score > best_score) or
+	      ((candidate_score == best_score) and (std::abs(candidate - offset) < std::abs(best_offset - offset))))
+	  {
+	    best_offset = candidate;
+	    best_score = candidate_score;
+	  }
+	}
+      }
+
+      if (best_offset != offset)
+      {
+	context.log() << "  midi notes at " << midi_notes[group_start].start_time << "ns are "
+			  << best_offset << "ns after the listener ones (was " << offset << "ns)\n";
+	offset = best_offset;
+	++nb_jumps;
+      }
+    }
+
+    for (auto i = group_start; i < group_end; ++i)
+    {
+      const auto& midi = midi_notes[i];
+      const auto expected_start = as_signed(midi.start_time) - offset;
+
+      auto index = matcher.find(midi.pitch, expected_start, midi.tolerance, offset);
+      if (index == notes_matcher::not_found)
+      {
+	index = matcher.find(midi.pitch, expected_start, grace_note_tolerance, offset);
+	if ((index != notes_matcher::not_found) and (not is_grace_note(listener_notes[index])))
+	{
+	  index = notes_matcher::not_found;
+	}
+      }
+
+      if (index == notes_matcher::not_found)
+      {
+	unmatched.push_back(&midi);
+	continue;
+      }
+
+      // the midi file has one note for the whole chain of tied notes, while the listener has one per
+      // note head. Split it back so the ties get processed as if the notes came from the listener.
+      std::vector<std::pair<size_t, uint64_t>> chain { { index, midi.start_time } };
+      matcher.use(index, offset);
+      while (has_tie_attached(listener_notes[chain.back().first]))
+      {
+	const auto& previous = listener_notes[chain.back().first];
+	const auto next = matcher.find_tied_note(previous, offset);
+	if (next == notes_matcher::not_found)
+	{
+	  break;
+	}
+
+	matcher.use(next, offset);
+	chain.emplace_back(next, chain.back().second + (previous.stop_time - previous.start_time));
+      }
+
+      for (size_t j = 0; j < chain.size(); ++j)
+      {
+	const auto& listener = listener_notes[chain[j].first];
+	const auto start_time = chain[j].second;
+	const auto listener_stop_time = start_time + (listener.stop_time - listener.start_time);
+	const auto stop_time = (j + 1 < chain.size()) ? chain[j + 1].second :
+	                       (midi.stop_time > start_time) ? midi.stop_time : listener_stop_time;
+
+	// transparent notes are played in the midi file, but they must be ignored just like
+	// get_unprocessed_notes does.
+	if (not is_transparent(listener))
+	{
+	  res.emplace_back(note_t{ .start_time = start_time,
+				   .stop_time = stop_time,
+				   .pitch = listener.pitch,
+				   .is_played = true,
+				   .staff_number = listener.staff_number,
+				   .id = listener.id });
+	}
+      }
+    }
+
+    group_start = group_end;
+  }
+
+  context.log() << "Matched " << (midi_notes.size() - unmatched.size()) << " of the " << midi_notes.size()
+		    << " midi notes to the " << listener_notes.size() << " notes seen by the listener, with "
+		    << nb_jumps << " jumps in the midi file\n\n";
+
+  if (not unmatched.empty())
+  {
+    std::string details;
+    for (const auto* note : unmatched)
+    {
+      details += "  pitch " + std::to_string(static_cast<unsigned int>(note->pitch)) + " at " + std::to_string(note->start_time) + "ns\n";
+    }
+
+    throw std::runtime_error(std::string{"Error: "} + std::to_string(unmatched.size()) + " notes of the midi file '" +
+			     midi_file.string() + "' do not match any note of the music sheet:\n" + details);
+  }
+
+  std::stable_sort(res.begin(), res.end(), [] (const auto& a, const auto& b) {
+      return a.start_time < b.start_time;
+    });
+
+  debug_dump(context, res, "midi_notes");
+  return res;
+}
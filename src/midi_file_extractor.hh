@@ -0,0 +1,13 @@
+#pragma once
+
+#include <vector>
+#include <fstream>
+#include "conversion_context.hh"
+#include "utils.hh"
+
+// Gives the same notes as get_unprocessed_notes would on the notes file of the unfolded score, but
+// the timings come from the midi file lilypond wrote (with its repeats unfolded) while the ids,
+// staff numbers and ties come from the notes the event listener saw while engraving the score.
+std::vector<note_t> get_unprocessed_notes_from_midi(const fs::path& midi_file,
+						    const fs::path& listener_notes_file,
+						    const conversion_context& context);
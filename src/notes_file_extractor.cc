@@ -4,6 +4,8 @@
 #include <fstream>
 #include <stdexcept>
 #include <iterator>
+#include <array>
+#include <chrono>
 #include "notes_file_extractor.hh"
 #include "utils.hh"
 
@@ -269,27 +271,22 @@ void fix_overlapping_key_presses(std::vector<note_t>& notes)
 
 }
 
-std::vector<note_t> get_unprocessed_notes(const fs::path& filename)
+// parses a line of the notes file, and adds its note to notes
+static
+void parse_notes_line(const std::string& line,
+		      const fs::path& filename,
+		      unsigned int line_number,
+		      bool keep_transparent_notes,
+		      std::vector<note_t>& notes)
 {
-  std::ifstream file (filename, std::ios::in);
-  if (! file.is_open() )
-  {
-    throw std::runtime_error(std::string{"Error: failed to open '"} + filename.c_str() + "'");
-  }
-
-  std::vector<note_t> res;
-
-  unsigned int current_line = 1;
-  for (std::string line; std::getline(file, line); ++current_line)
-  {
-    std::istringstream str (line);
-    std::string line_type;
-    std::array<std::string, 4> fields;
-    uint64_t start_time;
-    uint64_t stop_time;
-    uint64_t staff_number;
-
-    str >> line_type
+  std::istringstream str (line);
+  std::string line_type;
+  std::array<std::string, 4> fields;
+  uint64_t start_time;
+  uint64_t stop_time;
+  uint64_t staff_number;
+
+  str >> line_type
 	>> fields[0]
 	>> start_time
 	>> fields[1]
@@ -298,53 +295,53 @@ std::vector<note_t> get_unprocessed_notes(const fs::path& filename)
 	>> staff_number
 	>> fields[3];
 
-    const decltype(fields) expected_fields = { { "start-time:", "stop-time:", "staff-number:", "id:"} };
+  const decltype(fields) expected_fields = { { "start-time:", "stop-time:", "staff-number:", "id:"} };
 
-    if (line_type != "note")
-    {
-      throw std::runtime_error(std::string{"Error in file '"} + filename.c_str() + "' at line " + std::to_string(current_line) + "\n"
+  if (line_type != "note")
+  {
+    throw std::runtime_error(std::string{"Error in file '"} + filename.c_str() + "' at line " + std::to_string(line_number) + "\n"
 			       + "  Line starts by '" +  line_type + "' instead of 'note'");
-    }
+  }
 
-    for (unsigned int i = 0; i < fields.size(); ++i)
+  for (unsigned int i = 0; i < fields.size(); ++i)
+  {
+    if (fields[i] != expected_fields[i])
     {
-      if (fields[i] != expected_fields[i])
-      {
-	throw std::runtime_error(std::string{"Error in file '"} + filename.c_str() + "' at line " + std::to_string(current_line) + "\n"
+	throw std::runtime_error(std::string{"Error in file '"} + filename.c_str() + "' at line " + std::to_string(line_number) + "\n"
 				 "  Expected field name: " + expected_fields[i] + "\n"
 				 "  Got: " + fields[i] );
-      }
     }
+  }
 
-    const std::string id_str (line.substr(line.find(expected_fields[expected_fields.size() - 1]) + 4)); // + 4 for strlen("id: ")
-    if (id_str.find("#origin=") != 0)
-    {
-      throw std::runtime_error(std::string{"Error in file '"} + filename.c_str() + "' at line " + std::to_string(current_line) + "\n"
+  const std::string id_str (line.substr(line.find(expected_fields[expected_fields.size() - 1]) + 4)); // + 4 for strlen("id: ")
+  if (id_str.find("#origin=") != 0)
+  {
+    throw std::runtime_error(std::string{"Error in file '"} + filename.c_str() + "' at line " + std::to_string(line_number) + "\n"
 			       " the id does not start by '#origin='");
-    }
+  }
 
-    if (id_str.empty() or (id_str.back() != '#'))
-    {
-      throw std::runtime_error(std::string{"Error in file '"} + filename.c_str() + "' at line " + std::to_string(current_line) + "\n"
+  if (id_str.empty() or (id_str.back() != '#'))
+  {
+    throw std::runtime_error(std::string{"Error in file '"} + filename.c_str() + "' at line " + std::to_string(line_number) + "\n"
 			       " the id does not end by '#'");
-    }
+  }
 
-    const auto pitch = std::stoul(get_value_from_field(id_str, "pitch"));
-    if ((pitch < pitch_t::la_0) or (pitch > pitch_t::do_8))
-    {
-      throw std::runtime_error(std::string{"Error in file '"} + filename.c_str() + "' at line " + std::to_string(current_line) + "\n"
+  const auto pitch = std::stoul(get_value_from_field(id_str, "pitch"));
+  if ((pitch < pitch_t::la_0) or (pitch > pitch_t::do_8))
+  {
+    throw std::runtime_error(std::string{"Error in file '"} + filename.c_str() + "' at line " + std::to_string(line_number) + "\n"
 			       "  note with value " + std::to_string(pitch) + " and id " + id_str + " is not valid for keyboard.\n"
 			       "  Should be between la_0 (" + std::to_string(static_cast<int>(pitch_t::la_0)) +
 			       ") and do_8 (" + std::to_string(static_cast<int>(pitch_t::do_8)) + ")");
-    }
+  }
 
-    const auto is_transparent_note = [] (const std::string& id) {
-      return id.find("#is-transparent=yes#") != std::string::npos;
-    };
+  const auto is_transparent_note = [] (const std::string& id) {
+    return id.find("#is-transparent=yes#") != std::string::npos;
+  };
 
-    if (not is_transparent_note(id_str))
-    {
-      res.emplace_back(note_t{
+  if (keep_transparent_notes or (not is_transparent_note(id_str)))
+  {
+    notes.emplace_back(note_t{
 	  .start_time = start_time,
 	    .stop_time = stop_time,
 	    .pitch = static_cast<decltype(note_t::pitch)>(pitch),
@@ -352,12 +349,39 @@ std::vector<note_t> get_unprocessed_notes(const fs::path& filename)
 	    .staff_number = static_cast<decltype(note_t::staff_number)>(staff_number),
 	    .id = std::move(id_str) }
 	);
-    }
+  }
+}
+
+static
+std::vector<note_t> read_notes_file(const fs::path& filename, bool keep_transparent_notes)
+{
+  std::ifstream file (filename, std::ios::in);
+  if (! file.is_open() )
+  {
+    throw std::runtime_error(std::string{"Error: failed to open '"} + filename.c_str() + "'");
+  }
+
+  std::vector<note_t> res;
+
+  unsigned int current_line = 1;
+  for (std::string line; std::getline(file, line); ++current_line)
+  {
+    parse_notes_line(line, filename, current_line, keep_transparent_notes, res);
   }
 
   return res;
 }
 
+std::vector<note_t> get_unprocessed_notes(const fs::path& filename)
+{
+  return read_notes_file(filename, false);
+}
+
+std::vector<note_t> get_unprocessed_notes_with_transparent_ones(const fs::path& filename)
+{
+  return read_notes_file(filename, true);
+}
+
 std::vector<note_t> get_processed_notes(const std::vector<note_t>& unprocessed_notes)
 {
   auto res = unprocessed_notes;
@@ -377,3 +401,97 @@ std::vector<note_t> get_processed_notes(const std::vector<note_t>& unprocessed_n
 
   return res;
 }
+
+// how long the reader waits for more lines when it reached the end of the file
+constexpr std::chrono::milliseconds notes_file_poll_interval{10};
+
+notes_file_reader::notes_file_reader(const fs::path& filename)
+  : _filename(filename)
+  , _writer_finished(false)
+  , _failed(false)
+  , _error()
+  , _unprocessed_notes()
+  , _processed_notes()
+  , _thread([this] () { read(); })
+{
+}
+
+notes_file_reader::~notes_file_reader()
+{
+  _writer_finished = true;
+  if (_thread.joinable())
+  {
+    _thread.join();
+  }
+}
+
+void notes_file_reader::writer_finished()
+{
+  _writer_finished = true;
+}
+
+std::tuple<std::vector<note_t>, std::vector<note_t>> notes_file_reader::get_notes()
+{
+  if (not _writer_finished)
+  {
+    throw std::logic_error("Error: the notes file is read before its writer finished");
+  }
+
+  _thread.join();
+  if (_error)
+  {
+    std::rethrow_exception(_error);
+  }
+
+  return std::make_tuple(std::move(_unprocessed_notes), std::move(_processed_notes));
+}
+
+void notes_file_reader::read()
+{
+  try
+  {
+    std::ifstream file (_filename, std::ios::in);
+    if (! file.is_open() )
+    {
+      throw std::runtime_error(std::string{"Error: failed to open '"} + _filename.c_str() + "'");
+    }
+
+    unsigned int current_line = 1;
+    for (;;)
+    {
+      // read before looking at the file, so that what was written before the writer finished is seen
+      const bool writer_finished = _writer_finished;
+      const auto line_start = file.tellg();
+
+      std::string line;
+      if (std::getline(file, line) and (not file.eof()))
+      {
+	parse_notes_line(line, _filename, current_line, false, _unprocessed_notes);
+	++current_line;
+	continue;
+      }
+
+      // the end of the file, and maybe the beginning of a line still being written
+      if (writer_finished)
+      {
+	if (not line.empty())
+	{
+	  parse_notes_line(line, _filename, current_line, false, _unprocessed_notes);
+	}
+	break;
+      }
+
+      file.clear();
+      file.seekg(line_start);
+      std::this_thread::sleep_for(notes_file_poll_interval);
+    }
+
+    // ties and grace notes can only be handled once all the notes are known
+    _processed_notes = get_processed_notes(_unprocessed_notes);
+  }
+  catch (...)
+  {
+    _error = std::current_exception();
+    _failed = true;
+  }
+}
@@ -1,7 +1,48 @@
 #pragma once
 
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <tuple>
 #include <vector>
 #include "utils.hh"
 
 std::vector<note_t> get_unprocessed_notes(const fs::path& filename);
+// same as above, but keeps the notes that are not displayed on the music sheet.
+std::vector<note_t> get_unprocessed_notes_with_transparent_ones(const fs::path& filename);
 std::vector<note_t> get_processed_notes(const std::vector<note_t>& unprocessed_notes);
+
+// parses a notes file while lilypond is still writing it, so that the notes are ready when lilypond
+// exits, and a malformed line is known before. The listener appends a whole line for each note,
+// the reader follows the end of the file until it is told the writer is done.
+class notes_file_reader
+{
+  public:
+    // the file must exist already
+    explicit notes_file_reader(const fs::path& filename);
+    ~notes_file_reader();
+
+    notes_file_reader(const notes_file_reader&) = delete;
+    notes_file_reader& operator=(const notes_file_reader&) = delete;
+
+    // true as soon as a line couldn't be parsed. The writer can be stopped, get_notes will throw.
+    bool failed() const { return _failed; }
+
+    // tells nothing more will be written to the file. Must be called before get_notes.
+    void writer_finished();
+
+    // waits for the end of the file to be parsed. Gives the unprocessed and the processed notes,
+    // or throws what went wrong.
+    std::tuple<std::vector<note_t>, std::vector<note_t>> get_notes();
+
+  private:
+    void read();
+
+    const fs::path _filename;
+    std::atomic<bool> _writer_finished;
+    std::atomic<bool> _failed;
+    std::exception_ptr _error;
+    std::vector<note_t> _unprocessed_notes;
+    std::vector<note_t> _processed_notes;
+    std::thread _thread; // last, it starts once the members above are initialized
+};
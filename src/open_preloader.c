@@ -19,6 +19,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <limits.h>
 #include "common.h"
 
 typedef FILE* (*fopen_fn_t)(const char*, const char*);
@@ -246,6 +247,88 @@ FILE* get_modified_file(const char* pathname)
   return tmpfile_fd;
 }
 
+// djb2, to tell apart the music functions of several lilypond installations in the cache
+static
+unsigned long hash_string(const char* str)
+{
+  unsigned long res = 5381;
+  for (; *str != '\0'; ++str)
+  {
+    res = res * 33 + (unsigned char) *str;
+  }
+  return res;
+}
+
+static
+void save_to_cache(FILE* const patched_fd, const char* const cached_path)
+{
+  // written under another name first, so that no other lilypond process can read a partial file
+  char tmp_path[PATH_MAX];
+  const int len = snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", cached_path, (long) getpid());
+  if ((len < 0) || ((size_t) len >= sizeof(tmp_path)))
+  {
+    return;
+  }
+
+  FILE* const dst_stream = real_fopen(tmp_path, "w");
+  if (dst_stream == NULL)
+  {
+    return;
+  }
+
+  char buffer[4096];
+  size_t nb_read;
+  bool success = true;
+  while ((nb_read = fread(buffer, (size_t) 1, sizeof(buffer), patched_fd)) > 0)
+  {
+    success = success && (fwrite(buffer, (size_t) 1, nb_read, dst_stream) == nb_read);
+  }
+  rewind(patched_fd);
+
+  success = (fclose(dst_stream) == 0) && success;
+  if ((! success) || (rename(tmp_path, cached_path) != 0))
+  {
+    unlink(tmp_path);
+  }
+}
+
+// same as get_modified_file, but reuses the patched file of a former run when the directory of the
+// PATCHED_CACHE_DIR environment variable has it. It is named after the path, size and modification
+// time of the music functions file, a new version of lilypond gets a patched file of its own.
+static
+FILE* get_cached_modified_file(const char* pathname)
+{
+  const char* const cache_dir = secure_getenv(PATCHED_CACHE_DIR);
+  struct stat source_stat;
+  if ((cache_dir == NULL) || (stat(pathname, &source_stat) != 0))
+  {
+    return get_modified_file(pathname);
+  }
+
+  char cached_path[PATH_MAX];
+  const int len = snprintf(cached_path, sizeof(cached_path), "%s/music-functions-%lx-%lld-%lld.scm", cache_dir,
+			   hash_string(pathname), (long long) source_stat.st_size, (long long) source_stat.st_mtime);
+  if ((len < 0) || ((size_t) len >= sizeof(cached_path)))
+  {
+    return get_modified_file(pathname);
+  }
+
+  FILE* const cached_fd = real_fopen(cached_path, "r");
+  if (cached_fd != NULL)
+  {
+    // the patched file is dumped all the same, it tells lilydumper the repeats are unfolded
+    debug_dump(cached_fd, PATCHED_FILE_NAME);
+    return cached_fd;
+  }
+
+  FILE* const res = get_modified_file(pathname);
+  if (res != NULL)
+  {
+    save_to_cache(res, cached_path);
+  }
+  return res;
+}
+
 __attribute__((nonnull (1,2))) static
 bool init_function_ptr(const char* const symbol, void** ptr_to_set)
 {
@@ -305,7 +388,7 @@ int open(const char *pathname, int flags, ...)
     return real_open(pathname, flags);
   }
 
-  FILE* const res = get_modified_file(pathname);
+  FILE* const res = get_cached_modified_file(pathname);
   if (res == NULL)
   {
     return -1;
@@ -335,5 +418,5 @@ FILE *fopen(const char *pathname, const char *mode)
     return real_fopen(pathname, mode);
   }
 
-  return get_modified_file(pathname);
+  return get_cached_modified_file(pathname);
 }
@@ -0,0 +1,309 @@
+#include <cctype>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include "parts_splitter.hh"
+
+namespace
+{
+  // a range of the input file, end excluded
+  struct range_t
+  {
+      size_t begin;
+      size_t end;
+  };
+
+  // what is found at the top level of a lilypond file
+  struct top_level_t
+  {
+      std::vector<range_t> parts; // the \score and \bookpart blocks, keyword included
+      std::vector<range_t> include_names; // the file names of the \include commands, quotes excluded
+      bool can_split;
+  };
+}
+
+static
+size_t skip_string(const std::string& text, size_t pos)
+{
+  // pos is on the opening quote
+  for (++pos; pos < text.size(); ++pos)
+  {
+    if (text[pos] == '\\')
+    {
+      ++pos;
+    }
+    else if (text[pos] == '"')
+    {
+      return pos + 1;
+    }
+  }
+  return pos;
+}
+
+static
+size_t skip_comment(const std::string& text, size_t pos)
+{
+  // pos is on the %, which starts either a block comment %{ ... %} or a line comment
+  if ((pos + 1 < text.size()) and (text[pos + 1] == '{'))
+  {
+    const auto end = text.find("%}", pos + 2);
+    return (end == std::string::npos) ? text.size() : end + 2;
+  }
+
+  const auto end = text.find('\n', pos);
+  return (end == std::string::npos) ? text.size() : end + 1;
+}
+
+// skips the scheme expression after a # or a $. pos is on its first character.
+static
+size_t skip_scheme(const std::string& text, size_t pos)
+{
+  if (pos >= text.size())
+  {
+    return pos;
+  }
+
+  if (text[pos] == '"')
+  {
+    return skip_string(text, pos);
+  }
+
+  if (text[pos] != '(')
+  {
+    // a symbol, a number, a boolean... up to the next delimiter. #{ is lilypond code again.
+    while ((pos < text.size()) and (not std::isspace(static_cast<unsigned char>(text[pos]))) and
+	   (text[pos] != '{') and (text[pos] != '}') and (text[pos] != ')'))
+    {
+      ++pos;
+    }
+    return pos;
+  }
+
+  unsigned int depth = 0;
+  while (pos < text.size())
+  {
+    const auto c = text[pos];
+    if (c == '"')
+    {
+      pos = skip_string(text, pos);
+      continue;
+    }
+
+    if (c == ';')
+    {
+      const auto end = text.find('\n', pos);
+      pos = (end == std::string::npos) ? text.size() : end + 1;
+      continue;
+    }
+
+    if ((c == '#') and (pos + 1 < text.size()) and (text[pos + 1] == '\\'))
+    {
+      // a character, e.g. #\( must not be counted
+      pos += 3;
+      continue;
+    }
+
+    ++pos;
+    if (c == '(')
+    {
+      ++depth;
+    }
+    else if ((c == ')') and (--depth == 0))
+    {
+      return pos;
+    }
+  }
+
+  return pos;
+}
+
+static
+top_level_t scan_top_level(const std::string& text)
+{
+  top_level_t res{ .parts = {}, .include_names = {}, .can_split = true };
+
+  unsigned int depth = 0;
+  size_t part_begin = std::string::npos;
+
+  // whether the top level statement being read defines something instead of printing it: an
+  // assignment, or a \header, \paper, \layout or \midi block
+  bool in_definition = false;
+
+  // an assignment was read, its value comes next. A value which is not a block ends the definition.
+  bool in_value = false;
+
+  // the next string is the name of an included file
+  bool in_include = false;
+
+  for (size_t pos = 0; pos < text.size(); )
+  {
+    const auto c = text[pos];
+    const bool is_double = (pos + 1 < text.size()) and (text[pos + 1] == c);
+
+    if (c == '%')
+    {
+      pos = skip_comment(text, pos);
+    }
+    else if (c == '"')
+    {
+      const auto end = skip_string(text, pos);
+      if (in_include and (depth == 0))
+      {
+	res.include_names.push_back(range_t{ .begin = pos + 1, .end = end - 1 });
+      }
+      in_include = false;
+      if (in_value)
+      {
+	in_definition = in_value = false;
+      }
+      pos = end;
+    }
+    else if ((c == '#') or (c == '$'))
+    {
+      pos = skip_scheme(text, pos + 1);
+      if (in_value)
+      {
+	in_definition = in_value = false;
+      }
+    }
+    else if ((c == '{') or ((c == '<') and is_double))
+    {
+      // the block is the value, the definition ends with it
+      in_value = false;
+      if ((depth == 0) and (part_begin == std::string::npos) and (not in_definition))
+      {
+	// music at the top level, which makes a score of its own
+	res.can_split = false;
+      }
+      ++depth;
+      pos += (c == '{') ? 1 : 2;
+    }
+    else if ((c == '}') or ((c == '>') and is_double))
+    {
+      pos += (c == '}') ? 1 : 2;
+      if ((depth > 0) and (--depth == 0))
+      {
+	if (part_begin != std::string::npos)
+	{
+	  res.parts.push_back(range_t{ .begin = part_begin, .end = pos });
+	  part_begin = std::string::npos;
+	}
+	in_definition = false;
+      }
+    }
+    else if ((c == '\\') and (depth == 0))
+    {
+      auto end = pos + 1;
+      while ((end < text.size()) and std::isalpha(static_cast<unsigned char>(text[end])))
+      {
+	++end;
+      }
+      const auto command = text.substr(pos + 1, end - pos - 1);
+      in_value = false;
+
+      if ((command == "score") or (command == "bookpart"))
+      {
+	part_begin = pos;
+      }
+      else if (command == "book")
+      {
+	res.can_split = false;
+      }
+      else if ((command == "header") or (command == "paper") or (command == "layout") or (command == "midi"))
+      {
+	in_definition = true;
+      }
+      else if (((command == "markup") or (command == "markuplist")) and (not in_definition))
+      {
+	res.can_split = false;
+      }
+      else if (command == "include")
+      {
+	in_include = true;
+      }
+      pos = end;
+    }
+    else
+    {
+      if ((c == '=') and (depth == 0))
+      {
+	in_definition = in_value = true;
+      }
+      else if (in_value and (std::isalnum(static_cast<unsigned char>(c)) or (c == '-') or (c == '.')))
+      {
+	// a word or a number
+	while ((pos + 1 < text.size()) and
+	       (std::isalnum(static_cast<unsigned char>(text[pos + 1])) or (text[pos + 1] == '-') or (text[pos + 1] == '.')))
+	{
+	  ++pos;
+	}
+	in_definition = in_value = false;
+      }
+      ++pos;
+    }
+  }
+
+  return res;
+}
+
+std::vector<fs::path> split_into_parts(const fs::path& input_lily_file, const fs::path& directory)
+{
+  std::ifstream file (input_lily_file, std::ios::in | std::ios::binary);
+  if (! file.is_open() )
+  {
+    throw std::runtime_error(std::string{"Error: failed to open '"} + input_lily_file.c_str() + "'");
+  }
+  const std::string text { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+
+  const auto top_level = scan_top_level(text);
+  if ((not top_level.can_split) or (top_level.parts.size() < 2))
+  {
+    return {};
+  }
+
+  fs::create_directories(directory);
+
+  std::vector<fs::path> res;
+  for (size_t i = 0; i < top_level.parts.size(); ++i)
+  {
+    auto part_text = text;
+    for (size_t j = 0; j < top_level.parts.size(); ++j)
+    {
+      if (j == i)
+      {
+	continue;
+      }
+
+      for (auto pos = top_level.parts[j].begin; pos < top_level.parts[j].end; ++pos)
+      {
+	if (part_text[pos] != '\n')
+	{
+	  part_text[pos] = ' ';
+	}
+      }
+    }
+
+    // the part files are not next to the input file, its includes are made absolute. Walked
+    // backwards, so that replacing a name doesn't move the ones still to replace.
+    const auto input_directory = fs::absolute(input_lily_file).parent_path();
+    for (auto include = top_level.include_names.rbegin(); include != top_level.include_names.rend(); ++include)
+    {
+      const fs::path name = text.substr(include->begin, include->end - include->begin);
+      if (name.is_relative() and fs::exists(input_directory / name))
+      {
+	part_text.replace(include->begin, include->end - include->begin, (input_directory / name).string());
+      }
+    }
+
+    const auto part_file = directory / (input_lily_file.stem().string() + "-part-" + std::to_string(i + 1) + ".ly");
+    std::ofstream output (part_file, std::ios::out | std::ios::binary | std::ios::trunc);
+    output << part_text;
+    if (not output)
+    {
+      throw std::runtime_error(std::string{"Error: failed to write '"} + part_file.c_str() + "'");
+    }
+    res.push_back(part_file);
+  }
+
+  return res;
+}
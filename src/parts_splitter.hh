@@ -0,0 +1,13 @@
+#pragma once
+
+#include <vector>
+#include "utils.hh"
+
+// splits a lilypond file made of several top level \score or \bookpart blocks into one file per
+// block, written into directory as <stem>-part-<n>.ly. Each part file keeps everything else of the
+// input file (version, includes, variables, paper and header blocks), and the blocks of the other
+// parts are blanked out so that the line numbers stay the ones of the input file.
+//
+// Gives nothing when the file has less than two parts, or can't be split safely: a \book block, or
+// music or markup at the top level, which each part would print again.
+std::vector<fs::path> split_into_parts(const fs::path& input_lily_file, const fs::path& directory);
@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include "parts_splitter.hh"
+#include "unit_test.hh"
+
+static
+fs::path write_file(const fs::path& filename, const std::string& content)
+{
+  std::ofstream{filename, std::ios::out | std::ios::binary | std::ios::trunc} << content;
+  return filename;
+}
+
+static
+std::string read_file(const fs::path& filename)
+{
+  std::ifstream file (filename, std::ios::in | std::ios::binary);
+  return std::string{ std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+}
+
+// the number of parts the content is split into
+static
+size_t split(const std::string& content)
+{
+  const test_directory directory;
+  return split_into_parts(write_file(directory.path() / "song.ly", content), directory.path() / "parts").size();
+}
+
+static
+void test_parts()
+{
+  const test_directory directory;
+  const std::string content =
+    "\\version \"2.18.2\"\n"
+    "melody = { c'4 d' }\n"
+    "\\header { title = \"Song\" }\n"
+    "\\score { \\melody }\n"
+    "% \\score { in a comment }\n"
+    "\\bookpart {\n"
+    "  \\score { e'4 }\n"
+    "}\n";
+  const auto parts = split_into_parts(write_file(directory.path() / "song.ly", content), directory.path() / "parts");
+
+  CHECK(parts.size() == 2);
+  if (parts.size() != 2)
+  {
+    return;
+  }
+  CHECK(parts[0] == directory.path() / "parts" / "song-part-1.ly");
+  CHECK(parts[1] == directory.path() / "parts" / "song-part-2.ly");
+
+  // the blocks of the other parts are blanked, the lines stay where they are
+  const auto first = read_file(parts[0]);
+  const auto second = read_file(parts[1]);
+  CHECK(first.size() == content.size());
+  CHECK(second.size() == content.size());
+  CHECK(first.find("\\score { \\melody }") != std::string::npos);
+  CHECK(first.find("e'4") == std::string::npos);
+  CHECK(second.find("\\melody }") == std::string::npos);
+  CHECK(second.find("\\score { e'4 }") != std::string::npos);
+  CHECK(std::count(first.begin(), first.end(), '\n') == std::count(content.begin(), content.end(), '\n'));
+
+  // what is outside of the parts is kept in each of them
+  for (const auto& part : { first, second })
+  {
+    CHECK(part.find("melody = { c'4 d' }") != std::string::npos);
+    CHECK(part.find("\\header { title = \"Song\" }") != std::string::npos);
+  }
+}
+
+static
+void test_includes()
+{
+  const test_directory directory;
+  write_file(directory.path() / "notes.ily", "melody = { c'4 }\n");
+  const auto parts = split_into_parts(write_file(directory.path() / "song.ly",
+						 "\\include \"notes.ily\"\n"
+						 "\\include \"english.ly\"\n"
+						 "\\score { \\melody }\n"
+						 "\\score { d'4 }\n"),
+				      directory.path() / "parts");
+
+  CHECK(parts.size() == 2);
+  for (const auto& part : parts)
+  {
+    const auto text = read_file(part);
+    // the part files are not next to the input file
+    CHECK(text.find("\\include \"" + (directory.path() / "notes.ily").string() + "\"") != std::string::npos);
+    // lilypond's own files are left alone
+    CHECK(text.find("\\include \"english.ly\"") != std::string::npos);
+  }
+}
+
+static
+void test_not_split()
+{
+  // a single part
+  CHECK(split("\\score { c'4 }\n") == 0);
+  CHECK(split("{ c'4 }\n") == 0);
+
+  // music or markup at the top level would be printed by every part
+  CHECK(split("{ c'4 }\n\\score { c'4 }\n\\score { d'4 }\n") == 0);
+  CHECK(split("<< c'4 >>\n\\score { c'4 }\n\\score { d'4 }\n") == 0);
+  CHECK(split("\\markup { Title }\n\\score { c'4 }\n\\score { d'4 }\n") == 0);
+  CHECK(split("\\book { \\score { c'4 } }\n\\score { c'4 }\n\\score { d'4 }\n") == 0);
+
+  // a definition ends with its value
+  CHECK(split("x = #5\n{ c'4 }\n\\score { c'4 }\n\\score { d'4 }\n") == 0);
+  CHECK(split("x = \"s\"\n\\markup \"hi\"\n\\score { c'4 }\n\\score { d'4 }\n") == 0);
+  CHECK(split("x = 5\n{ c'4 }\n\\score { c'4 }\n\\score { d'4 }\n") == 0);
+}
+
+static
+void test_definitions()
+{
+  // definitions and settings are not music printed at the top level
+  CHECK(split("x = { c'4 }\n"
+	      "y = \\markup { hi }\n"
+	      "z = #(list 1 2)\n"
+	      "w = \"s\"\n"
+	      "\\paper { indent = 0 }\n"
+	      "\\layout { \\context { \\Score } }\n"
+	      "\\score { \\x }\n"
+	      "\\score { d'4 }\n") == 2);
+
+  // nor what is in comments and strings
+  CHECK(split("%{ { c'4 } %}\n"
+	      "% \\markup { hi }\n"
+	      "\\header { title = \"{ \\markup\" }\n"
+	      "\\score { c'4 }\n"
+	      "\\score { d'4 }\n") == 2);
+}
+
+int main()
+{
+  test_parts();
+  test_includes();
+  test_not_split();
+  test_definitions();
+  return test_result();
+}
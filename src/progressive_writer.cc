@@ -0,0 +1,260 @@
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include "bar_number_events_extractor.hh"
+#include "chords_extractor.hh"
+#include "keyboard_events_extractor.hh"
+#include "progressive_writer.hh"
+#include "staff_num_to_instr_extractor.hh"
+
+using time_type = decltype(key_event::time);
+
+// the events of a song are all written once they are written until this time
+constexpr auto end_of_song = std::numeric_limits<time_type>::max();
+
+static
+std::ofstream open_output_file(const fs::path& output_file)
+{
+  std::ofstream file (output_file, std::ios::binary | std::ios::trunc | std::ios::out);
+  if (not file.is_open())
+  {
+    throw std::runtime_error(std::string{"Error: failed to open "} + output_file.c_str());
+  }
+  return file;
+}
+
+progressive_writer::progressive_writer(const fs::path& output_file,
+				       bool with_pages,
+				       const conversion_context& context)
+  : _file(open_output_file(output_file))
+  , _writer(_file)
+  , _with_pages(with_pages)
+  , _mutex()
+  , _changed()
+  , _finished(false)
+  , _notes_ready(false)
+  , _unprocessed_notes()
+  , _processed_notes()
+  , _staffs_num_file()
+  , _extracted_pages()
+  , _started(false)
+  , _chords()
+  , _keyboard_events()
+  , _first_pages()
+  , _ids_on_pages()
+  , _cursor_boxes()
+  , _written_until(0)
+  , _all_events_written(false)
+  , _error()
+  , _log()
+  , _context(context.in_sub_directory("progressive").with_log(_log))
+  , _thread([this] () { write(); })
+{
+}
+
+progressive_writer::~progressive_writer()
+{
+  {
+    std::lock_guard<std::mutex> lock (_mutex);
+    _finished = true;
+  }
+  _changed.notify_all();
+
+  if (_thread.joinable())
+  {
+    _thread.join();
+  }
+}
+
+void progressive_writer::notes_ready(std::vector<note_t> unprocessed_notes,
+				     std::vector<note_t> processed_notes,
+				     const fs::path& staffs_num_file)
+{
+  {
+    std::lock_guard<std::mutex> lock (_mutex);
+    _unprocessed_notes = std::move(unprocessed_notes);
+    _processed_notes = std::move(processed_notes);
+    _staffs_num_file = staffs_num_file;
+    _notes_ready = true;
+  }
+  _changed.notify_all();
+}
+
+void progressive_writer::page_extracted(unsigned int page_number, const svg_file_t& page)
+{
+  {
+    std::lock_guard<std::mutex> lock (_mutex);
+    _extracted_pages.emplace(page_number, page);
+  }
+  _changed.notify_all();
+}
+
+void progressive_writer::write()
+{
+  try
+  {
+    for (;;)
+    {
+      {
+	std::unique_lock<std::mutex> lock (_mutex);
+	_changed.wait(lock, [&] () {
+	    return _finished or (_notes_ready and not _started) or
+	      (_started and (_extracted_pages.count(static_cast<unsigned int>(_first_pages.size() + 1)) != 0));
+	  });
+
+	if (_finished)
+	{
+	  return;
+	}
+
+	// the pages are only written once the notes are known, they wait until then
+	if (_notes_ready)
+	{
+	  for (auto page = _extracted_pages.find(static_cast<unsigned int>(_first_pages.size() + 1));
+	       page != _extracted_pages.end();
+	       page = _extracted_pages.find(static_cast<unsigned int>(_first_pages.size() + 1)))
+	  {
+	    _first_pages.push_back(page->second);
+	    _extracted_pages.erase(page);
+	  }
+	}
+      }
+
+      // the notes don't change once they are given
+      if (not _started)
+      {
+	start(get_staff_instr_mapping(_staffs_num_file, _context));
+	_chords = get_chords(_processed_notes, _context);
+	_keyboard_events = get_key_events(_processed_notes, _context);
+	if (not _with_pages)
+	{
+	  write_events_until(end_of_song, _keyboard_events, {}, {});
+	}
+      }
+
+      if (_with_pages)
+      {
+	write_ready_chords();
+      }
+    }
+  }
+  catch (...)
+  {
+    _error = std::current_exception();
+  }
+}
+
+void progressive_writer::start(const std::vector<std::string>& staffs_to_instrument)
+{
+  _writer.write_staff_num_mapping(staffs_to_instrument);
+  _started = true;
+}
+
+// writes the pages not written yet, then the events until the first chord on a page still to come
+void progressive_writer::write_ready_chords()
+{
+  for (auto page = _writer.nb_pages(); page < _first_pages.size(); ++page)
+  {
+    for (const auto& note_head : _first_pages[page].note_heads)
+    {
+      _ids_on_pages.insert(note_head.id);
+    }
+    _writer.write_page(_first_pages[page].clean_filename);
+  }
+
+  // a cursor box per chord written
+  const auto first_chord = _cursor_boxes.size();
+  auto end_chord = first_chord;
+  while ((end_chord < _chords.size()) and
+	 std::all_of(_chords[end_chord].notes.cbegin(), _chords[end_chord].notes.cend(), [&] (const note_t& note) {
+	     return _ids_on_pages.count(note.id) != 0;
+	   }))
+  {
+    ++end_chord;
+  }
+
+  if (_all_events_written or ((end_chord == first_chord) and (end_chord < _chords.size())))
+  {
+    return;
+  }
+
+  const std::vector<chord_t> ready_chords (_chords.cbegin() + static_cast<long>(first_chord),
+					   _chords.cbegin() + static_cast<long>(end_chord));
+  const auto cursor_boxes = get_cursor_boxes(ready_chords, _first_pages, _unprocessed_notes);
+  _cursor_boxes.insert(_cursor_boxes.end(), cursor_boxes.cbegin(), cursor_boxes.cend());
+
+  // the key events after the last chord, the releases, can only be written with it
+  const auto end_time = (end_chord == _chords.size()) ? end_of_song : _chords[end_chord].notes.at(0).start_time;
+  write_events_until(end_time, _keyboard_events, cursor_boxes, get_bar_num_events(_cursor_boxes));
+
+  _log << "Written the events of " << end_chord << " chords out of " << _chords.size() << ", and "
+       << _writer.nb_pages() << " pages\n";
+}
+
+// writes the events from _written_until to end_time, excluded
+void progressive_writer::write_events_until(time_type end_time,
+					    const std::vector<key_event>& keyboard_events,
+					    const std::vector<cursor_box_t>& cursor_boxes,
+					    const std::vector<bar_num_event_t>& bar_num_events)
+{
+  const auto in_range = [&] (time_type time) {
+    return (time >= _written_until) and (time < end_time);
+  };
+
+  std::vector<key_event> keyboard_events_in_range;
+  std::copy_if(keyboard_events.cbegin(), keyboard_events.cend(), std::back_inserter(keyboard_events_in_range),
+	       [&] (const auto& event) { return in_range(event.time); });
+
+  std::vector<cursor_box_t> cursor_boxes_in_range;
+  std::copy_if(cursor_boxes.cbegin(), cursor_boxes.cend(), std::back_inserter(cursor_boxes_in_range),
+	       [&] (const auto& cursor_box) { return in_range(cursor_box.start_time); });
+
+  std::vector<bar_num_event_t> bar_num_events_in_range;
+  std::copy_if(bar_num_events.cbegin(), bar_num_events.cend(), std::back_inserter(bar_num_events_in_range),
+	       [&] (const auto& event) { return in_range(event.time); });
+
+  _writer.write_events(keyboard_events_in_range, cursor_boxes_in_range, bar_num_events_in_range);
+  _written_until = end_time;
+  _all_events_written = (end_time == end_of_song);
+}
+
+void progressive_writer::finish(const song_t& song, std::ostream& output_debug_file)
+{
+  {
+    std::lock_guard<std::mutex> lock (_mutex);
+    _finished = true;
+  }
+  _changed.notify_all();
+  _thread.join();
+
+  output_debug_file << _log.str();
+  if (_error)
+  {
+    std::rethrow_exception(_error);
+  }
+
+  output_debug_file << "Written " << _writer.nb_pages() << " pages out of " << song.svg_files.size()
+		    << " while lilypond was running\n";
+
+  if (not _started)
+  {
+    start(song.staffs_to_instrument);
+  }
+
+  for (auto page = _writer.nb_pages(); page < song.svg_files.size(); ++page)
+  {
+    _writer.write_page(song.svg_files[page]);
+  }
+
+  if (not _all_events_written)
+  {
+    write_events_until(end_of_song, song.keyboard_events, song.cursor_boxes, song.bar_num_events);
+  }
+
+  _writer.write_end();
+  _file.close();
+  if (_file.fail())
+  {
+    throw std::runtime_error("Error: failed to write the output file");
+  }
+}
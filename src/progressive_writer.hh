@@ -0,0 +1,85 @@
+#pragma once
+
+#include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "command_executor.hh"
+#include "file_exporter.hh"
+
+// writes the output file of a conversion while lilypond is still rendering the pages, in the
+// progressive version of the file format (see conversion_options::progressive_output). Once the
+// notes pass is done, each page extracted is written with the events up to the first chord which
+// is on a page still to come, so that a player can start with the first pages. What is left is
+// written by finish, once the song is extracted.
+//
+// The work is done by a thread of its own, so that neither the lilypond runs nor the extraction of
+// the pages wait for it.
+class progressive_writer
+{
+  public:
+    // the output file is created right away. with_pages is false when only the key events are
+    // extracted. context is the one of the conversion, whose log is only written by finish.
+    progressive_writer(const fs::path& output_file, bool with_pages, const conversion_context& context);
+    ~progressive_writer();
+
+    progressive_writer(const progressive_writer&) = delete;
+    progressive_writer& operator=(const progressive_writer&) = delete;
+
+    // the notes pass is done, its notes and staff-num-to-instrument file are complete. Can be
+    // called from any thread.
+    void notes_ready(std::vector<note_t> unprocessed_notes,
+		     std::vector<note_t> processed_notes,
+		     const fs::path& staffs_num_file);
+
+    // the page page_number (from 1) is extracted. Can be called from any thread.
+    void page_extracted(unsigned int page_number, const svg_file_t& page);
+
+    // writes what is not written yet of the song, which must be the one made of the notes and the
+    // pages given before, and ends the file. Throws what went wrong while writing.
+    void finish(const song_t& song, std::ostream& output_debug_file);
+
+  private:
+    void write();
+    void start(const std::vector<std::string>& staffs_to_instrument);
+    void write_ready_chords();
+    void write_events_until(decltype(key_event::time) end_time,
+			    const std::vector<key_event>& keyboard_events,
+			    const std::vector<cursor_box_t>& cursor_boxes,
+			    const std::vector<bar_num_event_t>& bar_num_events);
+
+    std::ofstream _file;
+    song_chunks_writer _writer;
+    const bool _with_pages;
+
+    // what the conversion gives, under _mutex
+    std::mutex _mutex;
+    std::condition_variable _changed;
+    bool _finished;
+    bool _notes_ready;
+    std::vector<note_t> _unprocessed_notes;
+    std::vector<note_t> _processed_notes;
+    fs::path _staffs_num_file;
+    std::map<unsigned int, svg_file_t> _extracted_pages;
+
+    // only used by the writing thread, then by finish
+    bool _started; // the staff-num-to-instrument mapping is written
+    std::vector<chord_t> _chords;
+    std::vector<key_event> _keyboard_events;
+    std::vector<svg_file_t> _first_pages; // the pages 1 to n, without any missing
+    std::set<std::string> _ids_on_pages; // of the notes on _first_pages
+    std::vector<cursor_box_t> _cursor_boxes; // of the chords written
+    decltype(key_event::time) _written_until; // all the events before this time are written
+    bool _all_events_written;
+
+    std::exception_ptr _error;
+    std::ostringstream _log; // the log stream of the conversion isn't thread safe
+    const conversion_context _context; // the conversion's, with _log
+    std::thread _thread; // last, it starts once the members above are initialized
+};
@@ -0,0 +1,147 @@
+#include <algorithm>
+#include <stdexcept>
+#include "sha256.hh"
+
+static constexpr std::array<uint32_t, 64> round_constants = { {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 } };
+
+static
+uint32_t rotate_right(uint32_t value, unsigned int nb_bits)
+{
+  return (value >> nb_bits) | (value << (32 - nb_bits));
+}
+
+sha256::sha256()
+  : _state{ { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 } }
+  , _buffer()
+  , _buffer_size(0)
+  , _total_length(0)
+{
+}
+
+void sha256::process_block(const uint8_t* block)
+{
+  std::array<uint32_t, 64> w;
+  for (unsigned int i = 0; i < 16; ++i)
+  {
+    w[i] = (uint32_t{block[4 * i]} << 24) | (uint32_t{block[4 * i + 1]} << 16) |
+           (uint32_t{block[4 * i + 2]} << 8) | uint32_t{block[4 * i + 3]};
+  }
+
+  for (unsigned int i = 16; i < 64; ++i)
+  {
+    const auto s0 = rotate_right(w[i - 15], 7) ^ rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    const auto s1 = rotate_right(w[i - 2], 17) ^ rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  auto a = _state[0];
+  auto b = _state[1];
+  auto c = _state[2];
+  auto d = _state[3];
+  auto e = _state[4];
+  auto f = _state[5];
+  auto g = _state[6];
+  auto h = _state[7];
+
+  for (unsigned int i = 0; i < 64; ++i)
+  {
+    const auto s1 = rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25);
+    const auto ch = (e & f) ^ ((~e) & g);
+    const auto temp1 = h + s1 + ch + round_constants[i] + w[i];
+    const auto s0 = rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22);
+    const auto maj = (a & b) ^ (a & c) ^ (b & c);
+    const auto temp2 = s0 + maj;
+
+    h = g;
+    g = f;
+    f = e;
+    e = d + temp1;
+    d = c;
+    c = b;
+    b = a;
+    a = temp1 + temp2;
+  }
+
+  _state[0] += a;
+  _state[1] += b;
+  _state[2] += c;
+  _state[3] += d;
+  _state[4] += e;
+  _state[5] += f;
+  _state[6] += g;
+  _state[7] += h;
+}
+
+void sha256::update(const void* data, size_t length)
+{
+  const auto* bytes = static_cast<const uint8_t*>(data);
+  _total_length += length;
+
+  while (length > 0)
+  {
+    const auto to_copy = std::min(length, _buffer.size() - _buffer_size);
+    std::copy(bytes, bytes + to_copy, _buffer.begin() + static_cast<long>(_buffer_size));
+    _buffer_size += to_copy;
+    bytes += to_copy;
+    length -= to_copy;
+
+    if (_buffer_size == _buffer.size())
+    {
+      process_block(_buffer.data());
+      _buffer_size = 0;
+    }
+  }
+}
+
+void sha256::update(const std::string& data)
+{
+  update(data.data(), data.size());
+}
+
+std::string sha256::hex_digest()
+{
+  // the message is followed by a bit set to one, then by zeros, and finally by its length in bits
+  // on 64 bits big endian, so that the whole is a multiple of 512 bits.
+  const uint64_t length_in_bits = _total_length * 8;
+
+  const uint8_t end_marker = 0x80;
+  update(&end_marker, 1);
+
+  const uint8_t zero = 0;
+  while (_buffer_size != 56)
+  {
+    update(&zero, 1);
+  }
+
+  std::array<uint8_t, 8> length_bytes;
+  for (unsigned int i = 0; i < 8; ++i)
+  {
+    length_bytes[i] = static_cast<uint8_t>(length_in_bits >> (56 - 8 * i));
+  }
+  update(length_bytes.data(), length_bytes.size());
+
+  if (_buffer_size != 0)
+  {
+    throw std::logic_error("Error: the sha256 padding does not end on a block boundary");
+  }
+
+  const char* const hex_digits = "0123456789abcdef";
+  std::string res;
+  for (const auto word : _state)
+  {
+    for (int shift = 28; shift >= 0; shift -= 4)
+    {
+      res += hex_digits[(word >> shift) & 0xF];
+    }
+  }
+
+  return res;
+}
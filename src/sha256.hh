@@ -0,0 +1,28 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+
+// incremental sha-256 (FIPS 180-4). Used to compute the keys of the conversion cache, there is no
+// need to pull a crypto library just for that.
+class sha256
+{
+  public:
+    sha256();
+
+    void update(const void* data, size_t length);
+    void update(const std::string& data);
+
+    // pads the message and gives the digest as lower case hexadecimal. The object can't be updated
+    // any more afterwards.
+    std::string hex_digest();
+
+  private:
+    void process_block(const uint8_t* block);
+
+    std::array<uint32_t, 8> _state;
+    std::array<uint8_t, 64> _buffer;
+    size_t _buffer_size;
+    uint64_t _total_length;
+};
@@ -4,7 +4,7 @@
 #include <fstream>
 #include "staff_num_to_instr_extractor.hh"
 
-std::vector<std::string> get_staff_instr_mapping(const fs::path& filename, std::ofstream& output_debug_file)
+std::vector<std::string> get_staff_instr_mapping(const fs::path& filename, const conversion_context& context)
 {
   // preconditions:
   // 1) all staff numbers are in the range [0 .. staff_num_mapping.size() - 1]
@@ -46,7 +46,7 @@ std::vector<std::string> get_staff_instr_mapping(const fs::path& filename, std::
 
     if (instr_name == "")
     {
-      output_debug_file << std::string{"Warning: no instrument name found for staff "} + std::to_string(instr_num) + "\n";
+      context.log() << std::string{"Warning: no instrument name found for staff "} + std::to_string(instr_num) + "\n";
     }
 
     res.emplace_back( std::move(instr_name) );
@@ -56,6 +56,6 @@ std::vector<std::string> get_staff_instr_mapping(const fs::path& filename, std::
 
   file.close();
 
-  debug_dump(res, "instruments");
+  debug_dump(context, res, "instruments");
   return res;
 }
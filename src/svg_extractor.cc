@@ -3,6 +3,8 @@
 #include <cstdlib>
 #include <stdexcept>
 #include <algorithm>
+#include <fstream>
+#include <iterator>
 #include <pugixml.hpp>
 #include "svg_extractor.hh"
 #include "utils.hh"
@@ -342,28 +344,38 @@ std::vector<skyline_t> get_skylines(const pugi::xml_document& svg_file,
   return res;
 }
 
+// xpath queries selecting the groups lilypond draws when running with the debug-skylines option.
+static constexpr const char * const top_systems_skyline_xpath =
+  "//g[(@color=\"rgb(25500.0000%, 0.0000%, 0.0000%)\") or (@color=\"rgb(25500.0%, 0.0%, 0.0%)\") or (@color=\"rgb(100.0000%, 0.0000%, 0.0000%)\")]";
+static constexpr const char * const bottom_systems_skyline_xpath =
+  "//g[(@color=\"rgb(0.0000%, 25500.0000%, 0.0000%)\") or (@color=\"rgb(0.0%, 25500.0%, 0.0%)\") or (@color=\"rgb(0.0000%, 100.0000%, 0.0000%)\")]";
+static constexpr const char * const top_staves_skyline_xpath =
+  "//g[(@color=\"rgb(25500.0000%, 0.0000%, 25500.0000%)\") or (@color=\"rgb(25500.0%, 0.0%, 25500.0%)\") or (@color=\"rgb(100.0000%, 0.0000%, 100.0000%)\")]";
+static constexpr const char * const bottom_staves_skyline_xpath =
+  "//g[(@color=\"rgb(0.0000%, 25500.0000%, 25500.0000%)\") or (@color=\"rgb(0.0%, 25500.0%, 25500.0%)\") or (@color=\"rgb(0.0000%, 100.0000%, 100.0000%)\")]";
+
 static inline
 std::vector<skyline_t> get_top_systems_skyline(const pugi::xml_document& svg_file)
 {
-  return get_skylines(svg_file, "//g[(@color=\"rgb(25500.0000%, 0.0000%, 0.0000%)\") or (@color=\"rgb(25500.0%, 0.0%, 0.0%)\") or (@color=\"rgb(100.0000%, 0.0000%, 0.0000%)\")]");
+  return get_skylines(svg_file, top_systems_skyline_xpath);
 }
 
 static inline
 std::vector<skyline_t> get_bottom_systems_skyline(const pugi::xml_document& svg_file)
 {
-  return get_skylines(svg_file, "//g[(@color=\"rgb(0.0000%, 25500.0000%, 0.0000%)\") or (@color=\"rgb(0.0%, 25500.0%, 0.0%)\") or (@color=\"rgb(0.0000%, 100.0000%, 0.0000%)\")]");
+  return get_skylines(svg_file, bottom_systems_skyline_xpath);
 }
 
 static inline
 std::vector<skyline_t> get_top_staves_skyline(const pugi::xml_document& svg_file)
 {
-  return get_skylines(svg_file, "//g[(@color=\"rgb(25500.0000%, 0.0000%, 25500.0000%)\") or (@color=\"rgb(25500.0%, 0.0%, 25500.0%)\") or (@color=\"rgb(100.0000%, 0.0000%, 100.0000%)\")]");
+  return get_skylines(svg_file, top_staves_skyline_xpath);
 }
 
 static inline
 std::vector<skyline_t> get_bottom_staves_skyline(const pugi::xml_document& svg_file)
 {
-  return get_skylines(svg_file, "//g[(@color=\"rgb(0.0000%, 25500.0000%, 25500.0000%)\") or (@color=\"rgb(0.0%, 25500.0%, 25500.0%)\") or (@color=\"rgb(0.0000%, 100.0000%, 100.0000%)\")]");
+  return get_skylines(svg_file, bottom_staves_skyline_xpath);
 }
 
 static
@@ -447,7 +459,7 @@ unsigned int find_bottom_skyline_pos_of_staff(const rect_t& surface,
 
 // precondition svg_file is already parsed
 static
-std::vector<staff_t> get_staves(const pugi::xml_document& svg_file, std::ofstream& output_debug_file)
+std::vector<staff_t> get_staves(const pugi::xml_document& svg_file, std::ostream& output_debug_file)
 {
   const auto staves ( get_staves_surface(svg_file) );
   const auto top_skylines ( get_top_staves_skyline(svg_file) );
@@ -528,7 +540,7 @@ std::vector<staff_t> get_staves(const pugi::xml_document& svg_file, std::ofstrea
 static
 std::vector<system_t> get_systems(const pugi::xml_document& svg_file,
 				  const std::vector<staff_t>& staves,
-				  std::ofstream& output_debug_file)
+				  std::ostream& output_debug_file)
 {
   // sanity check: precondition staves must be sorted
   if (not std::is_sorted(staves.begin(), staves.end(), [] (const auto& a, const auto& b) {
@@ -721,27 +733,102 @@ std::vector<note_head_t> get_note_heads(const pugi::xml_document& svg_file)
 }
 
 
-svg_file_t get_svg_data(const fs::path& filename, std::ofstream& output_debug_file)
+// the note heads are wrapped in a 'g' node only because the event listener gave them an id. Without
+// the listener, lilypond outputs the note head directly in place of the 'g' node.
+static
+void remove_note_head_ids(pugi::xml_document& svg_file)
 {
-  pugi::xml_document doc;
-  // the parse_eol option replaces \r\n and single \r by \n
-  const auto parse_result = doc.load_file(filename.c_str(), pugi::parse_minimal | pugi::parse_eol);
+  for (const auto& xpath_node : svg_file.select_nodes("//g[@id]"))
+  {
+    auto group = xpath_node.node();
+    if (not begins_by(group.attribute("id").value(), "#x-width="))
+    {
+      continue;
+    }
+
+    auto parent = group.parent();
+    while (group.first_child())
+    {
+      parent.insert_move_before(group.first_child(), group);
+    }
+    parent.remove_child(group);
+  }
+}
+
+static
+void remove_skylines(pugi::xml_document& svg_file)
+{
+  for (const auto xpath_query : { top_systems_skyline_xpath,
+				  bottom_systems_skyline_xpath,
+				  top_staves_skyline_xpath,
+				  bottom_staves_skyline_xpath })
+  {
+    for (const auto& xpath_node : svg_file.select_nodes(xpath_query))
+    {
+      auto group = xpath_node.node();
+      auto parent = group.parent();
+
+      // the line break which ends the group goes with it
+      const auto next = group.next_sibling();
+      if ((next.type() == pugi::node_pcdata) and (std::strspn(next.value(), " \t\r\n") == std::strlen(next.value())))
+      {
+	parent.remove_child(next);
+      }
+      parent.remove_child(group);
+    }
+  }
+}
+
+static
+void save_svg(const pugi::xml_document& svg_file, const fs::path& filename)
+{
+  // the document is parsed without escape processing and with its own declaration, therefore it
+  // must be saved the same way to get the text back as it was.
+  const auto format = pugi::format_raw | pugi::format_no_escapes | pugi::format_no_declaration;
+  if (not svg_file.save_file(filename.c_str(), "", format))
+  {
+    throw std::runtime_error(std::string{"Error: failed to write `"} + filename.c_str() + "'");
+  }
+}
+
+static
+void load_svg(pugi::xml_document& doc, const fs::path& filename)
+{
+  // everything is kept (cdata, comments, whitespace, ...) so that the page saved again is the one
+  // lilypond wrote, without what is removed from it. Neither the escapes nor the whitespace of the
+  // attributes are converted, as they could not be written back the same.
+  const auto parse_options = (pugi::parse_full | pugi::parse_ws_pcdata) &
+    ~(pugi::parse_escapes | pugi::parse_wconv_attribute);
+  const auto parse_result = doc.load_file(filename.c_str(), parse_options);
   if (parse_result.status not_eq pugi::status_ok)
   {
     throw std::runtime_error(std::string{"Error: Failed to parse file `"} +
 			     filename.c_str() + "' ("
 			     + parse_result.description() + ")\n");
   }
+}
+
+svg_file_t get_svg_data(const fs::path& filename, const fs::path& clean_filename, const conversion_context& context)
+{
+  pugi::xml_document doc;
+  load_svg(doc, filename);
 
   try
   {
-    output_debug_file << "processing [" << filename.c_str() << "]\n";
-    auto staves = get_staves(doc, output_debug_file);
-    auto systems = get_systems(doc, staves, output_debug_file);
+    context.log() << "processing [" << filename.c_str() << "]\n";
+    auto staves = get_staves(doc, context.log());
+    auto systems = get_systems(doc, staves, context.log());
     auto note_heads = get_note_heads(doc);
 
+    // all the data is extracted, the page can now be cleaned up to look as it would have without
+    // the debug options.
+    remove_skylines(doc);
+    remove_note_head_ids(doc);
+    save_svg(doc, clean_filename);
+
     return svg_file_t{
       .filename = filename,
+      .clean_filename = clean_filename,
       .note_heads = std::move(note_heads),
       .systems = std::move(systems),
       .staves = std::move(staves),
@@ -753,3 +840,17 @@ svg_file_t get_svg_data(const fs::path& filename, std::ofstream& output_debug_fi
 			     e.what());
   }
 }
+
+bool have_same_content(const fs::path& svg_file_a, const fs::path& svg_file_b)
+{
+  std::ifstream file_a (svg_file_a.string(), std::ios::binary);
+  std::ifstream file_b (svg_file_b.string(), std::ios::binary);
+  if (not file_a or not file_b)
+  {
+    const auto& missing_file = file_a ? svg_file_b : svg_file_a;
+    throw std::runtime_error(std::string{"Error: failed to read `"} + missing_file.string() + "'");
+  }
+
+  return std::equal(std::istreambuf_iterator<char>(file_a), std::istreambuf_iterator<char>(),
+		    std::istreambuf_iterator<char>(file_b), std::istreambuf_iterator<char>());
+}
@@ -4,6 +4,7 @@
 #include <limits>
 #include <vector>
 #include <fstream>
+#include "conversion_context.hh"
 #include "utils.hh"
 
 // segments are used only to provide a full skyline.  Since a skyline
@@ -55,9 +56,15 @@ struct note_head_t
 struct svg_file_t
 {
     const fs::path filename;
+    const fs::path clean_filename; // same page, without the skylines and note ids
     std::vector<note_head_t> note_heads;
     std::vector<system_t> systems;
     std::vector<staff_t> staves;
 };
 
-svg_file_t get_svg_data(const fs::path& filename, std::ofstream& output_debug_file);
+// extracts the data from filename, a page generated with skylines and the event listener, and writes
+// into clean_filename the same page as lilypond would have rendered it without them.
+svg_file_t get_svg_data(const fs::path& filename, const fs::path& clean_filename, const conversion_context& context);
+
+// whether two svg files are the same, byte for byte.
+bool have_same_content(const fs::path& svg_file_a, const fs::path& svg_file_b);
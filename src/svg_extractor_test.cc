@@ -0,0 +1,36 @@
+#include <fstream>
+#include "svg_extractor.hh"
+#include "unit_test.hh"
+
+static
+fs::path write_file(const fs::path& filename, const std::string& content)
+{
+  std::ofstream file (filename.string(), std::ios::binary);
+  file << content;
+  return filename;
+}
+
+static
+void test_have_same_content()
+{
+  const test_directory directory;
+  const auto& dir = directory.path();
+  const auto page = write_file(dir / "page.svg", "<svg>\n<![CDATA[a]]>\n<!-- b -->\n</svg>\n");
+  const auto same_page = write_file(dir / "same_page.svg", "<svg>\n<![CDATA[a]]>\n<!-- b -->\n</svg>\n");
+  const auto other_cdata = write_file(dir / "other_cdata.svg", "<svg>\n<![CDATA[c]]>\n<!-- b -->\n</svg>\n");
+  const auto other_comment = write_file(dir / "other_comment.svg", "<svg>\n<![CDATA[a]]>\n<!-- c -->\n</svg>\n");
+  const auto other_spaces = write_file(dir / "other_spaces.svg", "<svg>\n<![CDATA[a]]>\n<!-- b -->\n\n</svg>\n");
+
+  CHECK(have_same_content(page, same_page));
+  CHECK(not have_same_content(page, other_cdata));
+  CHECK(not have_same_content(page, other_comment));
+  CHECK(not have_same_content(page, other_spaces));
+  CHECK(not have_same_content(page, write_file(dir / "shorter.svg", "<svg>\n")));
+  CHECK_THROWS(have_same_content(page, dir / "missing.svg"));
+}
+
+int main()
+{
+  test_have_same_content();
+  return test_result();
+}
@@ -0,0 +1,157 @@
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <array>
+#include <stdexcept>
+#include "svg_pages_extractor.hh"
+
+// how often the watching thread checks whether lilypond exited
+constexpr int finish_check_interval_ms = 50;
+
+// lilypond writes each page once, and closes it when it is complete
+constexpr uint32_t watched_events = IN_CLOSE_WRITE | IN_MOVED_TO;
+
+static
+int watch_directory(const fs::path& directory)
+{
+  const auto fd = ::inotify_init1(IN_CLOEXEC);
+  if (fd == -1)
+  {
+    throw std::runtime_error(std::string{"Error: failed to initialize inotify ("} + strerror(errno) + ")");
+  }
+
+  if (::inotify_add_watch(fd, directory.c_str(), watched_events) == -1)
+  {
+    const auto error = errno;
+    ::close(fd);
+    throw std::runtime_error(std::string{"Error: failed to watch '"} + directory.string() + "' (" + strerror(error) + ")");
+  }
+
+  return fd;
+}
+
+static
+bool is_page(const fs::path& file)
+{
+  return file.extension() == ".svg";
+}
+
+svg_pages_extractor::svg_pages_extractor(const fs::path& directory,
+					 const std::string& suffix,
+					 const std::string& clean_suffix,
+					 const conversion_context& context,
+					 const page_listener& listener)
+  : _directory(directory)
+  , _suffix(suffix)
+  , _clean_suffix(clean_suffix)
+  , _inotify_fd(watch_directory(directory))
+  , _finished(false)
+  , _pages()
+  , _error()
+  , _log()
+  , _context(context.with_log(_log))
+  , _listener(listener)
+  , _thread([this] () { watch(); })
+{
+}
+
+svg_pages_extractor::~svg_pages_extractor()
+{
+  _finished = true;
+  if (_thread.joinable())
+  {
+    _thread.join();
+  }
+  ::close(_inotify_fd);
+}
+
+void svg_pages_extractor::extract_page(const fs::path& page)
+{
+  // after an error, the conversion fails anyway
+  if (_error)
+  {
+    return;
+  }
+
+  try
+  {
+    auto new_name = page;
+    new_name += _suffix;
+    auto clean_name = page;
+    clean_name += _clean_suffix;
+
+    fs::rename(page, new_name);
+    const auto extracted = _pages.emplace(new_name, get_svg_data(new_name, clean_name, _context));
+    if (_listener)
+    {
+      _listener(new_name, extracted.first->second);
+    }
+  }
+  catch (...)
+  {
+    _error = std::current_exception();
+  }
+}
+
+void svg_pages_extractor::watch()
+{
+  while (not _finished)
+  {
+    struct pollfd poll_fd {};
+    poll_fd.fd = _inotify_fd;
+    poll_fd.events = POLLIN;
+
+    if (::poll(&poll_fd, 1, finish_check_interval_ms) <= 0)
+    {
+      continue;
+    }
+
+    // inotify events are aligned like this structure, and a read gives whole events only
+    alignas(inotify_event) std::array<char, 4096> buffer;
+    const auto nb_read = ::read(_inotify_fd, buffer.data(), buffer.size());
+    for (ssize_t pos = 0; pos < nb_read; )
+    {
+      const auto* event = reinterpret_cast<const inotify_event*>(buffer.data() + pos);
+      pos += static_cast<ssize_t>(sizeof(inotify_event) + event->len);
+
+      if (event->len > 0)
+      {
+	const auto page = _directory / event->name;
+	if (is_page(page) and fs::is_regular_file(page))
+	{
+	  extract_page(page);
+	}
+      }
+    }
+  }
+}
+
+std::map<fs::path, svg_file_t> svg_pages_extractor::finish(std::ostream& output_debug_file)
+{
+  _finished = true;
+  _thread.join();
+
+  // the pages written just before lilypond exited, whose events were not read yet
+  std::vector<fs::path> remaining_pages;
+  for (const auto& file : fs::directory_iterator(_directory))
+  {
+    if (is_page(file.path()) and fs::is_regular_file(file.path()))
+    {
+      remaining_pages.push_back(file.path());
+    }
+  }
+
+  for (const auto& page : remaining_pages)
+  {
+    extract_page(page);
+  }
+
+  output_debug_file << _log.str();
+  if (_error)
+  {
+    std::rethrow_exception(_error);
+  }
+
+  return std::move(_pages);
+}
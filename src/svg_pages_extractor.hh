@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include "svg_extractor.hh"
+#include "utils.hh"
+
+// extracts the pages lilypond writes into a directory while it is still rendering the next ones, so
+// that most of the pages of a long music sheet are done when lilypond exits. The pages are noticed
+// with inotify when lilypond closes them.
+//
+// Each page <name>.svg is renamed <name>.svg<suffix> once written, and its clean version is saved as
+// <name>.svg<clean_suffix> (see get_svg_data).
+class svg_pages_extractor
+{
+  public:
+    // called with each page once it is extracted, by its new name, from the thread watching the
+    // directory, or from finish
+    using page_listener = std::function<void(const fs::path& page, const svg_file_t& data)>;
+
+    // the directory must exist, and be the output directory of a single lilypond run. context is the
+    // one of the conversion, whose log is only written by finish.
+    svg_pages_extractor(const fs::path& directory,
+			const std::string& suffix,
+			const std::string& clean_suffix,
+			const conversion_context& context,
+			const page_listener& listener = {});
+    ~svg_pages_extractor();
+
+    svg_pages_extractor(const svg_pages_extractor&) = delete;
+    svg_pages_extractor& operator=(const svg_pages_extractor&) = delete;
+
+    // to call once lilypond exited successfully. Extracts the pages not noticed yet, and gives all
+    // of them by their new name, or throws the first error met.
+    std::map<fs::path, svg_file_t> finish(std::ostream& output_debug_file);
+
+  private:
+    void watch();
+    void extract_page(const fs::path& page);
+
+    const fs::path _directory;
+    const std::string _suffix;
+    const std::string _clean_suffix;
+    const int _inotify_fd;
+
+    std::atomic<bool> _finished;
+    std::map<fs::path, svg_file_t> _pages;
+    std::exception_ptr _error;
+    std::ostringstream _log; // the log stream of the conversion isn't thread safe
+    const conversion_context _context; // the conversion's, with _log
+    const page_listener _listener; // empty when nobody listens
+    std::thread _thread; // last, it starts once the members above are initialized
+};
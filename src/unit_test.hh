@@ -0,0 +1,82 @@
+#pragma once
+
+#include <iostream>
+#include <stdexcept>
+#include "utils.hh"
+
+// The unit tests are programs of their own, named after the source they test (see `make check`).
+// Each one checks what it has to with CHECK and CHECK_THROWS, and ends with `return test_result();`,
+// which tells how many checks failed and gives the exit status.
+
+inline
+unsigned int& nb_failed_checks()
+{
+  static unsigned int res = 0;
+  return res;
+}
+
+inline
+void check(bool condition, const char* const text, const char* const file, int line)
+{
+  if (not condition)
+  {
+    std::cerr << file << ":" << line << ": check failed: " << text << std::endl;
+    ++nb_failed_checks();
+  }
+}
+
+template <typename F>
+bool throws(F function)
+{
+  try
+  {
+    function();
+  }
+  catch (const std::exception&)
+  {
+    return true;
+  }
+  return false;
+}
+
+#define CHECK(condition) check((condition), #condition, __FILE__, __LINE__)
+#define CHECK_THROWS(expression) check(throws([&] () { expression; }), #expression " throws", \
+				       __FILE__, __LINE__)
+
+inline
+int test_result()
+{
+  if (nb_failed_checks() != 0)
+  {
+    std::cerr << nb_failed_checks() << " check(s) failed" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// a temporary directory for the files of a test, removed with what it holds once the test is done
+class test_directory
+{
+  public:
+    test_directory()
+      : _path(get_temp_dir(false))
+    {
+    }
+
+    ~test_directory()
+    {
+      std::error_code error;
+      fs::remove_all(_path, error);
+    }
+
+    test_directory(const test_directory&) = delete;
+    test_directory& operator=(const test_directory&) = delete;
+
+    const fs::path& path() const
+    {
+      return _path;
+    }
+
+  private:
+    const fs::path _path;
+};
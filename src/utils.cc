@@ -1,3 +1,6 @@
+#include <linux/magic.h>
+#include <sys/vfs.h>
+#include <unistd.h>
 #include <stdlib.h>
 #include <cstring>
 #include <stdexcept>
@@ -5,10 +8,6 @@
 #include <iostream>
 #include "utils.hh"
 
-extern bool enable_debug_dump;
-extern const char * debug_data_dir;
-
-
 // this function takes an id string, and return the value for the requested field
 // throw in the field could not be found.
 // an id string is a string made of field=value separated by the '#' symbol.
@@ -41,118 +40,37 @@ std::string get_value_from_field(const std::string& id_str, const char* const fi
 }
 
 static
-fs::path get_debug_filename_full_path(const char* const out_filename)
+bool is_memory_backed(const fs::path& dir)
 {
-  if (debug_data_dir == nullptr)
-  {
-    throw std::runtime_error("Error: directory to output debug data is unset (nullptr)");
-  }
-
-  return fs::path(std::string{debug_data_dir} + "/" + out_filename);
-}
-
-void debug_dump(const std::vector<note_t>& song, const char* const out_filename)
-{
-  const auto out_file = get_debug_filename_full_path(out_filename);
-
-  std::ofstream file(out_file,
-		     std::ios::binary | std::ios::trunc | std::ios::out);
-
-  if (not file.is_open())
-  {
-    std::cerr << "Error: could not open " << out_file << " for writing.\n";
-    return;
-  }
-
-  for (const auto& event : song)
-  {
-      file << event.start_time << "\n";
-  }
-
+  struct statfs stats;
+  return (::statfs(dir.c_str(), &stats) == 0) and (stats.f_type == TMPFS_MAGIC) and (::access(dir.c_str(), W_OK) == 0);
 }
 
-
-void debug_dump(const std::vector<key_event>& song, const char* const out_filename)
-{
-  const auto out_file = get_debug_filename_full_path(out_filename);
-
-  std::ofstream file(out_file,
-		     std::ios::binary | std::ios::trunc | std::ios::out);
-
-  if (not file.is_open())
-  {
-    std::cerr << "Error: could not open " << out_file << " for writing.\n";
-    return;
-  }
-
-  for (const auto& event : song)
-  {
-    if (event.data.ev_type == key_data::pressed)
-    {
-      file << event.time << " down " << static_cast<int>(event.data.pitch) << "\n";
-    }
-
-    if (event.data.ev_type == key_data::released)
-    {
-      file << event.time << " up " << static_cast<int>(event.data.pitch) << "\n";
-    }
-
-  }
-
-}
-
-
-void debug_dump(const std::vector<chord_t>& chords, const char* const out_filename)
+// the temporary directory of the system when it is in memory, then the usual memory backed ones
+static
+fs::path get_system_temp_dir(bool memory_backed)
 {
-  const auto out_file = get_debug_filename_full_path(out_filename);
-
-  std::ofstream file(out_file,
-		     std::ios::binary | std::ios::trunc | std::ios::out);
-
-  if (not file.is_open())
+  const auto system_dir = fs::temp_directory_path();
+  if (not memory_backed)
   {
-    std::cerr << "Error: could not open " << out_file << " for writing.\n";
-    return;
+    return system_dir;
   }
 
-  for (const auto& chord : chords)
+  const char* const runtime_dir = ::getenv("XDG_RUNTIME_DIR");
+  for (const auto& dir : { system_dir, fs::path{"/dev/shm"}, fs::path{runtime_dir == nullptr ? "" : runtime_dir} })
   {
-    const auto start_time = chord.notes[0].start_time;
-    file << start_time;
-
-    for (const auto& note : chord.notes)
+    if ((not dir.empty()) and is_memory_backed(dir))
     {
-      file << "\n  " << static_cast<int>(note.pitch) << " -> " << note.stop_time;
+      return dir;
     }
-
-    file << "\n\n";
-  }
-}
-
-
-void debug_dump(const std::vector<std::string>& strings, const char* const out_filename)
-{
-  const auto out_file = get_debug_filename_full_path(out_filename);
-
-  std::ofstream file(out_file,
-		     std::ios::binary | std::ios::trunc | std::ios::out);
-
-  if (not file.is_open())
-  {
-    std::cerr << "Error: could not open " << out_file << " for writing.\n";
-    return;
-  }
-
-  for (const auto& string : strings)
-  {
-    file << string << "\n";
   }
 
+  return system_dir;
 }
 
-fs::path get_temp_dir()
+fs::path get_temp_dir(bool memory_backed)
 {
-  const auto sys_temp_dir = fs::temp_directory_path() /= "lilydumper_XXXXXX";
+  const auto sys_temp_dir = get_system_temp_dir(memory_backed) /= "lilydumper_XXXXXX";
 
   // TODO: rework this when compilers will support C++17. std::string::data() returns a pointer to non-const data
   // in C++17, so one can just pass path_to_dir.data() to mkdtemp instead of creating a useless copy.
@@ -8,7 +8,9 @@ std::string get_value_from_field(const std::string& id_str, const char* const fi
 
 namespace fs = std::experimental::filesystem;
 
-fs::path get_temp_dir();
+// memory_backed prefers a tmpfs (/dev/shm, $XDG_RUNTIME_DIR), so that the intermediate files never
+// reach the disk
+fs::path get_temp_dir(bool memory_backed);
 
 
 #define OCTAVE(X) \
@@ -87,8 +89,3 @@ struct chord_t
     // a chord are just notes played at the same time
     std::vector<note_t> notes;
 };
-
-void debug_dump(const std::vector<key_event>& song, const char* const out_filename);
-void debug_dump(const std::vector<note_t>& song, const char* const out_filename);
-void debug_dump(const std::vector<chord_t>& chord, const char* const out_filename);
-void debug_dump(const std::vector<std::string>& strings, const char* const out_filename);